@@ -1,24 +1,213 @@
-;; kernel.asm
-bits 32         ; nasm directive - 32 bit
-global entry
-extern _kmain   ; kmain is defined in the c file
-
-section .text
-entry:  
-    jmp start
-
-    ; multiboot spec
-    align 4
-    dd 0x1BADB002            ; magic
-    dd 0x00                  ; flags
-    dd -(0x1BADB002 + 0x00)  ; checksum. m+f+c should be zero
-
-start:
-    cli                     ; block interrupts
-    mov esp, stack_space    ; set stack pointer
-    call _kmain
-    hlt                     ; halt the CPU
-
-section .bss
-resb 8192                 ; 8KB for stack
-stack_space:
+;; kernel.asm
+bits 32         ; nasm directive - 32 bit
+global entry
+global _isr_stub_table
+global _stack_guard
+global _ap_trampoline
+global _ap_params
+global _ap_trampoline_end
+extern _kmain   ; kmain is defined in the c file
+extern _isr_handler
+extern _switch_finish
+extern _ap_main
+
+section .text
+entry:
+    jmp start
+
+    ; multiboot spec
+    align 4
+    dd 0x1BADB002            ; magic
+    dd 0x03                  ; flags: page-align modules, provide memory map
+    dd -(0x1BADB002 + 0x03)  ; checksum. m+f+c should be zero
+
+start:
+    cli                     ; block interrupts
+    mov esp, stack_space    ; set stack pointer
+    push ebx                ; multiboot info pointer
+    push eax                ; multiboot magic
+    call _kmain
+    hlt                     ; halt the CPU
+
+; Interrupt entry stubs. Each one pushes a dummy error code when the CPU
+; does not supply one, then the vector number, so isr_common always sees
+; the same frame layout (InterruptFrame in kernel.c).
+%macro ISR_NOERR 1
+isr%1:
+    push dword 0
+    push dword %1
+    jmp isr_common
+%endmacro
+
+%macro ISR_ERR 1
+isr%1:
+    push dword %1
+    jmp isr_common
+%endmacro
+
+ISR_NOERR 0
+ISR_NOERR 1
+ISR_NOERR 2
+ISR_NOERR 3
+ISR_NOERR 4
+ISR_NOERR 5
+ISR_NOERR 6
+ISR_NOERR 7
+ISR_ERR   8
+ISR_NOERR 9
+ISR_ERR   10
+ISR_ERR   11
+ISR_ERR   12
+ISR_ERR   13
+ISR_ERR   14
+ISR_NOERR 15
+ISR_NOERR 16
+ISR_ERR   17
+ISR_NOERR 18
+ISR_NOERR 19
+ISR_NOERR 20
+ISR_ERR   21
+ISR_NOERR 22
+ISR_NOERR 23
+ISR_NOERR 24
+ISR_NOERR 25
+ISR_NOERR 26
+ISR_NOERR 27
+ISR_NOERR 28
+ISR_ERR   29
+ISR_ERR   30
+ISR_NOERR 31
+
+; IRQ0-15, remapped by pic_remap() to vectors 32-47
+ISR_NOERR 32
+ISR_NOERR 33
+ISR_NOERR 34
+ISR_NOERR 35
+ISR_NOERR 36
+ISR_NOERR 37
+ISR_NOERR 38
+ISR_NOERR 39
+ISR_NOERR 40
+ISR_NOERR 41
+ISR_NOERR 42
+ISR_NOERR 43
+ISR_NOERR 44
+ISR_NOERR 45
+ISR_NOERR 46
+ISR_NOERR 47
+
+; Software interrupt for a voluntary context switch, see thread_yield(),
+; then the local APIC vectors (timer, kick IPI, spurious at 63)
+ISR_NOERR 48
+ISR_NOERR 49
+ISR_NOERR 50
+ISR_NOERR 51
+ISR_NOERR 52
+ISR_NOERR 53
+ISR_NOERR 54
+ISR_NOERR 55
+ISR_NOERR 56
+ISR_NOERR 57
+ISR_NOERR 58
+ISR_NOERR 59
+ISR_NOERR 60
+ISR_NOERR 61
+ISR_NOERR 62
+ISR_NOERR 63
+
+isr_common:
+    pusha
+    push ds
+    push es
+    push fs
+    push gs
+    mov ax, 0x10            ; kernel data selector
+    mov ds, ax
+    mov es, ax
+    cld
+    push esp                ; InterruptFrame *
+    call _isr_handler
+    mov esp, eax            ; Frame to resume: this one, or another thread's
+    call _switch_finish     ; The old thread's stack is free for other CPUs now
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    popa
+    add esp, 8              ; drop vector number and error code
+    iret
+
+; Application processor start-up. smp_init() copies this to AP_TRAMPOLINE
+; below 1 MB and fills in the parameters at its end; the SIPI starts an
+; AP here in real mode. It switches to protected mode with a temporary
+; GDT, turns paging on like the boot CPU and calls ap_main(cpu) on the
+; stack it was given.
+AP_TRAMPOLINE equ 0x8000
+%define AP_ADDRESS(label) (AP_TRAMPOLINE + (label) - _ap_trampoline)
+
+bits 16
+_ap_trampoline:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [AP_ADDRESS(ap_gdt_pointer)]
+    mov eax, cr0
+    or eax, 1               ; PE
+    mov cr0, eax
+    jmp dword 0x08:AP_ADDRESS(ap_protected)
+
+bits 32
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    mov eax, [AP_ADDRESS(ap_cr4)]
+    mov cr4, eax
+    mov eax, [AP_ADDRESS(ap_cr3)]
+    mov cr3, eax
+    mov eax, [AP_ADDRESS(ap_cr0)]
+    mov cr0, eax
+    mov esp, [AP_ADDRESS(ap_stack)]
+    push dword [AP_ADDRESS(ap_cpu)]
+    mov eax, _ap_main       ; Absolute: the kernel is not where this copy runs
+    call eax
+    hlt                     ; ap_main() never returns
+
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF   ; Flat code, like the kernel's
+    dq 0x00CF92000000FFFF   ; Flat data
+ap_gdt_pointer:
+    dw ap_gdt_pointer - ap_gdt - 1
+    dd AP_ADDRESS(ap_gdt)
+
+align 4
+_ap_params:               ; ApParams in kernel.c
+ap_cr0: dd 0
+ap_cr3: dd 0
+ap_cr4: dd 0
+ap_stack: dd 0
+ap_cpu: dd 0
+_ap_trampoline_end:
+
+section .data
+_isr_stub_table:
+    dd isr0, isr1, isr2, isr3, isr4, isr5, isr6, isr7
+    dd isr8, isr9, isr10, isr11, isr12, isr13, isr14, isr15
+    dd isr16, isr17, isr18, isr19, isr20, isr21, isr22, isr23
+    dd isr24, isr25, isr26, isr27, isr28, isr29, isr30, isr31
+    dd isr32, isr33, isr34, isr35, isr36, isr37, isr38, isr39
+    dd isr40, isr41, isr42, isr43, isr44, isr45, isr46, isr47
+    dd isr48, isr49, isr50, isr51, isr52, isr53, isr54, isr55
+    dd isr56, isr57, isr58, isr59, isr60, isr61, isr62, isr63
+
+section .bss align=4096
+_stack_guard:             ; unmapped by paging_init(): an overflow faults here
+resb 4096
+resb 16384                ; 16KB for stack
+stack_space:
@@ -1,965 +1,6222 @@
-#include <stdbool.h>
-#include <stddef.h>
-#include <stdint.h>
-
-// Constants
-#define VIDEO_MEMORY 0xb8000
-#define WHITE_ON_BLUE 0x1F
-#define SCREEN_WIDTH 80
-#define SCREEN_HEIGHT 25
-#define KEYBOARD_DATA_PORT 0x60
-#define KEYBOARD_STATUS_PORT 0x64
-#define BACKSPACE_SCANCODE 0x0E
-#define DELETE_SCANCODE 0x53
-#define MAX_VARS 10
-#define VAR_NAME_LEN 32
-#define VAR_VALUE_LEN 32
-#define MAX_HISTORY 1000
-
-uint16_t screen_history[MAX_HISTORY][SCREEN_WIDTH]; // Buffer for storing history
-size_t history_count = 0; // Number of stored lines
-// Globals
-typedef struct {
-    char name[VAR_NAME_LEN];
-    char value[VAR_VALUE_LEN];
-} Variable;
-
-Variable variables[MAX_VARS];
-size_t var_count = 0;
-static char input_buffer[256];
-static size_t input_index = 0;
-static uint16_t cursor_pos = 0;
-static uint8_t text_color = 0xF;  // Default: white
-static uint8_t text_color1 = 0xF;  // Default: white
-static uint8_t bg_color = 0x1;   // Default: blue
-static char splash_screen[80] = "Welcome to DubrDos!"; // Default splash screen
-// Function Prototypes
-void init_system(void);
-void clear_screen(void);
-void display_text(const char *text, uint16_t row, uint16_t col);
-void handle_keyboard(void);
-void update_cursor(uint16_t position);
-void process_input(void);
-void print_char(char c);
-void set_splash(const char *new_splash);
-void create_variable(const char *name, const char *value);
-char *get_variable_value(const char *name);
-void print_color_text(const char *text, const char *color_name);
-void set_color_splash(const char *color_name);
-uint16_t get_cursor_row(void);
-uint16_t get_cursor_col(void);
-void execute_command(const char *command);
-int color_code_from_name(const char *name);
-
-// I/O Port Access Functions
-static inline void outb(uint16_t port, uint8_t value) {
-    __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
-}
-
-static inline uint8_t inb(uint16_t port) {
-    uint8_t ret;
-    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
-    return ret;
-}
-int atoi(const char *str) {
-    int result = 0;
-    int sign = 1;
-
-    // Handle negative numbers
-    if (*str == '-') {
-        sign = -1;
-        str++;
-    }
-
-    // Convert characters to integers
-    while (*str) {
-        if (*str < '0' || *str > '9') {
-            break; // Stop on non-digit character
-        }
-        result = result * 10 + (*str - '0');
-        str++;
-    }
-
-    return sign * result;
-}
-// Custom implementation of strncpy
-char *strncpy(char *dest, const char *src, size_t n) {
-    size_t i;
-    for (i = 0; i < n && src[i] != '\0'; i++) {
-        dest[i] = src[i];
-    }
-    for (; i < n; i++) {
-        dest[i] = '\0';
-    }
-    return dest;
-}
-
-// Custom implementation of strlen
-size_t strlen(const char *str) {
-    size_t len = 0;
-    while (str[len] != '\0') {
-        len++;
-    }
-    return len;
-}
-
-int strcmp(const char *str1, const char *str2) {
-    while (*str1 && (*str1 == *str2)) {
-        str1++;
-        str2++;
-    }
-    return *(unsigned char *)str1 - *(unsigned char *)str2;
-}
-int strncmp(const char *str1, const char *str2, size_t n) {
-    while (n > 0 && *str1 && (*str1 == *str2)) {
-        str1++;
-        str2++;
-        n--;
-    }
-    if (n == 0) {
-        return 0;
-    }
-    return *(unsigned char *)str1 - *(unsigned char *)str2;
-}
-char *strtok(char *str, const char *delim) {
-    static char *next_token = NULL;
-    if (str == NULL) {
-        str = next_token;
-    }
-    if (str == NULL) {
-        return NULL;
-    }
-
-    // Skip leading delimiters
-    while (*str && strchr(delim, *str)) {
-        str++;
-    }
-    if (*str == '\0') {
-        return NULL;
-    }
-
-    // Find the end of the token
-    char *token_start = str;
-    while (*str && !strchr(delim, *str)) {
-        str++;
-    }
-
-    if (*str) {
-        *str = '\0';
-        next_token = str + 1;
-    } else {
-        next_token = NULL;
-    }
-
-    return token_start;
-}
-char *strchr(const char *str, int c) {
-    while (*str) {
-        if (*str == (char)c) {
-            return (char *)str;
-        }
-        str++;
-    }
-    return NULL;
-}
-
-void itoa(int value, char *str, int base) {
-    char *digits = "0123456789ABCDEF";
-    char buffer[32];
-    int i = 0, is_negative = 0;
-
-    // Handle negative numbers for base 10
-    if (value < 0 && base == 10) {
-        is_negative = 1;
-        value = -value;
-    }
-
-    // Convert the number to the given base
-    do {
-        buffer[i++] = digits[value % base];
-        value /= base;
-    } while (value > 0);
-
-    // Add the negative sign if necessary
-    if (is_negative) {
-        buffer[i++] = '-';
-    }
-
-    // Reverse the string into the output buffer
-    int j = 0;
-    while (i > 0) {
-        str[j++] = buffer[--i];
-    }
-    str[j] = '\0';
-}
-
-void snprintf(char *str, size_t size, const char *format, const char *str_value, int int_value) {
-    const char *p = format;
-    char *out = str;
-
-    while (*p && (out - str) < (size - 1)) {
-        if (*p == '%' && *(p + 1) == 's') {
-            // Handle string
-            const char *s = str_value;
-            while (*s && (out - str) < (size - 1)) {
-                *out++ = *s++;
-            }
-            p += 2; // Skip %s
-        } else if (*p == '%' && *(p + 1) == 'd') {
-            // Handle integer
-            char num_buffer[32];
-            itoa(int_value, num_buffer, 10);
-            for (char *q = num_buffer; *q && (out - str) < (size - 1); q++) {
-                *out++ = *q;
-            }
-            p += 2; // Skip %d
-        } else {
-            *out++ = *p++;
-        }
-    }
-    *out = '\0'; // Null-terminate the string
-}
-
-
-void clear_screen(void) {
-    uint16_t *video_memory = (uint16_t *)VIDEO_MEMORY;
-    uint16_t blank = ' ' | ((text_color | (bg_color << 4)) << 8);
-    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
-        video_memory[i] = blank;
-    }
-    cursor_pos = 3 * SCREEN_WIDTH; // Start input on line 3
-    update_cursor(cursor_pos);
-}
-
-void display_text(const char *text, uint16_t row, uint16_t col) {
-    uint16_t *video_memory = (uint16_t *)VIDEO_MEMORY;
-    uint16_t offset = row * SCREEN_WIDTH + col;
-    while (*text) {
-        video_memory[offset++] = *text | ((text_color | (bg_color << 4)) << 8);
-        text++;
-    }
-}
-// Function to set a new splash screen
-void set_splash(const char *new_splash) {
-    strncpy(splash_screen, new_splash, sizeof(splash_screen) - 1);
-    splash_screen[sizeof(splash_screen) - 1] = '\0'; // Ensure null termination
-    display_text("Splash updated!", get_cursor_row(), 0);
-}
-// Print a single character to the screen at the current cursor position
-void print_char(char c) {
-    uint16_t *video_memory = (uint16_t *)VIDEO_MEMORY;
-
-    if (c == '\n') {
-        cursor_pos = (cursor_pos / SCREEN_WIDTH + 1) * SCREEN_WIDTH; // Move to the next row
-    } else {
-        video_memory[cursor_pos] = c | ((text_color | (bg_color << 4)) << 8);
-        cursor_pos++; // Move cursor forward
-    }
-
-    // Prevent cursor from going out of screen bounds
-    if (cursor_pos >= SCREEN_WIDTH * SCREEN_HEIGHT) {
-        scroll_screen();
-        cursor_pos -= SCREEN_WIDTH;
-    }
-
-    update_cursor(cursor_pos);
-}
-
-void scroll_screen(void) {
-    uint16_t *video_memory = (uint16_t *)VIDEO_MEMORY;
-
-    // Save the topmost line before it scrolls off
-    if (history_count < MAX_HISTORY) {
-        memcpy(screen_history[history_count], video_memory, SCREEN_WIDTH * sizeof(uint16_t));
-        history_count++;
-    }
-
-    // Move lines up
-    for (int i = 0; i < (SCREEN_HEIGHT - 1) * SCREEN_WIDTH; i++) {
-        video_memory[i] = video_memory[i + SCREEN_WIDTH];
-    }
-
-    // Clear the last line
-    for (int i = (SCREEN_HEIGHT - 1) * SCREEN_WIDTH; i < SCREEN_HEIGHT * SCREEN_WIDTH; i++) {
-        video_memory[i] = ' ' | (WHITE_ON_BLUE << 8);
-    }
-
-    cursor_pos -= SCREEN_WIDTH; // Adjust cursor
-    update_cursor(cursor_pos);
-}
-// Update the hardware cursor position
-void update_cursor(uint16_t position) {
-    outb(0x3D4, 0x0F);
-    outb(0x3D5, (uint8_t)(position & 0xFF));
-    outb(0x3D4, 0x0E);
-    outb(0x3D5, (uint8_t)((position >> 8) & 0xFF));
-}
-
-// Get the current cursor row
-uint16_t get_cursor_row(void) {
-    return cursor_pos / SCREEN_WIDTH;
-}
-
-// Get the current cursor column
-uint16_t get_cursor_col(void) {
-    return cursor_pos % SCREEN_WIDTH;
-}
-
-void scroll_screen_up(void) {
-    uint16_t *video_memory = (uint16_t *)VIDEO_MEMORY;
-
-    if (history_count > 0) {
-        // Move lines down
-        for (int i = (SCREEN_HEIGHT - 1) * SCREEN_WIDTH; i >= SCREEN_WIDTH; i--) {
-            video_memory[i] = video_memory[i - SCREEN_WIDTH];
-        }
-
-        // Restore the last stored line
-        history_count--;
-        memcpy(video_memory, screen_history[history_count], SCREEN_WIDTH * sizeof(uint16_t));
-
-        cursor_pos += SCREEN_WIDTH;
-        update_cursor(cursor_pos);
-    }
-}
-void *memcpy(void *dest, const void *src, size_t n) {
-    char *d = (char *)dest;
-    const char *s = (const char *)src;
-    for (size_t i = 0; i < n; i++) {
-        d[i] = s[i];
-    }
-    return dest;
-}
-
-
-void handle_keyboard(void) {
-    if ((inb(KEYBOARD_STATUS_PORT) & 0x01) == 0) {
-        return;
-    }
-
-    uint8_t scancode = inb(KEYBOARD_DATA_PORT);
-
-    if (scancode & 0x80) {
-        return; // Игнорируем отпускание клавиши
-    }
-
-    char key = '\0';
-
-    switch (scancode) {
-        case 0x48: // Up arrow
-            if (get_cursor_row() > 0) {
-                cursor_pos -= SCREEN_WIDTH;
-                update_cursor(cursor_pos);
-            } else {
-                scroll_screen_up(); // Restore previous lines
-            }
-            return;
-
-        case 0x50: // Down arrow
-            if (get_cursor_row() < SCREEN_HEIGHT - 1) {
-                cursor_pos += SCREEN_WIDTH;
-                update_cursor(cursor_pos);
-            } else {
-                scroll_screen();  // Scroll normally
-            }
-            return;
-        case 0x4B: // Влево
-            if (get_cursor_col() > 0) {
-                cursor_pos--;
-                update_cursor(cursor_pos);
-            }
-            return;
-        case 0x4D: // Вправо
-            if (get_cursor_col() < SCREEN_WIDTH - 1) {
-                cursor_pos++;
-                update_cursor(cursor_pos);
-            }
-            return;
-        case BACKSPACE_SCANCODE: // Backspace
-            if (input_index > 0) {
-                input_index--;
-                cursor_pos--;
-                uint16_t *video_memory = (uint16_t *)VIDEO_MEMORY;
-                video_memory[cursor_pos] = ' ' | (WHITE_ON_BLUE << 8); // Clear character
-                update_cursor(cursor_pos);
-            }
-            return;
-
-        case DELETE_SCANCODE: // Delete
-            if (cursor_pos < SCREEN_WIDTH * SCREEN_HEIGHT) {
-                uint16_t *video_memory = (uint16_t *)VIDEO_MEMORY;
-                video_memory[cursor_pos] = ' ' | (WHITE_ON_BLUE << 8); // Clear character
-            }
-            return;
-
-        // Ввод символов, включая специальные
-        case 0x1C: key = '\n'; break; // Enter
-        case 0x39: key = ' '; break;  // Пробел
-        case 0x02: key = '1'; break;
-        case 0x03: key = '2'; break;
-        case 0x04: key = '3'; break;
-        case 0x05: key = '4'; break;
-        case 0x06: key = '5'; break;
-        case 0x07: key = '6'; break;
-        case 0x08: key = '7'; break;
-        case 0x09: key = '8'; break;
-        case 0x0A: key = '9'; break;
-        case 0x0B: key = '0'; break;
-        case 0x10: key = 'q'; break;
-        case 0x11: key = 'w'; break;
-        case 0x12: key = 'e'; break;
-        case 0x13: key = 'r'; break;
-        case 0x14: key = 't'; break;
-        case 0x15: key = 'y'; break;
-        case 0x16: key = 'u'; break;
-        case 0x17: key = 'i'; break;
-        case 0x18: key = 'o'; break;
-        case 0x19: key = 'p'; break;
-        case 0x1E: key = 'a'; break;
-        case 0x1F: key = 's'; break;
-        case 0x20: key = 'd'; break;
-        case 0x21: key = 'f'; break;
-        case 0x22: key = 'g'; break;
-        case 0x23: key = 'h'; break;
-        case 0x24: key = 'j'; break;
-        case 0x25: key = 'k'; break;
-        case 0x26: key = 'l'; break;
-        case 0x2C: key = 'z'; break;
-        case 0x2D: key = 'x'; break;
-        case 0x2E: key = 'c'; break;
-        case 0x2F: key = 'v'; break;
-        case 0x30: key = 'b'; break;
-        case 0x31: key = 'n'; break;
-        case 0x32: key = 'm'; break;
-
-        case 0x0C: key = '-'; break;  // '-' key
-        case 0x0D: key = '='; break;  // '=' key
-        case 0x1A: key = '['; break;
-        case 0x1B: key = ']'; break;
-        case 0x2B: key = '\\'; break;
-        case 0x27: key = ';'; break;
-        case 0x28: key = '\''; break;
-        case 0x33: key = ','; break;
-        case 0x34: key = '.'; break;
-        case 0x35: key = '/'; break;
-        case 0x37: key = '*'; break;  // '*' key
-        case 0x4A: key = '/'; break;  // '/' key
-        case 0x4E: key = '+'; break;  // '+' key
-
-        default: break;
-    }
-
-    if (key != '\0') {
-        if (key == '\n') {
-            process_input();
-            input_index = 0;
-        } else {
-            if (input_index < sizeof(input_buffer) - 1) {
-                input_buffer[input_index++] = key;
-                print_char(key);
-
-                // Если курсор достиг низа экрана → прокручиваем
-                if (get_cursor_row() >= SCREEN_HEIGHT) {
-                    scroll_screen();
-                }
-            }
-        }
-    }
-}
-
-
-
-// Globals for Tic-Tac-Toe
-char board[3][3];
-char current_player;
-
-// Function Prototypes for Tic-Tac-Toe
-void start_tictactoe(void);
-void display_board(void);
-void make_move(int row, int col);
-int check_winner(void);
-void reset_board(void);
-
-// Start the Tic-Tac-Toe game
-void start_tictactoe(void) {
-    reset_board();
-    current_player = 'X';
-    display_text("Tic-Tac-Toe started! Use row and col (e.g., 1 1).", get_cursor_row(), 0);
-    display_board();
-}
-
-// Display the Tic-Tac-Toe board
-// Display the Tic-Tac-Toe board
-void display_board(void) {
-    char row_text[16];
-    for (int i = 0; i < 3; i++) {
-        int index = 0;
-        row_text[index++] = ' ';
-        row_text[index++] = board[i][0];
-        row_text[index++] = ' ';
-        row_text[index++] = '|';
-        row_text[index++] = ' ';
-        row_text[index++] = board[i][1];
-        row_text[index++] = ' ';
-        row_text[index++] = '|';
-        row_text[index++] = ' ';
-        row_text[index++] = board[i][2];
-        row_text[index] = '\0'; // Null-terminate the string
-        display_text(row_text, get_cursor_row() + (i * 2), 0);
-
-        if (i < 2) {
-            display_text("---|---|---", get_cursor_row() + (i * 2) + 1, 0);
-        }
-    }
-    cursor_pos = (get_cursor_row() + 6) * SCREEN_WIDTH; // Position cursor for input
-    update_cursor(cursor_pos);
-}
-
-
-// Make a move in the game
-void make_move(int row, int col) {
-    if (row < 1 || row > 3 || col < 1 || col > 3) {
-        display_text("Invalid position! Use row and col (1-3).", get_cursor_row(), 0);
-        return;
-    }
-
-    row--; col--; // Convert to zero-based index
-    if (board[row][col] != ' ') {
-        display_text("Position already taken!", get_cursor_row(), 0);
-        return;
-    }
-
-    board[row][col] = current_player;
-
-    if (check_winner()) {
-        display_board();
-        char result_text[32];
-        char current_player_str[2] = { current_player, '\0' }; // Convert char to string
-        snprintf(result_text, sizeof(result_text), "Player %s wins!", current_player_str, 0);
-        display_text(result_text, get_cursor_row(), 0);
-        reset_board();
-        return;
-    }
-
-    // Check for a draw
-    int draw = 1;
-    for (int i = 0; i < 3; i++) {
-        for (int j = 0; j < 3; j++) {
-            if (board[i][j] == ' ') {
-                draw = 0;
-                break;
-            }
-        }
-        if (!draw) break;
-    }
-
-    if (draw) {
-        display_board();
-        display_text("It's a draw!", get_cursor_row(), 0);
-        reset_board();
-        return;
-    }
-
-    // Switch players
-    current_player = (current_player == 'X') ? 'O' : 'X';
-    display_board();
-}
-
-// Check if there's a winner
-int check_winner(void) {
-    // Check rows, columns, and diagonals
-    for (int i = 0; i < 3; i++) {
-        if (board[i][0] == current_player && board[i][1] == current_player && board[i][2] == current_player) return 1;
-        if (board[0][i] == current_player && board[1][i] == current_player && board[2][i] == current_player) return 1;
-    }
-    if (board[0][0] == current_player && board[1][1] == current_player && board[2][2] == current_player) return 1;
-    if (board[0][2] == current_player && board[1][1] == current_player && board[2][0] == current_player) return 1;
-
-    return 0;
-}
-
-// Reset the Tic-Tac-Toe board
-void reset_board(void) {
-    for (int i = 0; i < 3; i++) {
-        for (int j = 0; j < 3; j++) {
-            board[i][j] = ' ';
-        }
-    }
-}
-// Function to create a variable
-void create_variable(const char *name, const char *value) {
-    if (var_count < MAX_VARS) {
-        strncpy(variables[var_count].name, name, VAR_NAME_LEN - 1);
-        variables[var_count].name[VAR_NAME_LEN - 1] = '\0'; // Ensure null termination
-        strncpy(variables[var_count].value, value, VAR_VALUE_LEN - 1);
-        variables[var_count].value[VAR_VALUE_LEN - 1] = '\0'; // Ensure null termination
-        var_count++;
-        display_text("Variable created!", get_cursor_row(), 0);
-    } else {
-        display_text("Variable limit reached!", get_cursor_row(), 0);
-    }
-}
-
-// Function to get a variable's value
-char *get_variable_value(const char *name) {
-    for (size_t i = 0; i < var_count; i++) {
-        if (strcmp(variables[i].name, name) == 0) {
-            return variables[i].value;
-        }
-    }
-    return NULL; // Variable not found
-}
-// Function to display all variables
-void display_variables(void) {
-    for (size_t i = 0; i < var_count; i++) {
-        char output[VAR_NAME_LEN + VAR_VALUE_LEN + 10]; // Buffer for output
-        snprintf(output, sizeof(output), "%s: %s", variables[i].name, variables[i].value);
-        display_text(output, get_cursor_row(), 0);
-    }
-    cursor_pos = (get_cursor_row() + var_count + 1) * SCREEN_WIDTH; // Move cursor below displayed variables
-    update_cursor(cursor_pos);
-}
-
-// Function to fill the screen area with a specified character and color
-void fill_area(char fill_char, uint8_t fg_color, uint8_t bg_color, uint16_t start_row, uint16_t start_col, uint16_t height, uint16_t width) {
-    uint16_t *video_memory = (uint16_t *)VIDEO_MEMORY;
-    uint16_t offset;
-    for (uint16_t row = 0; row < height; row++) {
-        for (uint16_t col = 0; col < width; col++) {
-            offset = (start_row + row) * SCREEN_WIDTH + (start_col + col);
-            if (offset < SCREEN_WIDTH * SCREEN_HEIGHT) { // Ensure we don't go out of bounds
-                video_memory[offset] = fill_char | ((fg_color | (bg_color << 4)) << 8);
-            }
-        }
-    }
-    cursor_pos = (start_row + height) * SCREEN_WIDTH; // Move cursor below filled area
-    update_cursor(cursor_pos);
-}
-// Function to print text in a specified color
-void print_color_text(const char *text, const char *color_name) {
-    int color_code = color_code_from_name(color_name);
-    if (color_code == -1) {
-        display_text("Invalid color name!", get_cursor_row() + 1, 0);
-        return;
-    }
-    uint16_t *video_memory = (uint16_t *)VIDEO_MEMORY;
-    uint16_t offset = cursor_pos; // Use current cursor position
-    while (*text) {
-        video_memory[offset++] = *text | ((color_code | (bg_color << 4)) << 8);
-        text++;
-    }
-    cursor_pos = offset; // Update cursor position
-    update_cursor(cursor_pos);
-}
-
-// Function to set the splash screen color
-void set_color_splash(const char *color_name) {
-    int color_code = color_code_from_name(color_name);
-    if (color_code == -1) {
-        display_text("Invalid color name!", get_cursor_row(), 0);
-        return;
-    }
-    text_color1 = color_code;
-    display_text("Splash text color updated!", get_cursor_row(), 0);
-}
-// Pause Execution
-void pause_com(void) {
-    display_text("Press any key to continue...", get_cursor_row(), 0);
-    while (!(inb(KEYBOARD_STATUS_PORT) & 0x01)); // Wait for key press
-}
-void reboot_system(void) {
-    display_text("Rebooting system...", get_cursor_row(), 0);
-    __asm__ __volatile__("int $0x19"); // Trigger BIOS reboot
-}
-
-// Shutdown Command
-void shutdown_system(void) {
-    display_text("System shutting down...", get_cursor_row(), 0);
-    // Issue halt instruction
-    __asm__ __volatile__("cli; hlt");
-}
-void get_cpu_info(void) {
-    char cpu_vendor[13];
-    __asm__ __volatile__(
-        "cpuid"
-        : "=b"(cpu_vendor[0]), "=d"(cpu_vendor[4]), "=c"(cpu_vendor[8])
-        : "a"(0)
-    );
-    cpu_vendor[12] = '\0';
-
-    display_text("CPU Vendor: ", get_cursor_row(), 0);
-    display_text(cpu_vendor, get_cursor_row(), 12);
-}
-void get_memory_info(void) {
-    uint32_t mem_kb;
-    __asm__ __volatile__(
-        "int $0x15"
-        : "=c"(mem_kb)
-        : "a"(0xE820), "b"(0), "d"(0x534D4150)
-        : "memory"
-    );
-
-    char buffer[32];
-    itoa(mem_kb, buffer, 10);
-    display_text("Memory Size: ", get_cursor_row(), 0);
-    display_text(buffer, get_cursor_row(), 14);
-    display_text(" KB", get_cursor_row(), 20);
-}
-void get_uptime(void) {
-    uint32_t ticks;
-    __asm__ __volatile__("mov %%eax, %0" : "=r"(ticks));
-
-    char buffer[32];
-    itoa(ticks / 18, buffer, 10); // Convert to seconds (assuming 18.2 ticks per second)
-    display_text("Uptime: ", get_cursor_row(), 0);
-    display_text(buffer, get_cursor_row(), 8);
-    display_text(" seconds", get_cursor_row(), 15);
-}
-void get_disk_info(void) {
-    uint8_t num_drives;
-    __asm__ __volatile__(
-        "int $0x13"
-        : "=b"(num_drives)
-        : "a"(0x0800)
-    );
-
-    char buffer[32];
-    itoa(num_drives, buffer, 10);
-    display_text("Disk Drives: ", get_cursor_row(), 0);
-    display_text(buffer, get_cursor_row(), 13);
-}
-void get_system_time(void) {
-    uint8_t hours, minutes, seconds;
-    outb(0x70, 0x04); // Get hours
-    hours = inb(0x71);
-    outb(0x70, 0x02); // Get minutes
-    minutes = inb(0x71);
-    outb(0x70, 0x00); // Get seconds
-    seconds = inb(0x71);
-
-    char buffer[32];
-    snprintf(buffer, sizeof(buffer), "Time: " + hours + minutes, hours, minutes);
-    display_text(buffer, get_cursor_row(), 0);
-}
-
-// Execute commands (extended with tictactoe)
-void execute_command(const char *command) {
-    if (strcmp(command, "cls") == 0) {
-        clear_screen();
-    } else if (strncmp(command, "setcolor ", 9) == 0) {
-        char *args = (char *)command + 9;
-        char *fg_str = strtok(args, " ");
-        char *bg_str = strtok(NULL, " ");
-
-        if (fg_str && bg_str) {
-            int fg = color_code_from_name(fg_str);
-            int bg = color_code_from_name(bg_str);
-
-            if (fg != -1 && bg != -1) {
-                text_color = fg;
-                bg_color = bg;
-                clear_screen();
-                display_text("Colors updated successfully!", get_cursor_row(), 0);
-            } else {
-                display_text("Invalid color names!", get_cursor_row(), 0);
-            }
-        } else {
-            display_text("Usage: setcolor <fg> <bg>", get_cursor_row(), 0);
-        }
-    } else if (strcmp(command, "cpuinfo") == 0) {
-        get_cpu_info();
-    } else if (strcmp(command, "meminfo") == 0) {
-        get_memory_info();
-    } else if (strcmp(command, "uptime") == 0) {
-        get_uptime();
-    } else if (strcmp(command, "diskinfo") == 0) {
-        get_disk_info();
-    } else if (strcmp(command, "sysclock") == 0) {
-        get_system_time();
-    } else if (strcmp(command, "shutdown") == 0) {
-        shutdown_system(); // Call shutdown
-    } else if (strcmp(command, "help") == 0) {
-        display_text("Available commands:",get_cursor_row(), 0);
-        display_text("cls - clear screen",get_cursor_row() + 1, 0);
-        display_text("shutdown - shut down the system",get_cursor_row() + 2, 0);
-        display_text("tictactoe - play Tic-Tac-Toe",get_cursor_row() + 3, 0);
-        display_text("move - make a move in Tic-Tac-Toe",get_cursor_row() + 4, 0);
-        display_text("calc 1 + 1 - calculator",get_cursor_row() + 5, 0);
-        display_text("setcolor - set text and bg color",get_cursor_row() + 6, 0);
-        display_text("pause - pause",get_cursor_row() + 7, 0);
-        display_text("setsplash <text> - set splash screen",get_cursor_row() + 8, 0);
-        display_text("printcolortext <color> <text> - print text in color", get_cursor_row() + 9, 0);
-        display_text("setcolorsplash <color> - set splash text color", get_cursor_row() + 10, 0);
-        display_text("createvar <name> <value> - create a variable", get_cursor_row() + 11, 0);
-        display_text("var <name> <value> - assign a value to a variable", get_cursor_row() + 12, 0);
-        display_text("showvars - Displays all defined variables and their values", get_cursor_row() + 13, 0);
-        display_text("fill <char> <fg_color> <bg_color> <height> <width> - Fills a specified area with a character and colors", get_cursor_row() + 14, 0);
-        display_text("reboot - reboot", get_cursor_row() + 15, 0);
-        display_text("cpuinfo - cpu info", get_cursor_row() + 16, 0);
-        display_text("meminfo - memory info", get_cursor_row() + 17, 0);
-        display_text("uptime - uptime", get_cursor_row() + 18, 0);
-        display_text("sysclock - clock", get_cursor_row() + 19, 0);
-        display_text("diskinfo - disk info", get_cursor_row() + 20, 0);
-
-        // Move cursor below the displayed text
-        cursor_pos = (get_cursor_row() + 22) * SCREEN_WIDTH; // 5 lines of help text
-        update_cursor(cursor_pos);
-    } else if (strcmp(command, "showvars") == 0) {
-        display_variables(); // Show all variables
-    } else if (strcmp(command, "reboot") == 0) {
-        reboot_system();
-    } else if (strncmp(command, "fill ", 5) == 0) {
-        clear_screen();
-        char *args = (char *)command + 5;
-        char *fill_char_str = strtok(args, " ");
-        char *fg_color_str = strtok(NULL, " ");
-        char *bg_color_str = strtok(NULL, " ");
-        char *dimensions_str = strtok(NULL, " ");
-
-        if (fill_char_str && fg_color_str && bg_color_str && dimensions_str) {
-            char fill_char = fill_char_str[0]; // Take the first character as the fill character
-            int fg_color = color_code_from_name(fg_color_str);
-            int bg_color = color_code_from_name(bg_color_str);
-            int height = atoi(dimensions_str);
-            int width = atoi(strtok(NULL, " ")); // Get width from the next token
-
-            if (fg_color != -1 && bg_color != -1) {
-                fill_area(fill_char, fg_color, bg_color, 1, 1, height, width);
-            } else {
-                display_text("Invalid color names!", get_cursor_row(), 0);
-            }
-        } else {
-            display_text("Usage: fill <char> <fg_color> <bg_color> <height> <width>", get_cursor_row(), 0);
-        }
-    } else if (strncmp(command, "calc ", 5) == 0) {
-        char *args = (char *)command + 5;
-        char *op1_str = strtok(args, " ");
-        char *op_str = strtok(NULL, " ");
-        char *op2_str = strtok(NULL, " ");
-
-        if (op1_str && op_str && op2_str) {
-            int op1 = atoi(op1_str);
-            int op2 = atoi(op2_str);
-            int result = 0;
-
-            if (strcmp(op_str, "+") == 0) {
-                result = op1 + op2;
-            } else if (strcmp(op_str, "-") == 0) {
-                result = op1 - op2;
-            } else if (strcmp(op_str, "*") == 0) {
-                result = op1 * op2;
-            } else if (strcmp(op_str, "/") == 0 && op2 != 0) {
-                result = op1 / op2;
-            } else {
-                display_text("Invalid operator or division by zero!", get_cursor_row(), 0);
-                return;
-            }
-
-            char result_text[64];
-            snprintf(result_text, sizeof(result_text), "Result: %d", 0, result);
-            display_text(result_text, get_cursor_row(), 0);
-        } else {
-            display_text("Invalid calculator syntax!", get_cursor_row(), 0);
-        }
-    } else if (strncmp(command, "setsplash ", 10) == 0) {
-        const char *new_splash = command + 10; // Get the new splash text
-        set_splash(new_splash);
-        clear_screen();
-    } else if (strcmp(command, "pause") == 0) {
-        pause_com();
-    } else if (strcmp(command, "tictactoe") == 0) {
-        start_tictactoe();
-    } else if (strncmp(command, "move ", 5) == 0) {
-        char *args = (char *)command + 5;
-        char *row_str = strtok(args, " ");
-        char *col_str = strtok(NULL, " ");
-        if (row_str && col_str) {
-            int row = atoi(row_str);
-            int col = atoi(col_str);
-            make_move(row, col);
-        } else {
-            display_text("Invalid move syntax! Use move row col.", get_cursor_row(), 0);
-        }
-    } else if (strncmp(command, "printcolortext ", 15) == 0) {
-        char *args = (char *)command + 15;
-        char *color_name = strtok(args, " ");
-        char *text = strtok(NULL, "\0"); // Get the rest of the string as text
-        if (color_name && text) {
-            print_color_text(text, color_name);
-        } else {
-            display_text("Usage: printcolortext <color> <text>", get_cursor_row(), 0);
-        }
-    } else if (strncmp(command, "setcolorsplash ", 15) == 0) {
-        char *args = (char *)command + 15;
-        char *color_name = strtok(args, " ");
-        if (color_name) {
-            set_color_splash(color_name);
-        } else {
-            display_text("Usage: setcolorsplash <color>", get_cursor_row(), 0);
-        }
-    } else if (strncmp(command, "createvar ", 10) == 0) {
-        char *args = (char *)command + 10;
-        char *var_name = strtok(args, " ");
-        char *var_value = strtok(NULL, "\0"); // Get the rest of the string as value
-        if (var_name && var_value) {
-            create_variable(var_name, var_value);
-        } else {
-            display_text("Usage: createvar <name> <value>", get_cursor_row(), 0);
-        }
-    } else if (strncmp(command, "var", 5) == 0) {
-        char *args = (char *)command + 5;
-        char *var_name = strtok(args, " ");
-        char *var_value = strtok(NULL, "\0"); // Get the rest of the string as value
-        if (var_name && var_value) {
-            create_variable(var_name, var_value);
-        } else {
-            display_text("Usage: var = <name> <value>", get_cursor_row(), 0);
-        }
-    } else {
-        display_text("Unknown command! Enter help!", get_cursor_row(), 0);
-    }
-}
-int color_code_from_name(const char *name) {
-    if (strcmp(name, "black") == 0) return 0;
-    if (strcmp(name, "blue") == 0) return 1;
-    if (strcmp(name, "green") == 0) return 2;
-    if (strcmp(name, "cyan") == 0) return 3;
-    if (strcmp(name, "red") == 0) return 4;
-    if (strcmp(name, "magenta") == 0) return 5;
-    if (strcmp(name, "brown") == 0) return 6;
-    if (strcmp(name, "light_gray") == 0) return 7;
-    if (strcmp(name, "dark_gray") == 0) return 8;
-    if (strcmp(name, "light_blue") == 0) return 9;
-    if (strcmp(name, "light_green") == 0) return 10;
-    if (strcmp(name, "light_cyan") == 0) return 11;
-    if (strcmp(name, "light_red") == 0) return 12;
-    if (strcmp(name, "light_magenta") == 0) return 13;
-    if (strcmp(name, "yellow") == 0) return 14;
-    if (strcmp(name, "white") == 0) return 15;
-    return -1;
-}
-
-
-// Process input when the Enter key is pressed
-void process_input(void) {
-    input_buffer[input_index] = '\0'; // Null-terminate the string
-    execute_command(input_buffer);
-    cursor_pos = (get_cursor_row() + 1) * SCREEN_WIDTH; // Move to next line
-    update_cursor(cursor_pos);
-}
-
-// Initialize the system
-void init_system(void) {
-    clear_screen();
-    cursor_pos = 3 * SCREEN_WIDTH; // Start at line 3
-    update_cursor(cursor_pos);
-}
-
-// Main kernel entry point
-void kmain(void) {
-    init_system();
-    display_text(splash_screen, 0, (SCREEN_WIDTH - strlen(splash_screen)) / 2);
-    while (1) {
-        handle_keyboard(); // Poll for keyboard input
-    }
-}
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "klib.h"
+
+// Constants
+#define VIDEO_MEMORY 0xb8000
+#define WHITE_ON_BLUE 0x1F
+#define SCREEN_WIDTH 80
+#define SCREEN_HEIGHT 25
+#define SCREEN_CELLS (SCREEN_WIDTH * SCREEN_HEIGHT)
+#define VGA_TEXT_CELLS 16384 // 32 KB of text-mode VRAM at 0xB8000
+#define ALL_ROWS_DIRTY ((1u << SCREEN_HEIGHT) - 1)
+#define KEYBOARD_DATA_PORT 0x60
+#define KEYBOARD_STATUS_PORT 0x64
+#define BACKSPACE_SCANCODE 0x0E
+#define DELETE_SCANCODE 0x53
+#define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
+#define KEYBOARD_BUFFER_SIZE 256 // Scancode ring size, must be a power of two
+#define VAR_TABLE_MIN 64 // Initial variable hash slots, must be a power of two
+#define ARENA_CHUNK_SIZE (16 * 1024) // Heap chunk an arena grows by
+#define INPUT_BUFFER_MIN 128 // Static input line buffer, moved to the heap and doubled as needed
+#define SCROLLBACK_BYTES 65536 // Encoded scrollback storage, offsets must fit in 16 bits
+#define SCROLLBACK_LINES 4096 // Max lines kept, must be a power of two
+#define SCROLLBACK_RECORD_MAX (4 + 3 * SCREEN_WIDTH) // Worst-case encoded row
+#define KPRINTF_BUFFER_SIZE 256 // kprintf() output up to this size is formatted in a per-CPU buffer
+
+// Latency probes, see perf_begin()/perf_end()
+enum {
+    PERF_COMMAND, // execute_command()
+    PERF_INPUT, // handle_key() for a typed character or backspace
+    PERF_FLUSH, // screen_flush() with dirty rows
+    PERF_SCROLL, // scroll_screen()
+    PERF_CLEAR, // clear_screen()
+    PERF_PROBE_COUNT
+};
+
+// Scrollback: rows that scrolled off the top, run-length encoded into a
+// circular byte store. The oldest lines are overwritten when it fills.
+static uint8_t scrollback_data[SCROLLBACK_BYTES];
+static uint16_t scrollback_index[SCROLLBACK_LINES]; // Record offset of each stored line
+static uint32_t scrollback_first = 0; // Index slot of the oldest line
+static uint32_t scrollback_count = 0; // Number of stored lines
+static uint32_t scrollback_write = 0; // Byte offset of the next record
+static uint32_t scroll_view = 0; // Lines scrolled back from the live screen, 0 = live
+// Globals
+typedef struct {
+    char *name; // NULL marks an empty slot
+    char *value;
+    uint32_t hash;
+    uint32_t value_capacity; // Bytes available at value, including the terminator
+} Variable;
+
+// Bump allocator over a chain of heap chunks
+typedef struct {
+    uint8_t *base; // Current chunk; its first word points to the previous one
+    size_t size;
+    size_t used;
+} Arena;
+
+static Arena var_arena = { NULL, 0, 0 };
+static Variable *variables = NULL; // Open addressing, linear probing
+static uint32_t var_table_size = 0; // Slots in variables, a power of two
+static size_t var_count = 0;
+static char input_initial[INPUT_BUFFER_MIN]; // Works even with no heap
+static char *input_buffer = input_initial; // Current input line, grown on the heap
+static size_t input_capacity = INPUT_BUFFER_MIN;
+static size_t input_index = 0;
+static uint16_t cursor_pos = 0;
+static uint8_t text_color = 0xF;  // Default: white
+static uint8_t text_color1 = 0xF;  // Default: white
+static uint8_t bg_color = 0x1;   // Default: blue
+static char default_splash[] = "Welcome to DubrDos!";
+static char *splash_screen = default_splash; // Heap copy once set_splash() runs
+static uint16_t shadow_buffer[SCREEN_CELLS]; // RAM copy of the screen, see screen_flush()
+static uint16_t shadow_top = 0; // Shadow row holding screen row 0 (rows form a ring)
+static uint32_t dirty_rows = 0; // Bit n set when screen row n is newer than VGA memory
+static uint16_t pending_cursor = 0; // Cursor position to program on the next flush
+static uint16_t hw_cursor = 0xFFFF; // Cursor position the CRTC currently holds
+static uint16_t vram_origin = 0; // VRAM cell shown at the top left (CRTC start address)
+static uint16_t hw_origin = 0xFFFF; // Start address the CRTC currently holds
+// Function Prototypes
+void init_system(void);
+void clear_screen(void);
+void display_text(const char *text, uint16_t row, uint16_t col);
+void kprintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void handle_keyboard(void);
+void update_cursor(uint16_t position);
+void screen_flush(void);
+void screen_fill(uint16_t offset, uint16_t cell, uint16_t count);
+void process_input(void);
+void print_char(char c);
+void set_splash(const char *new_splash);
+void create_variable(const char *name, const char *value);
+char *get_variable_value(const char *name);
+bool set_variable(const char *name, const char *value);
+bool delete_variable(const char *name);
+size_t expand_variables(const char *input, char *output, size_t size);
+void *arena_alloc(Arena *arena, size_t size);
+void arena_reset(Arena *arena);
+void print_line(const char *text);
+void print_color_text(const char *text, const char *color_name);
+void set_color_splash(const char *color_name);
+uint16_t get_cursor_row(void);
+uint16_t get_cursor_col(void);
+void console_newline(void);
+bool execute_command(const char *command);
+int color_code_from_name(const char *name);
+void scroll_screen(void);
+void scrollback_push(const uint16_t *row);
+void scrollback_scroll(int lines);
+void scrollback_reset_view(void);
+void console_mirror(uint16_t row, uint16_t col, const char *text, size_t length);
+void console_scrolled(void);
+void console_erase(void);
+void console_mute(bool muted);
+void console_serial_line(const char *text, size_t length);
+void klog(const char *fmt, uint32_t arg0, uint32_t arg1);
+void klog_drain_serial(void);
+uint64_t perf_begin(void);
+void perf_end(uint32_t probe, uint64_t start);
+void serial_write(const char *text, size_t length);
+void serial_drain(void);
+void *kmalloc(size_t size);
+void *krealloc(void *ptr, size_t size);
+void kfree(void *ptr);
+void preempt_disable(void);
+void preempt_enable(void);
+void console_lock(void);
+void console_unlock(void);
+char *console_line_get(void);
+void console_line_put(void);
+bool thread_quiet(void);
+bool thread_wait_input(void);
+bool thread_guard_hit(uint32_t address);
+void input_wake(void);
+void sched_slice_end(void);
+
+// I/O Port Access Functions
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outw(uint16_t port, uint16_t value) {
+    __asm__ __volatile__("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint16_t inw(uint16_t port) {
+    uint16_t ret;
+    __asm__ __volatile__("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outl(uint16_t port, uint32_t value) {
+    __asm__ __volatile__("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    __asm__ __volatile__("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// Read the CPU timestamp counter
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Short delay for old hardware (write to an unused port)
+static inline void io_wait(void) {
+    outb(0x80, 0);
+}
+
+// Disable interrupts, returning the previous EFLAGS for irq_restore()
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200) {
+        __asm__ __volatile__("sti" : : : "memory");
+    }
+}
+
+static inline bool interrupts_enabled(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0" : "=r"(flags));
+    return (flags & 0x200) != 0;
+}
+// Shadow storage for a screen row
+static inline uint16_t *shadow_row(uint16_t row) {
+    row += shadow_top;
+    if (row >= SCREEN_HEIGHT) {
+        row -= SCREEN_HEIGHT;
+    }
+    return &shadow_buffer[row * SCREEN_WIDTH];
+}
+
+// Shadow storage for a screen offset (row * SCREEN_WIDTH + col)
+static inline uint16_t *shadow_cell(uint16_t offset) {
+    return shadow_row(offset / SCREEN_WIDTH) + offset % SCREEN_WIDTH;
+}
+
+// Mark the shadow rows covering [offset, offset + count) for the next flush
+static inline void mark_dirty(uint16_t offset, uint16_t count) {
+    if (count == 0 || offset >= SCREEN_CELLS) {
+        return;
+    }
+    uint16_t last = offset + count - 1;
+    if (last >= SCREEN_CELLS) {
+        last = SCREEN_CELLS - 1;
+    }
+    for (uint16_t row = offset / SCREEN_WIDTH; row <= last / SCREEN_WIDTH; row++) {
+        dirty_rows |= 1u << row;
+    }
+}
+
+// Encode a row as [text_len][run_count][fill cell] [run_len, attr]... chars...
+// Trailing cells equal to a blank last cell are dropped and replayed from
+// the fill cell; colors are stored as runs since most rows use one.
+static uint16_t scrollback_encode(const uint16_t *row, uint8_t *out) {
+    uint16_t fill = row[SCREEN_WIDTH - 1];
+    uint8_t text_len = SCREEN_WIDTH;
+    if ((fill & 0xFF) == ' ') {
+        while (text_len > 0 && row[text_len - 1] == fill) {
+            text_len--;
+        }
+    }
+
+    uint16_t length = 4;
+    uint8_t run_count = 0;
+    for (uint8_t i = 0; i < text_len; i++) {
+        uint8_t attr = row[i] >> 8;
+        if (run_count > 0 && out[length - 1] == attr) {
+            out[length - 2]++;
+        } else {
+            out[length++] = 1;
+            out[length++] = attr;
+            run_count++;
+        }
+    }
+    for (uint8_t i = 0; i < text_len; i++) {
+        out[length++] = row[i] & 0xFF;
+    }
+
+    out[0] = text_len;
+    out[1] = run_count;
+    out[2] = fill & 0xFF;
+    out[3] = fill >> 8;
+    return length;
+}
+
+// Expand stored line number `line` (0 = oldest) into a full row
+static void scrollback_decode(uint32_t line, uint16_t *row) {
+    const uint8_t *record = &scrollback_data[scrollback_index[(scrollback_first + line) & (SCROLLBACK_LINES - 1)]];
+    uint8_t text_len = record[0];
+    const uint8_t *runs = record + 4;
+    const uint8_t *chars = runs + 2 * record[1];
+
+    uint8_t col = 0;
+    for (uint8_t run = 0; run < record[1]; run++) {
+        uint16_t attr = runs[2 * run + 1] << 8;
+        for (uint8_t end = col + runs[2 * run]; col < end; col++) {
+            row[col] = chars[col] | attr;
+        }
+    }
+    memset16(row + text_len, record[2] | (record[3] << 8), SCREEN_WIDTH - text_len);
+}
+
+static void scrollback_drop_oldest(void) {
+    scrollback_first = (scrollback_first + 1) & (SCROLLBACK_LINES - 1);
+    scrollback_count--;
+    if (scroll_view > scrollback_count) {
+        scroll_view = scrollback_count;
+    }
+}
+
+// Append a row that scrolled off the top, evicting the oldest lines whose
+// bytes the new record would overwrite
+void scrollback_push(const uint16_t *row) {
+    uint8_t record[SCROLLBACK_RECORD_MAX];
+    uint16_t length = scrollback_encode(row, record);
+
+    if (scrollback_write + length > SCROLLBACK_BYTES) {
+        // Skip the tail of the store; lines still stored there are the oldest
+        while (scrollback_count > 0 && scrollback_index[scrollback_first] >= scrollback_write) {
+            scrollback_drop_oldest();
+        }
+        scrollback_write = 0;
+    }
+    while (scrollback_count > 0 &&
+           scrollback_index[scrollback_first] >= scrollback_write &&
+           scrollback_index[scrollback_first] < scrollback_write + length) {
+        scrollback_drop_oldest();
+    }
+    if (scrollback_count == SCROLLBACK_LINES) {
+        scrollback_drop_oldest();
+    }
+
+    memcpy(&scrollback_data[scrollback_write], record, length);
+    scrollback_index[(scrollback_first + scrollback_count) & (SCROLLBACK_LINES - 1)] = scrollback_write;
+    scrollback_count++;
+    scrollback_write += length;
+
+    // Keep a scrolled-back view pinned to the same text
+    if (scroll_view > 0 && scroll_view < scrollback_count) {
+        scroll_view++;
+        dirty_rows = ALL_ROWS_DIRTY;
+    }
+}
+
+// Move the view back (positive) or forward (negative) through the
+// scrollback. Non-destructive: the live screen stays in the shadow.
+void scrollback_scroll(int lines) {
+    int view = (int)scroll_view + lines;
+    if (view < 0) {
+        view = 0;
+    }
+    if (view > (int)scrollback_count) {
+        view = scrollback_count;
+    }
+    if ((uint32_t)view != scroll_view) {
+        scroll_view = view;
+        dirty_rows = ALL_ROWS_DIRTY;
+    }
+}
+
+// Return to the live screen, e.g. when the user starts typing
+void scrollback_reset_view(void) {
+    scrollback_scroll(-(int)scroll_view);
+}
+
+// Contents of screen row `row` as currently viewed: scrollback lines
+// first when scrolled back, then the top of the live screen
+static const uint16_t *view_row(int row, uint16_t *scratch) {
+    if (scroll_view > 0) {
+        uint32_t line = scrollback_count - scroll_view + row;
+        if (line < scrollback_count) {
+            scrollback_decode(line, scratch);
+            return scratch;
+        }
+        row = line - scrollback_count;
+    }
+    return shadow_row(row);
+}
+
+// Copy every dirty shadow row to VGA memory, then program the start
+// address and cursor once
+void screen_flush(void) {
+    uint16_t scratch[SCREEN_WIDTH];
+    console_lock();
+    uint64_t start = dirty_rows ? perf_begin() : 0; // Idle flushes would swamp the histogram
+
+    while (dirty_rows) {
+        int row = __builtin_ctz(dirty_rows);
+        dirty_rows &= dirty_rows - 1;
+        // One wide string move per row instead of 80 word writes
+        uint16_t *dest = (uint16_t *)VIDEO_MEMORY + vram_origin + row * SCREEN_WIDTH;
+        memcpy(dest, view_row(row, scratch), SCREEN_WIDTH * sizeof(uint16_t));
+    }
+
+    // Flip the start address only after the rows it exposes are written
+    if (vram_origin != hw_origin) {
+        hw_origin = vram_origin;
+        outb(0x3D4, 0x0C);
+        outb(0x3D5, (uint8_t)((hw_origin >> 8) & 0xFF));
+        outb(0x3D4, 0x0D);
+        outb(0x3D5, (uint8_t)(hw_origin & 0xFF));
+    }
+
+    // The cursor register addresses VRAM, not the screen. When the live
+    // cursor is scrolled out of view, park it just below the window.
+    uint32_t screen_cursor = pending_cursor + scroll_view * SCREEN_WIDTH;
+    if (screen_cursor >= SCREEN_CELLS) {
+        screen_cursor = SCREEN_CELLS;
+    }
+    uint16_t position = (vram_origin + screen_cursor) % VGA_TEXT_CELLS;
+    if (position != hw_cursor) {
+        hw_cursor = position;
+        outb(0x3D4, 0x0F);
+        outb(0x3D5, (uint8_t)(position & 0xFF));
+        outb(0x3D4, 0x0E);
+        outb(0x3D5, (uint8_t)((position >> 8) & 0xFF));
+    }
+    perf_end(PERF_FLUSH, start);
+    console_unlock();
+}
+
+// Fill count cells starting at a screen offset, one memset16 per row
+void screen_fill(uint16_t offset, uint16_t cell, uint16_t count) {
+    if (offset >= SCREEN_CELLS) {
+        return;
+    }
+    if (count > SCREEN_CELLS - offset) { // Ensure we don't go out of bounds
+        count = SCREEN_CELLS - offset;
+    }
+    console_lock();
+    mark_dirty(offset, count);
+    while (count > 0) {
+        uint16_t col = offset % SCREEN_WIDTH;
+        uint16_t span = SCREEN_WIDTH - col < count ? SCREEN_WIDTH - col : count;
+        memset16(shadow_row(offset / SCREEN_WIDTH) + col, cell, span);
+        offset += span;
+        count -= span;
+    }
+    console_unlock();
+}
+
+void clear_screen(void) {
+    uint64_t start = perf_begin();
+    uint16_t blank = ' ' | ((text_color | (bg_color << 4)) << 8);
+    console_lock();
+    screen_fill(0, blank, SCREEN_CELLS);
+    cursor_pos = 3 * SCREEN_WIDTH; // Start input on line 3
+    update_cursor(cursor_pos);
+    console_unlock();
+    perf_end(PERF_CLEAR, start);
+}
+
+// Store length characters from row/col on in the shadow buffer, marking
+// them dirty and mirroring them to serial once for the whole run
+static void display_run(const char *text, size_t length, uint16_t row, uint16_t col) {
+    uint16_t start = row * SCREEN_WIDTH + col;
+    if (start >= SCREEN_CELLS) {
+        return;
+    }
+    size_t room = SCREEN_CELLS - start;
+    if (length > room) {
+        length = room;
+    }
+    console_lock();
+    uint16_t attribute = (text_color | (bg_color << 4)) << 8;
+    for (size_t i = 0; i < length; i++) {
+        *shadow_cell(start + i) = (uint8_t)text[i] | attribute;
+    }
+    mark_dirty(start, length);
+    console_mirror(row, col, text, length);
+    console_unlock();
+}
+
+void display_text(const char *text, uint16_t row, uint16_t col) {
+    display_run(text, strlen(text), row, col);
+}
+
+// Formatted output from column 0 of the cursor row. Each '\n' ends the
+// row like print_line(); text after the last one stays on the cursor row
+// like display_text(). Rows are cut at the screen width. The whole call
+// is formatted into this CPU's line buffer first, without the console
+// lock; each row then takes the lock once, so rows from other threads
+// may come between two rows of one call but never inside a row.
+void kprintf(const char *fmt, ...) {
+    char *buffer = console_line_get();
+    va_list args;
+    va_start(args, fmt);
+    size_t length = kvsnprintf(buffer, KPRINTF_BUFFER_SIZE, fmt, args);
+    va_end(args);
+
+    char *text = buffer;
+    if (length >= KPRINTF_BUFFER_SIZE) {
+        text = kmalloc(length + 1);
+        if (text != NULL) {
+            va_start(args, fmt);
+            kvsnprintf(text, length + 1, fmt, args);
+            va_end(args);
+        } else {
+            text = buffer;
+            length = KPRINTF_BUFFER_SIZE - 1;
+        }
+    }
+
+    for (size_t line = 0; line < length;) {
+        size_t end = line;
+        while (end < length && text[end] != '\n') {
+            end++;
+        }
+        size_t run = end - line < SCREEN_WIDTH ? end - line : SCREEN_WIDTH;
+        console_lock();
+        while (cursor_pos >= SCREEN_CELLS) {
+            scroll_screen();
+        }
+        if (run > 0) {
+            display_run(text + line, run, get_cursor_row(), 0);
+        }
+        if (end < length) {
+            cursor_pos = (get_cursor_row() + 1) * SCREEN_WIDTH;
+            end++;
+        }
+        update_cursor(cursor_pos);
+        console_unlock();
+        line = end;
+    }
+
+    if (text != buffer) {
+        kfree(text);
+    }
+    console_line_put();
+}
+// Function to set a new splash screen
+void set_splash(const char *new_splash) {
+    size_t length = strlen(new_splash);
+    char *copy = kmalloc(length + 1);
+    if (copy == NULL) {
+        display_text("Out of memory!", get_cursor_row(), 0);
+        return;
+    }
+    memcpy(copy, new_splash, length + 1);
+    if (splash_screen != default_splash) {
+        kfree(splash_screen);
+    }
+    splash_screen = copy;
+    display_text("Splash updated!", get_cursor_row(), 0);
+}
+// Print a single character to the screen at the current cursor position
+void print_char(char c) {
+    console_lock();
+    // A previous command may have left the cursor below the last row
+    while (cursor_pos >= SCREEN_CELLS) {
+        scroll_screen();
+    }
+
+    if (c == '\n') {
+        cursor_pos = (cursor_pos / SCREEN_WIDTH + 1) * SCREEN_WIDTH; // Move to the next row
+    } else {
+        console_mirror(cursor_pos / SCREEN_WIDTH, cursor_pos % SCREEN_WIDTH, &c, 1);
+        *shadow_cell(cursor_pos) = c | ((text_color | (bg_color << 4)) << 8);
+        dirty_rows |= 1u << (cursor_pos / SCREEN_WIDTH);
+        cursor_pos++; // Move cursor forward
+    }
+
+    // Prevent cursor from going out of screen bounds (scroll_screen moves it up a row)
+    if (cursor_pos >= SCREEN_CELLS) {
+        scroll_screen();
+    }
+
+    update_cursor(cursor_pos);
+    console_unlock();
+}
+
+// Scroll by advancing the shadow ring and the CRTC start address: rows
+// already in VGA memory stay put and only the new bottom row is written.
+// Once the window reaches the end of VRAM it restarts at offset 0 and
+// the whole screen is rewritten from the shadow.
+void scroll_screen(void) {
+    uint64_t start = perf_begin();
+    console_lock();
+    uint16_t *top = shadow_row(0);
+
+    // Save the topmost line before it scrolls off
+    scrollback_push(top);
+
+    // The old top row becomes the new bottom row; clear it
+    shadow_top = shadow_top + 1 < SCREEN_HEIGHT ? shadow_top + 1 : 0;
+    memset16(top, ' ' | (WHITE_ON_BLUE << 8), SCREEN_WIDTH);
+    dirty_rows = (dirty_rows >> 1) | (1u << (SCREEN_HEIGHT - 1));
+
+    vram_origin += SCREEN_WIDTH;
+    if (vram_origin + SCREEN_CELLS > VGA_TEXT_CELLS) {
+        vram_origin = 0;
+        dirty_rows = ALL_ROWS_DIRTY;
+    }
+
+    cursor_pos -= SCREEN_WIDTH; // Adjust cursor
+    update_cursor(cursor_pos);
+    console_scrolled();
+    console_unlock();
+    perf_end(PERF_SCROLL, start);
+}
+// Record the cursor position; screen_flush() programs the CRTC
+void update_cursor(uint16_t position) {
+    pending_cursor = position < SCREEN_CELLS ? position : SCREEN_CELLS - 1;
+}
+
+// Get the current cursor row
+uint16_t get_cursor_row(void) {
+    return cursor_pos / SCREEN_WIDTH;
+}
+
+// Get the current cursor column
+uint16_t get_cursor_col(void) {
+    return cursor_pos % SCREEN_WIDTH;
+}
+
+// Move the cursor to the start of the next row, e.g. after a command
+void console_newline(void) {
+    console_lock();
+    cursor_pos = (get_cursor_row() + 1) * SCREEN_WIDTH;
+    update_cursor(cursor_pos);
+    console_unlock();
+}
+
+
+// Globals for per-CPU data
+#define MAX_CPUS 8
+#define SCHED_PRIORITIES 4 // 0 runs first; idle threads sit below the last level
+#define PERCPU_GDT_INDEX 5 // GDT slot of CPU 0's data segment, one slot per CPU after it
+#define PERCPU_SELECTOR(cpu) ((PERCPU_GDT_INDEX + (cpu)) * 8)
+#define TIMER_HEAP_SIZE 64 // Pending timers per CPU: a sleeping thread each, plus a few
+
+// Ticket lock: waiters are served in the order they arrived, so a CPU
+// that keeps retaking a lock cannot starve the others
+typedef struct {
+    volatile uint16_t owner; // Ticket being served
+    volatile uint16_t next; // Ticket the next arrival draws
+} Spinlock;
+
+// Everything the scheduler keeps per CPU. Each CPU's GS segment starts
+// at its entry, so a CPU finds its own with one GS-relative load.
+typedef struct Cpu {
+    struct Cpu *self; // At %gs:0, see this_cpu()
+    struct Thread *current; // Running thread, NULL until sched_init()
+    uint32_t index;
+    uint8_t apic_id;
+    volatile bool online;
+    struct Thread *idle; // Runs when no thread is ready; never queued
+    struct Thread *previous; // Switched out, but its stack is in use until switch_finish()
+    uint32_t preempt_count; // Preemption is off while non-zero
+    uint32_t kernel_lock_depth; // Nesting of preempt_disable()
+    uint32_t console_lock_depth; // Nesting of console_lock()
+    char console_line[KPRINTF_BUFFER_SIZE]; // kprintf() formats here, see console_line_get()
+    volatile bool need_resched; // Switch at the next preemption point
+    uint64_t slice_end; // ktime_ns() when the running thread's slice is over, 0 while idle
+    uint64_t switch_ns; // ktime_ns() at the last switch, for CPU time accounting
+    uint64_t online_ns; // ktime_ns() when the CPU came up
+    uint64_t idle_ns;
+    uint32_t timer_irqs; // Timer interrupts taken; few while idle
+    uint32_t context_switches;
+    uint32_t steals; // Threads taken from other CPUs' run queues
+    Spinlock run_queue_lock;
+    struct Thread *run_queue_head[SCHED_PRIORITIES]; // FIFO per priority
+    struct Thread *run_queue_tail[SCHED_PRIORITIES];
+    volatile uint32_t run_queue_ready; // Bit n set while level n is non-empty
+    volatile uint32_t run_queue_count; // Threads queued, over all levels
+    Spinlock timer_lock;
+    struct Timer *timers[TIMER_HEAP_SIZE]; // Min-heap on deadline
+    uint32_t timer_count;
+    uint64_t timer_armed; // Deadline the local APIC timer is set for, 0 when stopped
+} Cpu;
+
+static Cpu cpus[MAX_CPUS];
+static uint32_t cpu_count = 1; // CPUs online
+
+static inline Cpu *this_cpu(void) {
+    Cpu *cpu;
+    __asm__ __volatile__("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// The running thread, read with one instruction so that a migration
+// cannot fall between finding the CPU and reading its thread
+static inline struct Thread *current_thread(void) {
+    struct Thread *thread;
+    __asm__ __volatile__("mov %%gs:%c1, %0" : "=r"(thread) : "i"(offsetof(Cpu, current)));
+    return thread;
+}
+
+static inline void spin_lock(Spinlock *lock) {
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        __asm__ __volatile__("pause");
+    }
+}
+
+static inline void spin_unlock(Spinlock *lock) {
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+// For locks an IRQ handler takes too: with interrupts on, the handler
+// could spin on this CPU for a ticket this CPU holds
+static inline uint32_t spin_lock_irqsave(Spinlock *lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(Spinlock *lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+// Globals for interrupt handling
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA 0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA 0xA1
+#define PIC_EOI 0x20
+#define IRQ_BASE 0x20 // IRQ0-15 are remapped to vectors 0x20-0x2F
+#define YIELD_VECTOR 0x30 // int $0x30 enters the scheduler, see thread_yield()
+#define LAPIC_TIMER_VECTOR 0x31 // One-shot local APIC timer, see timer_program()
+#define KICK_VECTOR 0x32 // IPI that wakes an idle CPU to look for work
+#define LAPIC_SPURIOUS_VECTOR 0x3F // Low nibble all ones, as older local APICs require
+#define ISR_STUBS 64 // Vectors 0-63 have stubs in kernel.asm
+#define IDT_ENTRIES 256
+#define KERNEL_CODE_SELECTOR 0x08
+#define KERNEL_DATA_SELECTOR 0x10
+#define KERNEL_TSS_SELECTOR 0x18
+#define DOUBLE_FAULT_TSS_SELECTOR 0x20
+
+typedef struct {
+    uint16_t limit_low;
+    uint16_t base_low;
+    uint8_t base_mid;
+    uint8_t access;
+    uint8_t granularity;
+    uint8_t base_high;
+} __attribute__((packed)) GdtEntry;
+
+typedef struct {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t zero;
+    uint8_t type_attr;
+    uint16_t offset_high;
+} __attribute__((packed)) IdtEntry;
+
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) DescriptorPointer;
+
+// 32-bit task state segment. Only used for the double-fault task switch.
+typedef struct {
+    uint32_t prev_task;
+    uint32_t esp0, ss0, esp1, ss1, esp2, ss2;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs;
+    uint32_t ldt;
+    uint16_t trap;
+    uint16_t iomap_base;
+} __attribute__((packed)) Tss;
+
+// Register state saved by isr_common in kernel.asm
+typedef struct {
+    uint32_t gs, fs, es, ds;
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
+    uint32_t int_no, err_code;
+    uint32_t eip, cs, eflags;
+} InterruptFrame;
+
+typedef void (*irq_handler_t)(InterruptFrame *frame);
+
+extern uint32_t isr_stub_table[ISR_STUBS]; // Entry stubs, see kernel.asm
+extern uint8_t stack_guard[]; // Page below the boot stack, see kernel.asm
+
+static GdtEntry gdt[PERCPU_GDT_INDEX + MAX_CPUS];
+static Tss kernel_tss; // Receives the interrupted state on a double fault
+static Tss double_fault_tss;
+static uint8_t double_fault_stack[4096] __attribute__((aligned(16)));
+static uint32_t stack_guard_page = 0; // Unmapped by paging_init(), 0 until then
+static IdtEntry idt[IDT_ENTRIES];
+static irq_handler_t irq_handlers[16];
+
+// Keyboard scancode ring: IRQ1 is the only producer, the main loop the only consumer
+static uint8_t keyboard_buffer[KEYBOARD_BUFFER_SIZE];
+static volatile uint32_t keyboard_head = 0; // Written only by the IRQ1 handler
+static volatile uint32_t keyboard_tail = 0; // Written only by the main loop
+static volatile uint32_t keyboard_dropped = 0; // Scancodes lost to a full ring
+
+static const char *exception_names[32] = {
+    "Divide error", "Debug", "NMI", "Breakpoint", "Overflow", "Bound range",
+    "Invalid opcode", "Device not available", "Double fault", "Coprocessor overrun",
+    "Invalid TSS", "Segment not present", "Stack fault", "General protection",
+    "Page fault", "Reserved", "x87 FPU error", "Alignment check", "Machine check",
+    "SIMD error", "Virtualization", "Control protection", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved", "Hypervisor injection",
+    "VMM communication", "Security", "Reserved"
+};
+
+// Function Prototypes for interrupt handling
+void gdt_init(void);
+void idt_init(void);
+void pic_remap(void);
+void irq_install_handler(uint8_t irq, irq_handler_t handler);
+void irq_set_mask(uint8_t irq, bool masked);
+InterruptFrame *isr_handler(InterruptFrame *frame);
+InterruptFrame *schedule(InterruptFrame *frame);
+InterruptFrame *sched_irq_exit(InterruptFrame *frame);
+void switch_finish(void);
+void lapic_eoi(void);
+void timer_interrupt(InterruptFrame *frame);
+void keyboard_irq(InterruptFrame *frame);
+bool keyboard_read_scancode(uint8_t *scancode);
+void handle_scancode(uint8_t scancode);
+void handle_key(char key);
+bool input_pending(void);
+void wait_for_interrupt(void);
+void double_fault_task(void);
+
+static void gdt_set_entry(int index, uint32_t base, uint32_t limit, uint8_t access, uint8_t granularity) {
+    gdt[index].limit_low = limit & 0xFFFF;
+    gdt[index].base_low = base & 0xFFFF;
+    gdt[index].base_mid = (base >> 16) & 0xFF;
+    gdt[index].access = access;
+    gdt[index].granularity = ((limit >> 16) & 0x0F) | (granularity & 0xF0);
+    gdt[index].base_high = (base >> 24) & 0xFF;
+}
+
+// Load the GDT on this CPU and reload every segment register; GS gets
+// the CPU's own data segment, see this_cpu()
+static void gdt_load(uint32_t cpu) {
+    DescriptorPointer gdt_pointer;
+    gdt_pointer.limit = sizeof(gdt) - 1;
+    gdt_pointer.base = (uint32_t)gdt;
+
+    __asm__ __volatile__(
+        "lgdt %0\n"
+        "ljmp $0x08, $1f\n"
+        "1:\n"
+        "mov $0x10, %%ax\n"
+        "mov %%ax, %%ds\n"
+        "mov %%ax, %%es\n"
+        "mov %%ax, %%fs\n"
+        "mov %%ax, %%ss\n"
+        "mov %w1, %%gs\n"
+        : : "m"(gdt_pointer), "r"(PERCPU_SELECTOR(cpu)) : "eax", "memory"
+    );
+}
+
+// Replace the bootloader's GDT with our own flat code/data segments,
+// the two TSSs the double-fault task gate switches between and one
+// data segment per CPU based at its Cpu entry
+void gdt_init(void) {
+    // A #DF usually means the kernel stack is gone, so the handler runs
+    // as a separate task with its own stack (cr3 is set by paging_init)
+    double_fault_tss.eip = (uint32_t)double_fault_task;
+    double_fault_tss.esp = (uint32_t)(double_fault_stack + sizeof(double_fault_stack));
+    double_fault_tss.eflags = 0x2; // Interrupts off
+    double_fault_tss.cs = KERNEL_CODE_SELECTOR;
+    double_fault_tss.ss = double_fault_tss.ds = double_fault_tss.es = KERNEL_DATA_SELECTOR;
+    double_fault_tss.fs = KERNEL_DATA_SELECTOR;
+    double_fault_tss.gs = PERCPU_SELECTOR(0); // Only the boot CPU has the task gate's TSSs
+    double_fault_tss.iomap_base = sizeof(Tss);
+    kernel_tss.iomap_base = sizeof(Tss);
+
+    gdt_set_entry(0, 0, 0, 0, 0);
+    gdt_set_entry(1, 0, 0xFFFFFFFF, 0x9A, 0xCF); // Kernel code
+    gdt_set_entry(2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Kernel data
+    gdt_set_entry(3, (uint32_t)&kernel_tss, sizeof(Tss) - 1, 0x89, 0x00); // Available 32-bit TSS
+    gdt_set_entry(4, (uint32_t)&double_fault_tss, sizeof(Tss) - 1, 0x89, 0x00);
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        cpus[i].self = &cpus[i];
+        cpus[i].index = i;
+        gdt_set_entry(PERCPU_GDT_INDEX + i, (uint32_t)&cpus[i], sizeof(Cpu) - 1, 0x92, 0x40);
+    }
+    gdt_load(0);
+    __asm__ __volatile__("ltr %w0" : : "r"(KERNEL_TSS_SELECTOR));
+}
+
+static void idt_set_gate(uint8_t vector, uint32_t handler, uint8_t type_attr) {
+    idt[vector].offset_low = handler & 0xFFFF;
+    idt[vector].selector = KERNEL_CODE_SELECTOR;
+    idt[vector].zero = 0;
+    idt[vector].type_attr = type_attr;
+    idt[vector].offset_high = (handler >> 16) & 0xFFFF;
+}
+
+static void idt_load(void) {
+    DescriptorPointer idt_pointer;
+    idt_pointer.limit = sizeof(idt) - 1;
+    idt_pointer.base = (uint32_t)idt;
+    __asm__ __volatile__("lidt %0" : : "m"(idt_pointer));
+}
+
+// Install gates for the 32 CPU exceptions, the 16 remapped PIC lines,
+// the scheduler's yield vector and the local APIC vectors
+void idt_init(void) {
+    for (int i = 0; i < ISR_STUBS; i++) {
+        idt_set_gate(i, isr_stub_table[i], 0x8E); // Present, ring 0, 32-bit interrupt gate
+    }
+    // Task gate: #DF switches to double_fault_tss instead of using the stack
+    idt[8].offset_low = 0;
+    idt[8].selector = DOUBLE_FAULT_TSS_SELECTOR;
+    idt[8].zero = 0;
+    idt[8].type_attr = 0x85;
+    idt[8].offset_high = 0;
+    idt_load();
+}
+
+// Move the 8259 PICs off the CPU exception vectors and mask every line
+void pic_remap(void) {
+    outb(PIC1_COMMAND, 0x11); io_wait(); // ICW1: init, expect ICW4
+    outb(PIC2_COMMAND, 0x11); io_wait();
+    outb(PIC1_DATA, IRQ_BASE); io_wait(); // ICW2: vector offsets
+    outb(PIC2_DATA, IRQ_BASE + 8); io_wait();
+    outb(PIC1_DATA, 0x04); io_wait(); // ICW3: slave on IRQ2
+    outb(PIC2_DATA, 0x02); io_wait();
+    outb(PIC1_DATA, 0x01); io_wait(); // ICW4: 8086 mode
+    outb(PIC2_DATA, 0x01); io_wait();
+
+    outb(PIC1_DATA, 0xFB); // Everything masked except the cascade line
+    outb(PIC2_DATA, 0xFF);
+}
+
+void irq_set_mask(uint8_t irq, bool masked) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    uint8_t bit = 1 << (irq & 7);
+    uint8_t mask = inb(port);
+    outb(port, masked ? (mask | bit) : (mask & ~bit));
+}
+
+void irq_install_handler(uint8_t irq, irq_handler_t handler) {
+    irq_handlers[irq] = handler;
+    irq_set_mask(irq, handler == NULL);
+}
+
+// Common C entry for every stub in kernel.asm. Returns the frame to
+// resume, which belongs to another thread after a context switch.
+InterruptFrame *isr_handler(InterruptFrame *frame) {
+    if (frame->int_no == YIELD_VECTOR) {
+        return schedule(frame);
+    }
+    if (frame->int_no == LAPIC_SPURIOUS_VECTOR) {
+        return frame; // Not in service, so no EOI
+    }
+    if (frame->int_no == LAPIC_TIMER_VECTOR || frame->int_no == KICK_VECTOR) {
+        lapic_eoi();
+        if (frame->int_no == LAPIC_TIMER_VECTOR) {
+            timer_interrupt(frame);
+        }
+        return sched_irq_exit(frame);
+    }
+    if (frame->int_no < IRQ_BASE) {
+        char line[SCREEN_WIDTH + 1];
+        size_t length;
+        klog("exception %u (%s)", frame->int_no, (uint32_t)exception_names[frame->int_no]);
+        klog("  eip 0x%08x error code 0x%x", frame->eip, frame->err_code);
+        klog_drain_serial();
+        // ksnprintf returns the untruncated length, so clamp it after each call
+        length = ksnprintf(line, sizeof(line), "CPU exception: %s", exception_names[frame->int_no]);
+        if (length > sizeof(line) - 1) {
+            length = sizeof(line) - 1;
+        }
+        if (frame->int_no == 14) {
+            // CR2 holds the faulting address; error code bit 1 = write, bit 0 = protection
+            uint32_t cr2;
+            __asm__ __volatile__("mov %%cr2, %0" : "=r"(cr2));
+            length += ksnprintf(line + length, sizeof(line) - length, " at 0x%08X %s", cr2,
+                                frame->err_code & 2 ? "write" : "read");
+            if (length > sizeof(line) - 1) {
+                length = sizeof(line) - 1;
+            }
+        }
+        ksnprintf(line + length, sizeof(line) - length, " EIP=0x%08X System halted.", frame->eip);
+        display_text(line, 24, 0);
+        screen_flush();
+        serial_drain();
+        __asm__ __volatile__("cli; hlt");
+        return frame;
+    }
+
+    uint8_t irq = frame->int_no - IRQ_BASE;
+
+    // Spurious IRQ7/IRQ15: the in-service bit is clear, so no EOI for that PIC
+    if (irq == 7 || irq == 15) {
+        uint16_t port = irq == 7 ? PIC1_COMMAND : PIC2_COMMAND;
+        outb(port, 0x0B); // OCW3: read ISR
+        if ((inb(port) & 0x80) == 0) {
+            klog("irq: spurious IRQ%u", irq, 0);
+            if (irq == 15) {
+                outb(PIC1_COMMAND, PIC_EOI);
+            }
+            return frame;
+        }
+    }
+
+    if (irq_handlers[irq]) {
+        irq_handlers[irq](frame);
+    }
+
+    if (irq >= 8) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);
+    return sched_irq_exit(frame);
+}
+
+// Runs as its own task on double_fault_stack; the faulting state is in
+// kernel_tss. Never returns.
+void double_fault_task(void) {
+    char line[SCREEN_WIDTH + 1];
+    uint32_t cr2;
+    __asm__ __volatile__("mov %%cr2, %0" : "=r"(cr2));
+    bool overflow = stack_guard_page && cr2 - stack_guard_page < PAGE_SIZE;
+    bool thread_overflow = thread_guard_hit(cr2);
+
+    ksnprintf(line, sizeof(line), "%s at 0x%08X EIP=0x%08X System halted.",
+              overflow ? "Kernel stack overflow" : thread_overflow ? "Thread stack overflow"
+                                                                   : "CPU exception: Double fault",
+              cr2, kernel_tss.eip);
+    display_text(line, 24, 0);
+    screen_flush();
+    serial_drain();
+    while (1) {
+        __asm__ __volatile__("cli; hlt");
+    }
+}
+
+// IRQ1: move the scancode into the ring, never touch the screen here
+void keyboard_irq(InterruptFrame *frame) {
+    (void)frame;
+    uint8_t scancode = inb(KEYBOARD_DATA_PORT);
+    uint32_t head = keyboard_head;
+
+    if (head - keyboard_tail >= KEYBOARD_BUFFER_SIZE) {
+        keyboard_dropped++;
+        klog("keyboard: ring full, dropped scancode 0x%02x", scancode, 0);
+        return;
+    }
+    keyboard_buffer[head & (KEYBOARD_BUFFER_SIZE - 1)] = scancode;
+    __asm__ __volatile__("" : : : "memory"); // Publish the byte before the index
+    keyboard_head = head + 1;
+    input_wake();
+}
+
+// Pop one scancode from the ring; returns false when it is empty
+bool keyboard_read_scancode(uint8_t *scancode) {
+    uint32_t tail = keyboard_tail;
+    if (tail == keyboard_head) {
+        return false;
+    }
+    __asm__ __volatile__("" : : : "memory");
+    *scancode = keyboard_buffer[tail & (KEYBOARD_BUFFER_SIZE - 1)];
+    __asm__ __volatile__("" : : : "memory"); // Consume the byte before freeing the slot
+    keyboard_tail = tail + 1;
+    return true;
+}
+
+// Sleep until input arrives unless some is already waiting. Once the
+// scheduler runs the calling thread blocks and others get the CPU.
+// Before that, sti only takes effect after the following instruction,
+// so an IRQ arriving between the check and hlt still wakes us up.
+void wait_for_interrupt(void) {
+    __asm__ __volatile__("cli");
+    if (input_pending()) {
+        __asm__ __volatile__("sti");
+    } else if (!thread_wait_input()) {
+        __asm__ __volatile__("sti; hlt" : : : "memory");
+    }
+}
+
+// Drain every scancode queued by IRQ1
+void handle_keyboard(void) {
+    uint8_t scancode;
+    while (keyboard_read_scancode(&scancode)) {
+        handle_scancode(scancode);
+    }
+}
+
+// Double the input line buffer; false (line stays as is) when out of memory
+static bool input_grow(void) {
+    size_t capacity = input_capacity * 2;
+    char *buffer;
+    if (input_buffer == input_initial) {
+        buffer = kmalloc(capacity);
+        if (buffer != NULL) {
+            memcpy(buffer, input_initial, input_index);
+        }
+    } else {
+        buffer = krealloc(input_buffer, capacity);
+    }
+    if (buffer == NULL) {
+        return false;
+    }
+    input_buffer = buffer;
+    input_capacity = capacity;
+    return true;
+}
+
+void handle_scancode(uint8_t scancode) {
+    if (scancode & 0x80) {
+        return; // Игнорируем отпускание клавиши
+    }
+
+    char key = '\0';
+
+    switch (scancode) {
+        case 0x48: // Up arrow
+            console_lock();
+            if (get_cursor_row() > 0 && scroll_view == 0) {
+                cursor_pos -= SCREEN_WIDTH;
+                update_cursor(cursor_pos);
+            } else {
+                scrollback_scroll(1); // Show the previous line
+            }
+            console_unlock();
+            return;
+
+        case 0x50: // Down arrow
+            console_lock();
+            if (scroll_view > 0) {
+                scrollback_scroll(-1);
+            } else if (get_cursor_row() < SCREEN_HEIGHT - 1) {
+                cursor_pos += SCREEN_WIDTH;
+                update_cursor(cursor_pos);
+            } else {
+                scroll_screen();  // Scroll normally
+            }
+            console_unlock();
+            return;
+        case 0x49: // Page Up
+            scrollback_scroll(SCREEN_HEIGHT - 1);
+            return;
+        case 0x51: // Page Down
+            scrollback_scroll(-(SCREEN_HEIGHT - 1));
+            return;
+        case 0x4B: // Влево
+            console_lock();
+            if (get_cursor_col() > 0) {
+                cursor_pos--;
+                update_cursor(cursor_pos);
+            }
+            console_unlock();
+            return;
+        case 0x4D: // Вправо
+            console_lock();
+            if (get_cursor_col() < SCREEN_WIDTH - 1) {
+                cursor_pos++;
+                update_cursor(cursor_pos);
+            }
+            console_unlock();
+            return;
+        case BACKSPACE_SCANCODE: // Backspace
+            handle_key('\b');
+            return;
+
+        case DELETE_SCANCODE: // Delete
+            console_lock();
+            if (cursor_pos < SCREEN_CELLS) {
+                *shadow_cell(cursor_pos) = ' ' | (WHITE_ON_BLUE << 8); // Clear character
+                mark_dirty(cursor_pos, 1);
+            }
+            console_unlock();
+            return;
+
+        // Ввод символов, включая специальные
+        case 0x1C: key = '\n'; break; // Enter
+        case 0x39: key = ' '; break;  // Пробел
+        case 0x02: key = '1'; break;
+        case 0x03: key = '2'; break;
+        case 0x04: key = '3'; break;
+        case 0x05: key = '4'; break;
+        case 0x06: key = '5'; break;
+        case 0x07: key = '6'; break;
+        case 0x08: key = '7'; break;
+        case 0x09: key = '8'; break;
+        case 0x0A: key = '9'; break;
+        case 0x0B: key = '0'; break;
+        case 0x10: key = 'q'; break;
+        case 0x11: key = 'w'; break;
+        case 0x12: key = 'e'; break;
+        case 0x13: key = 'r'; break;
+        case 0x14: key = 't'; break;
+        case 0x15: key = 'y'; break;
+        case 0x16: key = 'u'; break;
+        case 0x17: key = 'i'; break;
+        case 0x18: key = 'o'; break;
+        case 0x19: key = 'p'; break;
+        case 0x1E: key = 'a'; break;
+        case 0x1F: key = 's'; break;
+        case 0x20: key = 'd'; break;
+        case 0x21: key = 'f'; break;
+        case 0x22: key = 'g'; break;
+        case 0x23: key = 'h'; break;
+        case 0x24: key = 'j'; break;
+        case 0x25: key = 'k'; break;
+        case 0x26: key = 'l'; break;
+        case 0x2C: key = 'z'; break;
+        case 0x2D: key = 'x'; break;
+        case 0x2E: key = 'c'; break;
+        case 0x2F: key = 'v'; break;
+        case 0x30: key = 'b'; break;
+        case 0x31: key = 'n'; break;
+        case 0x32: key = 'm'; break;
+
+        case 0x0C: key = '-'; break;  // '-' key
+        case 0x0D: key = '='; break;  // '=' key
+        case 0x1A: key = '['; break;
+        case 0x1B: key = ']'; break;
+        case 0x2B: key = '\\'; break;
+        case 0x27: key = ';'; break;
+        case 0x28: key = '\''; break;
+        case 0x33: key = ','; break;
+        case 0x34: key = '.'; break;
+        case 0x35: key = '/'; break;
+        case 0x37: key = '*'; break;  // '*' key
+        case 0x4A: key = '/'; break;  // '/' key
+        case 0x4E: key = '+'; break;  // '+' key
+
+        default: break;
+    }
+
+    if (key != '\0') {
+        handle_key(key);
+    }
+}
+
+// Line editing shared by the PS/2 keyboard and the serial console:
+// '\b' erases, '\n' runs the line, anything else is typed
+void handle_key(char key) {
+    scrollback_reset_view(); // Typing always happens on the live screen
+    if (key == '\n') {
+        process_input(); // Timed as PERF_COMMAND
+        input_index = 0;
+        return;
+    }
+
+    uint64_t start = perf_begin();
+    if (key == '\b') {
+        if (input_index > 0) {
+            input_index--;
+            console_lock();
+            cursor_pos--;
+            *shadow_cell(cursor_pos) = ' ' | (WHITE_ON_BLUE << 8); // Clear character
+            mark_dirty(cursor_pos, 1);
+            update_cursor(cursor_pos);
+            console_erase();
+            console_unlock();
+        }
+    } else {
+        if (input_index + 1 < input_capacity || input_grow()) {
+            input_buffer[input_index++] = key;
+            print_char(key);
+
+            // Если курсор достиг низа экрана → прокручиваем
+            if (get_cursor_row() >= SCREEN_HEIGHT) {
+                scroll_screen();
+            }
+        }
+    }
+    perf_end(PERF_INPUT, start);
+}
+
+
+
+// Globals for the serial console
+#define COM1_PORT 0x3F8
+#define UART_DATA 0 // RBR/THR; divisor low byte while DLAB is set
+#define UART_IER 1 // Divisor high byte while DLAB is set
+#define UART_IIR 2 // FCR when written
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+#define UART_IER_RX 0x01
+#define UART_IER_THRE 0x02
+#define UART_LSR_DATA_READY 0x01
+#define UART_LSR_THRE 0x20 // Transmit FIFO empty
+#define UART_FIFO_SIZE 16
+#define SERIAL_TX_SIZE 16384 // Output ring, must be a power of two
+#define SERIAL_RX_SIZE 256 // Input ring, must be a power of two
+
+static bool serial_present = false;
+static uint8_t serial_ier = 0; // Last value written to UART_IER
+// Output ring: any code appends, serial_fill_fifo() (IRQs off) consumes
+static uint8_t serial_tx_buffer[SERIAL_TX_SIZE];
+static volatile uint32_t serial_tx_head = 0;
+static volatile uint32_t serial_tx_tail = 0;
+static Spinlock serial_lock; // The UART and serial_tx_tail, shared with IRQ4 on the boot CPU
+// Input ring: IRQ4 is the only producer, the main loop the only consumer
+static uint8_t serial_rx_buffer[SERIAL_RX_SIZE];
+static volatile uint32_t serial_rx_head = 0;
+static volatile uint32_t serial_rx_tail = 0;
+static volatile uint32_t serial_rx_dropped = 0;
+// Position of the serial line on the VGA screen, see console_mirror()
+static int serial_row = -1;
+static uint16_t serial_col = 0;
+static bool serial_last_cr = false; // Swallow the '\n' of a "\r\n" pair
+static bool serial_muted = false; // console_mirror() drops everything while set
+static bool serial_line_start = true; // Nothing written since the last line break
+
+// Function Prototypes for the serial console
+void serial_init(void);
+void serial_irq(InterruptFrame *frame);
+bool serial_read_char(char *c);
+void handle_serial_input(void);
+
+// Start the UART on COM1: 115200 8N1, FIFOs on, receive interrupt
+// armed. A loopback test first makes sure a 16550 is really there.
+void serial_init(void) {
+    outb(COM1_PORT + UART_IER, 0x00);
+    outb(COM1_PORT + UART_LCR, 0x80); // DLAB on
+    outb(COM1_PORT + UART_DATA, 0x01); // Divisor 1: 115200 baud
+    outb(COM1_PORT + UART_IER, 0x00);
+    outb(COM1_PORT + UART_LCR, 0x03); // 8 data bits, no parity, one stop bit
+    outb(COM1_PORT + UART_IIR, 0xC7); // Enable and clear FIFOs, 14-byte receive trigger
+    outb(COM1_PORT + UART_MCR, 0x1E); // Loopback
+    outb(COM1_PORT + UART_DATA, 0xAE);
+    if (inb(COM1_PORT + UART_DATA) != 0xAE) {
+        return;
+    }
+    outb(COM1_PORT + UART_MCR, 0x0B); // DTR, RTS, OUT2 (routes the IRQ line)
+
+    serial_present = true;
+    serial_ier = UART_IER_RX;
+    outb(COM1_PORT + UART_IER, serial_ier);
+    irq_install_handler(4, serial_irq);
+    klog("serial: 16550 on COM1 at 0x%x, 115200 baud", COM1_PORT, 0);
+}
+
+// Called with interrupts off. Once the transmit FIFO is empty, refill it
+// with up to 16 bytes in one go; keep the THRE interrupt armed only
+// while the ring still holds data.
+static void serial_fill_fifo(void) {
+    uint32_t tail = serial_tx_tail;
+    if (inb(COM1_PORT + UART_LSR) & UART_LSR_THRE) {
+        for (int i = 0; i < UART_FIFO_SIZE && tail != serial_tx_head; i++, tail++) {
+            outb(COM1_PORT + UART_DATA, serial_tx_buffer[tail & (SERIAL_TX_SIZE - 1)]);
+        }
+        serial_tx_tail = tail;
+    }
+
+    uint8_t ier = tail != serial_tx_head ? serial_ier | UART_IER_THRE : serial_ier & ~UART_IER_THRE;
+    if (ier != serial_ier) {
+        serial_ier = ier;
+        outb(COM1_PORT + UART_IER, ier);
+    }
+}
+
+// Refill the FIFO from any CPU
+static void serial_kick(void) {
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
+    serial_fill_fifo();
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+// Queue bytes for COM1. Never waits on the UART per byte; only a full
+// ring blocks, until the THRE interrupt (or, with interrupts off or on
+// another CPU than the boot CPU, a polled refill) makes room. Writers
+// are serialized by the console lock, see console_lock().
+void serial_write(const char *text, size_t length) {
+    if (!serial_present) {
+        return;
+    }
+    for (size_t i = 0; i < length; i++) {
+        while (serial_tx_head - serial_tx_tail >= SERIAL_TX_SIZE) {
+            serial_kick();
+            if (interrupts_enabled() && this_cpu()->index == 0) {
+                __asm__ __volatile__("hlt"); // Only the boot CPU gets the THRE interrupt
+            } else {
+                __asm__ __volatile__("pause");
+            }
+        }
+        serial_tx_buffer[serial_tx_head & (SERIAL_TX_SIZE - 1)] = text[i];
+        serial_tx_head++;
+    }
+    serial_kick();
+}
+
+// Push everything queued out by polling; for panics, with interrupts off
+void serial_drain(void) {
+    while (serial_present && serial_tx_tail != serial_tx_head) {
+        serial_fill_fifo();
+    }
+}
+
+// IRQ4: service every pending UART condition
+void serial_irq(InterruptFrame *frame) {
+    (void)frame;
+    uint8_t iir;
+    while (!((iir = inb(COM1_PORT + UART_IIR)) & 0x01)) {
+        switch (iir & 0x0E) {
+            case 0x02: // Transmit FIFO empty
+                spin_lock(&serial_lock);
+                serial_fill_fifo();
+                spin_unlock(&serial_lock);
+                break;
+            case 0x04: // Receive data available
+            case 0x0C: // Receive timeout
+                while (inb(COM1_PORT + UART_LSR) & UART_LSR_DATA_READY) {
+                    uint8_t c = inb(COM1_PORT + UART_DATA);
+                    uint32_t head = serial_rx_head;
+                    if (head - serial_rx_tail >= SERIAL_RX_SIZE) {
+                        serial_rx_dropped++;
+                        klog("serial: input ring full, dropped %c", c, 0);
+                        continue;
+                    }
+                    serial_rx_buffer[head & (SERIAL_RX_SIZE - 1)] = c;
+                    __asm__ __volatile__("" : : : "memory"); // Publish the byte before the index
+                    serial_rx_head = head + 1;
+                }
+                input_wake();
+                break;
+            case 0x06: // Line status
+                inb(COM1_PORT + UART_LSR);
+                break;
+            default: // Modem status
+                inb(COM1_PORT + UART_MSR);
+                break;
+        }
+    }
+}
+
+// Pop one received byte; returns false when the ring is empty
+bool serial_read_char(char *c) {
+    uint32_t tail = serial_rx_tail;
+    if (tail == serial_rx_head) {
+        return false;
+    }
+    __asm__ __volatile__("" : : : "memory");
+    *c = serial_rx_buffer[tail & (SERIAL_RX_SIZE - 1)];
+    __asm__ __volatile__("" : : : "memory"); // Consume the byte before freeing the slot
+    serial_rx_tail = tail + 1;
+    return true;
+}
+
+// Feed serial input to the line editor like keyboard input
+void handle_serial_input(void) {
+    char c;
+    while (serial_read_char(&c)) {
+        bool was_cr = serial_last_cr;
+        serial_last_cr = c == '\r';
+        if (c == '\r' || (c == '\n' && !was_cr)) {
+            handle_key('\n');
+        } else if (c == '\b' || c == 0x7F) {
+            handle_key('\b');
+        } else if (c >= ' ' && c < 0x7F) {
+            handle_key(c);
+        }
+    }
+}
+
+bool input_pending(void) {
+    return keyboard_head != keyboard_tail || serial_rx_head != serial_rx_tail;
+}
+
+// Mirror text drawn at (row, col) to the serial line. Text further
+// right on the row the line is on continues it (padded with spaces);
+// text on a later row starts that many lines down, anything else
+// starts a fresh line.
+void console_mirror(uint16_t row, uint16_t col, const char *text, size_t length) {
+    if (!serial_present || serial_muted || thread_quiet() || length == 0) {
+        return;
+    }
+    if (row != serial_row || col < serial_col) {
+        int newlines = serial_row >= 0 && row > serial_row ? row - serial_row : 1;
+        if (serial_line_start) {
+            newlines--;
+        }
+        while (newlines-- > 0) {
+            serial_write("\r\n", 2);
+        }
+        serial_row = row;
+        serial_col = 0;
+    }
+    while (serial_col < col) {
+        uint16_t pad = col - serial_col < 16 ? col - serial_col : 16;
+        serial_write("                ", pad);
+        serial_col += pad;
+    }
+    serial_write(text, length);
+    serial_col += length;
+    serial_line_start = false;
+}
+
+// Stop or resume mirroring; the next mirrored text starts a new line
+void console_mute(bool muted) {
+    serial_muted = muted;
+    serial_row = -1;
+}
+
+// The screen moved up a row, and so did the row the serial line is on
+void console_scrolled(void) {
+    if (serial_row >= 0) {
+        serial_row--;
+    }
+}
+
+// A complete line for the serial port only (e.g. kernel log output),
+// written between the mirrored lines
+void console_serial_line(const char *text, size_t length) {
+    if (!serial_present) {
+        return;
+    }
+    console_lock();
+    if (!serial_line_start) {
+        serial_write("\r\n", 2);
+    }
+    serial_write(text, length);
+    serial_write("\r\n", 2);
+    serial_line_start = true;
+    serial_row = -1;
+    serial_col = 0;
+    console_unlock();
+}
+
+// Backspace over the last mirrored character
+void console_erase(void) {
+    console_lock();
+    if (serial_present && serial_col > 0) {
+        serial_write("\b \b", 3);
+        serial_col--;
+    }
+    console_unlock();
+}
+
+// Globals for the sampling profiler
+#define PROF_HASH_BITS 12
+#define PROF_BUCKETS (1u << PROF_HASH_BITS) // EIP histogram slots
+#define PROF_MAX_USED (PROF_BUCKETS * 3 / 4) // Keep probe runs short
+#define PROF_TOP 10 // Hottest addresses shown on screen
+
+typedef struct {
+    uint32_t eip; // Only valid while count != 0
+    uint32_t count;
+} ProfBucket;
+
+static ProfBucket prof_table[PROF_BUCKETS]; // Open addressing, linear probing
+static volatile bool prof_running = false;
+static uint32_t prof_samples = 0;
+static uint32_t prof_dropped = 0; // Samples of new addresses once the table was full
+static uint32_t prof_used = 0;
+
+// Function Prototypes for the sampling profiler
+void prof_sample(uint32_t eip);
+void prof_reset(void);
+void prof_dump(void);
+
+// Count one timer-interrupt sample of the interrupted EIP
+void prof_sample(uint32_t eip) {
+    uint32_t slot = (eip * 2654435761u) >> (32 - PROF_HASH_BITS); // Fibonacci hashing
+    while (prof_table[slot].count && prof_table[slot].eip != eip) {
+        slot = (slot + 1) & (PROF_BUCKETS - 1);
+    }
+    prof_samples++;
+    if (prof_table[slot].count == 0) {
+        if (prof_used >= PROF_MAX_USED) {
+            prof_dropped++;
+            return;
+        }
+        prof_used++;
+        prof_table[slot].eip = eip;
+    }
+    prof_table[slot].count++;
+}
+
+void prof_reset(void) {
+    uint32_t flags = irq_save();
+    memset(prof_table, 0, sizeof(prof_table));
+    prof_samples = 0;
+    prof_dropped = 0;
+    prof_used = 0;
+    irq_restore(flags);
+}
+
+// Send the whole histogram to the serial port as "PROF <eip> <count>"
+// lines for tools/prof_symbolize.py, and show the hottest addresses
+void prof_dump(void) {
+    char line[64];
+
+    console_serial_line(line, ksnprintf(line, sizeof(line), "PROF BEGIN samples=%u dropped=%u",
+                                        prof_samples, prof_dropped));
+    for (uint32_t i = 0; i < PROF_BUCKETS; i++) {
+        if (prof_table[i].count == 0) {
+            continue;
+        }
+        console_serial_line(line, ksnprintf(line, sizeof(line), "PROF 0x%08X %u",
+                                            prof_table[i].eip, prof_table[i].count));
+    }
+    console_serial_line("PROF END", 8);
+
+    kprintf("Samples: %u, histogram sent to serial\n", prof_samples);
+
+    // Top addresses by repeated selection; PROF_TOP passes over the table
+    uint32_t shown_below = 0xFFFFFFFFu;
+    uint32_t shown_eip = 0;
+    for (int rank = 0; rank < PROF_TOP; rank++) {
+        ProfBucket best = { 0, 0 };
+        for (uint32_t i = 0; i < PROF_BUCKETS; i++) {
+            ProfBucket b = prof_table[i];
+            // Order by count, then address, so equal counts are each shown once
+            bool after_shown = b.count < shown_below || (b.count == shown_below && b.eip > shown_eip);
+            bool better = b.count > best.count || (b.count == best.count && b.count && b.eip < best.eip);
+            if (b.count && after_shown && better) {
+                best = b;
+            }
+        }
+        if (best.count == 0) {
+            break;
+        }
+        shown_below = best.count;
+        shown_eip = best.eip;
+        kprintf("0x%08X %u\n", best.eip, best.count);
+    }
+}
+
+// Globals for timekeeping
+#define PIT_CHANNEL0_PORT 0x40
+#define PIT_COMMAND_PORT 0x43
+#define PIT_BASE_HZ 1193182
+#define TIMER_HZ 1000 // PIT channel 0 tick rate
+#define TSC_CALIBRATION_TICKS 50
+#define NS_PER_SEC 1000000000u
+#define CMOS_ADDRESS_PORT 0x70
+#define CMOS_DATA_PORT 0x71
+
+static volatile uint32_t timer_ticks = 0; // PIT ticks since pit_init()
+static uint32_t pit_divisor = 0;
+static bool timer_tickless = false; // Timers run off one-shot local APIC timers, not the PIT tick
+static uint32_t tick_ns = 0; // Real length of one PIT tick
+static bool tsc_available = false;
+static uint64_t tsc_boot = 0; // TSC value that ktime_ns() counts from
+static uint32_t tsc_khz = 0;
+static uint32_t tsc_mult = 0; // ns = (cycles * tsc_mult) >> tsc_shift
+static uint32_t tsc_shift = 0;
+static uint32_t rtc_boot_seconds = 0; // Wall clock (seconds since midnight) at rtc_boot_ns
+static uint64_t rtc_boot_ns = 0;
+
+// Function Prototypes for timekeeping
+void pit_init(uint32_t hz);
+void pit_stop(void);
+void timer_irq(InterruptFrame *frame);
+void tsc_calibrate(void);
+void rtc_init(void);
+uint64_t ktime_ns(void);
+
+// (value * mult) >> shift without a 128-bit intermediate
+static inline uint64_t mul_u64_u32_shr(uint64_t value, uint32_t mult, uint32_t shift) {
+    uint32_t low = (uint32_t)value;
+    uint32_t high = (uint32_t)(value >> 32);
+    uint64_t result = ((uint64_t)low * mult) >> shift;
+    if (high) {
+        result += ((uint64_t)high * mult) << (32 - shift);
+    }
+    return result;
+}
+
+// Program PIT channel 0 as a rate generator firing IRQ0 at hz
+void pit_init(uint32_t hz) {
+    pit_divisor = PIT_BASE_HZ / hz;
+    tick_ns = (uint32_t)div_u64_u32((uint64_t)pit_divisor * NS_PER_SEC, PIT_BASE_HZ, NULL);
+    outb(PIT_COMMAND_PORT, 0x34); // Channel 0, lobyte/hibyte, mode 2
+    outb(PIT_CHANNEL0_PORT, pit_divisor & 0xFF);
+    outb(PIT_CHANNEL0_PORT, (pit_divisor >> 8) & 0xFF);
+    irq_install_handler(0, timer_irq);
+}
+
+// Only the clock once the local APIC timers have taken over, and not even
+// that when the TSC keeps time; see timer_tickless
+void timer_irq(InterruptFrame *frame) {
+    timer_ticks++;
+    if (!timer_tickless) {
+        timer_interrupt(frame);
+    }
+}
+
+// Stop PIT channel 0: mode 0 waits for a count that never comes
+void pit_stop(void) {
+    irq_set_mask(0, true);
+    outb(PIT_COMMAND_PORT, 0x30); // Channel 0, lobyte/hibyte, mode 0
+}
+
+// Count TSC cycles across a fixed number of PIT ticks and derive the
+// mult/shift pair used by ktime_ns(). Needs interrupts enabled.
+void tsc_calibrate(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    tsc_available = (edx & (1 << 4)) != 0;
+    if (!tsc_available) {
+        return;
+    }
+
+    // Start on a tick edge so the window is whole ticks
+    uint32_t start = timer_ticks;
+    while (timer_ticks == start) {
+        __asm__ __volatile__("hlt");
+    }
+    start = timer_ticks;
+    uint64_t tsc_start = rdtsc();
+    while (timer_ticks - start < TSC_CALIBRATION_TICKS) {
+        __asm__ __volatile__("hlt");
+    }
+    uint64_t cycles = rdtsc() - tsc_start;
+
+    // cycles / (ticks * divisor / PIT_BASE_HZ) seconds, in kHz
+    tsc_khz = (uint32_t)div_u64_u32(cycles * PIT_BASE_HZ, TSC_CALIBRATION_TICKS * pit_divisor * 1000, NULL);
+    if (tsc_khz == 0) {
+        tsc_available = false;
+        return;
+    }
+
+    // Largest shift that keeps the multiplier in 32 bits
+    tsc_shift = 32;
+    while (tsc_shift > 0 && div_u64_u32((uint64_t)1000000 << tsc_shift, tsc_khz, NULL) > 0xFFFFFFFFu) {
+        tsc_shift--;
+    }
+    tsc_mult = (uint32_t)div_u64_u32((uint64_t)1000000 << tsc_shift, tsc_khz, NULL);
+    klog("tsc: %u kHz", tsc_khz, 0);
+
+    // Keep the clock continuous with the PIT-based count used so far
+    uint64_t elapsed_ns = (uint64_t)timer_ticks * tick_ns;
+    tsc_boot = rdtsc() - div_u64_u32(elapsed_ns * tsc_khz, 1000000, NULL);
+}
+
+// Nanoseconds since pit_init(); one rdtsc plus a multiply once calibrated
+uint64_t ktime_ns(void) {
+    if (tsc_available) {
+        return mul_u64_u32_shr(rdtsc() - tsc_boot, tsc_mult, tsc_shift);
+    }
+    return (uint64_t)timer_ticks * tick_ns;
+}
+
+static uint8_t cmos_read(uint8_t reg) {
+    outb(CMOS_ADDRESS_PORT, reg);
+    return inb(CMOS_DATA_PORT);
+}
+
+static uint8_t bcd_to_binary(uint8_t value) {
+    return (value & 0x0F) + (value >> 4) * 10;
+}
+
+// Read the RTC once at boot; sysclock advances it with ktime_ns()
+void rtc_init(void) {
+    uint8_t seconds, minutes, hours;
+    do {
+        while (cmos_read(0x0A) & 0x80); // Wait out an update in progress
+        seconds = cmos_read(0x00);
+        minutes = cmos_read(0x02);
+        hours = cmos_read(0x04);
+    } while (seconds != cmos_read(0x00));
+
+    uint8_t status_b = cmos_read(0x0B);
+    bool pm = (hours & 0x80) != 0;
+    hours &= 0x7F;
+    if (!(status_b & 0x04)) { // BCD mode
+        seconds = bcd_to_binary(seconds);
+        minutes = bcd_to_binary(minutes);
+        hours = bcd_to_binary(hours);
+    }
+    if (!(status_b & 0x02)) { // 12-hour mode
+        hours = (hours % 12) + (pm ? 12 : 0);
+    }
+
+    rtc_boot_seconds = hours * 3600 + minutes * 60 + seconds;
+    rtc_boot_ns = ktime_ns();
+}
+
+// Globals for timers
+#define TIMER_MAX_ARM_NS NS_PER_SEC // Longest one-shot; later deadlines take another round
+
+typedef struct Timer {
+    uint64_t deadline; // ktime_ns() at which it fires
+    uint64_t period; // Fires again this much later, 0 for once
+    void (*fire)(struct Timer *timer, InterruptFrame *frame); // Interrupts off
+    void *arg;
+    int32_t slot; // Heap index while pending, -1 otherwise
+    uint32_t cpu; // CPU whose heap holds it
+} Timer;
+
+// Function Prototypes for timers
+void timer_init(Timer *timer, void (*fire)(Timer *timer, InterruptFrame *frame), void *arg);
+bool timer_add(Timer *timer, uint64_t deadline, uint64_t period);
+void timer_cancel(Timer *timer);
+void timer_interrupt(InterruptFrame *frame);
+void lapic_timer_arm(uint32_t delta_ns);
+
+// Heap helpers run with the CPU's timer_lock held
+static void timer_sift_up(Cpu *cpu, uint32_t slot) {
+    Timer *timer = cpu->timers[slot];
+    while (slot > 0) {
+        uint32_t parent = (slot - 1) / 2;
+        if (cpu->timers[parent]->deadline <= timer->deadline) {
+            break;
+        }
+        cpu->timers[slot] = cpu->timers[parent];
+        cpu->timers[slot]->slot = slot;
+        slot = parent;
+    }
+    cpu->timers[slot] = timer;
+    timer->slot = slot;
+}
+
+static void timer_sift_down(Cpu *cpu, uint32_t slot) {
+    Timer *timer = cpu->timers[slot];
+    while (1) {
+        uint32_t child = slot * 2 + 1;
+        if (child >= cpu->timer_count) {
+            break;
+        }
+        if (child + 1 < cpu->timer_count && cpu->timers[child + 1]->deadline < cpu->timers[child]->deadline) {
+            child++;
+        }
+        if (timer->deadline <= cpu->timers[child]->deadline) {
+            break;
+        }
+        cpu->timers[slot] = cpu->timers[child];
+        cpu->timers[slot]->slot = slot;
+        slot = child;
+    }
+    cpu->timers[slot] = timer;
+    timer->slot = slot;
+}
+
+static bool timer_heap_insert(Cpu *cpu, Timer *timer) {
+    if (cpu->timer_count == TIMER_HEAP_SIZE) {
+        return false;
+    }
+    timer->cpu = cpu->index;
+    cpu->timers[cpu->timer_count] = timer;
+    timer_sift_up(cpu, cpu->timer_count++);
+    return true;
+}
+
+static void timer_heap_remove(Cpu *cpu, Timer *timer) {
+    uint32_t slot = timer->slot;
+    Timer *last = cpu->timers[--cpu->timer_count];
+    timer->slot = -1;
+    if (last != timer) {
+        cpu->timers[slot] = last;
+        last->slot = slot;
+        timer_sift_up(cpu, slot);
+        timer_sift_down(cpu, last->slot);
+    }
+}
+
+// Point this CPU's local APIC timer at its next event: the earliest
+// timer or the end of the running thread's slice. With neither it stays
+// stopped, and an idle CPU sleeps until a device interrupt or an IPI.
+// Interrupts off.
+static void timer_program(Cpu *cpu) {
+    if (!timer_tickless) {
+        return; // The PIT tick looks at the deadlines instead
+    }
+    uint64_t next = cpu->slice_end;
+    spin_lock(&cpu->timer_lock);
+    if (cpu->timer_count && (next == 0 || cpu->timers[0]->deadline < next)) {
+        next = cpu->timers[0]->deadline;
+    }
+    spin_unlock(&cpu->timer_lock);
+    if (next == cpu->timer_armed) {
+        return;
+    }
+    cpu->timer_armed = next;
+    if (next == 0) {
+        lapic_timer_arm(0);
+        return;
+    }
+    uint64_t now = ktime_ns();
+    uint64_t delta = next > now ? next - now : 1;
+    lapic_timer_arm(delta < TIMER_MAX_ARM_NS ? (uint32_t)delta : TIMER_MAX_ARM_NS);
+}
+
+void timer_init(Timer *timer, void (*fire)(Timer *timer, InterruptFrame *frame), void *arg) {
+    timer->fire = fire;
+    timer->arg = arg;
+    timer->slot = -1;
+}
+
+// Queue a timer on this CPU to fire at deadline, then every period ns if
+// period is non-zero. False when this CPU already has TIMER_HEAP_SIZE.
+bool timer_add(Timer *timer, uint64_t deadline, uint64_t period) {
+    uint32_t flags = irq_save();
+    Cpu *cpu = this_cpu();
+    timer->deadline = deadline;
+    timer->period = period;
+    spin_lock(&cpu->timer_lock);
+    bool added = timer_heap_insert(cpu, timer);
+    spin_unlock(&cpu->timer_lock);
+    if (added) {
+        timer_program(cpu);
+    }
+    irq_restore(flags);
+    return added;
+}
+
+// Take a timer out of its CPU's heap; a no-op if it is not pending. The
+// other CPU may still be running its fire function.
+void timer_cancel(Timer *timer) {
+    Cpu *cpu = &cpus[timer->cpu];
+    uint32_t flags = spin_lock_irqsave(&cpu->timer_lock);
+    if (timer->slot >= 0) {
+        timer_heap_remove(cpu, timer);
+    }
+    spin_unlock_irqrestore(&cpu->timer_lock, flags);
+}
+
+// Local APIC timer interrupt, or the PIT tick until that takes over: run
+// the timers that are due, end the time slice if it is over and program
+// the next event
+void timer_interrupt(InterruptFrame *frame) {
+    Cpu *cpu = this_cpu();
+    cpu->timer_irqs++;
+    cpu->timer_armed = 0; // The one-shot has gone off
+    uint64_t now = ktime_ns();
+    while (1) {
+        spin_lock(&cpu->timer_lock);
+        Timer *timer = cpu->timer_count ? cpu->timers[0] : NULL;
+        if (timer == NULL || timer->deadline > now) {
+            spin_unlock(&cpu->timer_lock);
+            break;
+        }
+        timer_heap_remove(cpu, timer);
+        if (timer->period) {
+            timer->deadline += timer->period;
+            if (timer->deadline <= now) {
+                timer->deadline = now + timer->period; // Skip periods that were missed
+            }
+            timer_heap_insert(cpu, timer);
+        }
+        spin_unlock(&cpu->timer_lock);
+        timer->fire(timer, frame);
+    }
+    if (cpu->slice_end && now >= cpu->slice_end) {
+        sched_slice_end();
+    }
+    timer_program(cpu);
+}
+
+// Globals for the kernel log
+#define KLOG_ENTRIES 1024 // Must be a power of two
+#define KLOG_LINE_LEN 128
+
+// Arguments are stored by value and formatted only when the entry is
+// read, so %s arguments must point at strings that stay around
+typedef struct {
+    volatile uint32_t seq; // seq + 1 once the entry is complete, 0 while it is written
+    const char *fmt;
+    uint32_t args[2];
+    uint64_t timestamp; // ktime_ns() when logged
+} KlogEntry;
+
+static KlogEntry klog_ring[KLOG_ENTRIES];
+static volatile uint32_t klog_next = 0; // Sequence number of the next entry
+static uint32_t klog_serial_next = 0; // Next entry klog_drain_serial() sends
+
+// Function Prototypes for the kernel log
+bool klog_read(uint32_t seq, KlogEntry *entry);
+size_t klog_render(const KlogEntry *entry, char *out, size_t size);
+void display_klog(uint32_t count);
+
+// Append a message. Lock-free and safe from IRQ handlers: the atomic
+// increment hands every writer its own slot, and readers ignore slots
+// whose seq does not match. One rdtsc and a few stores otherwise.
+void klog(const char *fmt, uint32_t arg0, uint32_t arg1) {
+    uint32_t seq = __atomic_fetch_add(&klog_next, 1, __ATOMIC_RELAXED);
+    KlogEntry *entry = &klog_ring[seq & (KLOG_ENTRIES - 1)];
+    entry->seq = 0;
+    __asm__ __volatile__("" : : : "memory");
+    entry->fmt = fmt;
+    entry->args[0] = arg0;
+    entry->args[1] = arg1;
+    entry->timestamp = ktime_ns();
+    __asm__ __volatile__("" : : : "memory"); // Fill the entry before publishing it
+    entry->seq = seq + 1;
+}
+
+// Copy entry seq out of the ring; false if it was overwritten (or is
+// still being written) before or during the copy
+bool klog_read(uint32_t seq, KlogEntry *entry) {
+    const KlogEntry *slot = &klog_ring[seq & (KLOG_ENTRIES - 1)];
+    if (slot->seq != seq + 1) {
+        return false;
+    }
+    __asm__ __volatile__("" : : : "memory");
+    entry->fmt = slot->fmt;
+    entry->args[0] = slot->args[0];
+    entry->args[1] = slot->args[1];
+    entry->timestamp = slot->timestamp;
+    __asm__ __volatile__("" : : : "memory");
+    entry->seq = seq + 1;
+    return slot->seq == seq + 1;
+}
+
+// "[seconds.micros] message", at most size - 1 characters. The message
+// is entry->fmt formatted by ksnprintf() with the two logged arguments.
+size_t klog_render(const KlogEntry *entry, char *out, size_t size) {
+    uint32_t micros;
+    uint32_t seconds = (uint32_t)div_u64_u32(div_u64_u32(entry->timestamp, 1000, NULL), 1000000, &micros);
+    size_t length = ksnprintf(out, size, "[%5u.%06u] ", seconds, micros);
+    if (length < size) {
+        length += ksnprintf(out + length, size - length, entry->fmt, entry->args[0], entry->args[1]);
+    }
+    return length < size ? length : size - 1;
+}
+
+// Send entries logged since the last call to the serial port. Runs
+// from the main loop, so loggers never wait on the UART.
+void klog_drain_serial(void) {
+    uint32_t next = klog_next;
+    if (next - klog_serial_next > KLOG_ENTRIES) {
+        klog_serial_next = next - KLOG_ENTRIES; // The rest was overwritten
+    }
+    for (; klog_serial_next != next; klog_serial_next++) {
+        KlogEntry entry;
+        char line[KLOG_LINE_LEN];
+        if (klog_read(klog_serial_next, &entry)) {
+            console_serial_line(line, klog_render(&entry, line, sizeof(line)));
+        }
+    }
+}
+
+// Print the last count entries (all retained ones if count is 0);
+// PgUp pages back through them
+void display_klog(uint32_t count) {
+    uint32_t next = klog_next;
+    uint32_t available = next < KLOG_ENTRIES ? next : KLOG_ENTRIES;
+    if (count == 0 || count > available) {
+        count = available;
+    }
+    for (uint32_t seq = next - count; seq != next; seq++) {
+        KlogEntry entry;
+        char line[KLOG_LINE_LEN];
+        if (klog_read(seq, &entry)) {
+            klog_render(&entry, line, SCREEN_WIDTH + 1); // One screen row
+            print_line(line);
+        }
+    }
+}
+
+// Globals for physical memory
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+#define MULTIBOOT_INFO_MEMORY 0x001
+#define MULTIBOOT_INFO_MODS 0x008
+#define MULTIBOOT_INFO_MEM_MAP 0x040
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+#define MAX_ORDER 10 // Largest buddy block: 2^10 pages (4 MB)
+#define FRAME_FREE 0x80 // frame_info flag: first frame of a free block
+#define FRAME_SLAB 0x40 // frame_info flag: page is a kmalloc slab
+#define FRAME_ORDER_MASK 0x0F
+#define LOW_MEMORY_END 0x100000 // Below 1 MB belongs to the BIOS and real-mode code
+
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+} __attribute__((packed)) MultibootInfo;
+
+typedef struct {
+    uint32_t size; // Size of the rest of the entry
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+} __attribute__((packed)) MultibootMmapEntry;
+
+typedef struct {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t string;
+    uint32_t reserved;
+} __attribute__((packed)) MultibootModule;
+
+// Free blocks are linked through their own first bytes
+typedef struct FreeBlock {
+    struct FreeBlock *next;
+    struct FreeBlock *prev;
+} FreeBlock;
+
+extern uint8_t kernel_start[], kernel_end[]; // Defined in link.ld
+
+static MultibootInfo *boot_info = NULL; // NULL when not started by a multiboot loader
+static FreeBlock *free_lists[MAX_ORDER + 1];
+static uint8_t *frame_info = NULL; // One byte per frame: FRAME_FREE | order
+static uint32_t frame_count = 0; // Frames covered by frame_info
+static uint32_t total_frames = 0; // Usable frames handed to the allocator
+static uint32_t free_frames = 0;
+
+// Function Prototypes for physical memory
+void pmm_init(MultibootInfo *info);
+uint32_t alloc_pages(uint32_t order);
+void free_pages(uint32_t address, uint32_t order);
+uint32_t alloc_page(void);
+void free_page(uint32_t address);
+
+static void free_list_push(uint32_t pfn, uint32_t order) {
+    FreeBlock *block = (FreeBlock *)(pfn << PAGE_SHIFT);
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    free_lists[order] = block;
+    frame_info[pfn] = FRAME_FREE | order;
+}
+
+static void free_list_remove(uint32_t pfn, uint32_t order) {
+    FreeBlock *block = (FreeBlock *)(pfn << PAGE_SHIFT);
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        free_lists[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    frame_info[pfn] = order;
+}
+
+// Allocate 2^order contiguous frames; returns the physical address or 0.
+// Splits the smallest larger block, so it is O(MAX_ORDER).
+uint32_t alloc_pages(uint32_t order) {
+    uint32_t current = order;
+    while (current <= MAX_ORDER && free_lists[current] == NULL) {
+        current++;
+    }
+    if (current > MAX_ORDER) {
+        return 0;
+    }
+
+    uint32_t pfn = (uint32_t)free_lists[current] >> PAGE_SHIFT;
+    free_list_remove(pfn, current);
+    while (current > order) {
+        current--;
+        free_list_push(pfn + (1u << current), current); // Upper half goes back
+    }
+    frame_info[pfn] = order;
+    free_frames -= 1u << order;
+    return pfn << PAGE_SHIFT;
+}
+
+// Return a block, merging with its buddy while the buddy is free too
+void free_pages(uint32_t address, uint32_t order) {
+    uint32_t pfn = address >> PAGE_SHIFT;
+    if (pfn >= frame_count || (frame_info[pfn] & FRAME_FREE)) {
+        return; // Not ours, or a double free
+    }
+    free_frames += 1u << order;
+
+    while (order < MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        if (buddy >= frame_count || frame_info[buddy] != (FRAME_FREE | order)) {
+            break;
+        }
+        free_list_remove(buddy, order);
+        pfn &= ~(1u << order);
+        order++;
+    }
+    free_list_push(pfn, order);
+}
+
+uint32_t alloc_page(void) {
+    return alloc_pages(0);
+}
+
+void free_page(uint32_t address) {
+    free_pages(address, 0);
+}
+
+// Hand [start, end) to the allocator as the largest aligned blocks that fit
+static void pmm_free_range(uint32_t start, uint32_t end) {
+    uint32_t pfn = (start + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    uint32_t last = end >> PAGE_SHIFT;
+    while (pfn < last) {
+        uint32_t order = MAX_ORDER;
+        while (order > 0 && ((pfn & ((1u << order) - 1)) || pfn + (1u << order) > last)) {
+            order--;
+        }
+        frame_info[pfn] = order; // Looks allocated so free_pages accepts it
+        free_pages(pfn << PAGE_SHIFT, order);
+        total_frames += 1u << order;
+        pfn += 1u << order;
+    }
+}
+
+// Free the parts of [start, end) that do not overlap any reserved range
+static void pmm_add_region(uint32_t start, uint32_t end, const uint32_t (*reserved)[2], int reserved_count) {
+    for (int i = 0; i < reserved_count && start < end; i++) {
+        uint32_t res_start = reserved[i][0] & ~(PAGE_SIZE - 1);
+        uint32_t res_end = (reserved[i][1] + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        if (res_end <= start || res_start >= end) {
+            continue;
+        }
+        if (res_start > start) {
+            pmm_add_region(start, res_start, reserved + i + 1, reserved_count - i - 1);
+        }
+        start = res_end;
+    }
+    if (start < end) {
+        pmm_free_range(start, end);
+    }
+}
+
+// Calls fn for each usable RAM region below 4 GB in the multiboot map
+static void for_each_ram_region(MultibootInfo *info, void (*fn)(uint32_t start, uint32_t end, void *ctx), void *ctx) {
+    if (info->flags & MULTIBOOT_INFO_MEM_MAP) {
+        uint32_t entry = info->mmap_addr;
+        while (entry < info->mmap_addr + info->mmap_length) {
+            MultibootMmapEntry *mmap = (MultibootMmapEntry *)entry;
+            if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE && mmap->addr < 0x100000000ULL) {
+                uint64_t end = mmap->addr + mmap->len;
+                fn((uint32_t)mmap->addr, end > 0xFFFFF000ULL ? 0xFFFFF000u : (uint32_t)end, ctx);
+            }
+            entry += mmap->size + sizeof(mmap->size);
+        }
+    } else if (info->flags & MULTIBOOT_INFO_MEMORY) {
+        fn(LOW_MEMORY_END, LOW_MEMORY_END + info->mem_upper * 1024, ctx);
+    }
+}
+
+static void find_memory_top(uint32_t start, uint32_t end, void *ctx) {
+    uint32_t *top = ctx;
+    if (end > *top) {
+        *top = end;
+    }
+}
+
+// First page-aligned spot of at least size bytes above the kernel image
+// that overlaps none of the reserved ranges
+typedef struct {
+    uint32_t size;
+    uint32_t floor;
+    const uint32_t (*reserved)[2];
+    int reserved_count;
+    uint32_t found;
+} PlacementSearch;
+
+static void find_placement(uint32_t start, uint32_t end, void *ctx) {
+    PlacementSearch *search = ctx;
+    if (search->found) {
+        return;
+    }
+    if (start < search->floor) {
+        start = search->floor;
+    }
+    start = (start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    int i = 0;
+    while (start < end && end - start >= search->size) {
+        if (i == search->reserved_count) {
+            search->found = start;
+            return;
+        }
+        uint32_t res_start = search->reserved[i][0] & ~(PAGE_SIZE - 1);
+        uint32_t res_end = (search->reserved[i][1] + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        if (res_end > start && res_start < start + search->size) {
+            start = res_end; // Skip past it and check every range again
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+}
+
+typedef struct {
+    uint32_t (*reserved)[2];
+    int count;
+} RegionContext;
+
+static void add_ram_region(uint32_t start, uint32_t end, void *ctx) {
+    RegionContext *regions = ctx;
+    if (start < LOW_MEMORY_END) {
+        start = LOW_MEMORY_END;
+    }
+    if (start < end) {
+        pmm_add_region(start, end, (const uint32_t (*)[2])regions->reserved, regions->count);
+    }
+}
+
+// Build the buddy allocator from the multiboot memory map. Everything
+// the kernel or bootloader still uses is kept out: low memory, the
+// kernel image, the boot info structures and any modules.
+void pmm_init(MultibootInfo *info) {
+    if (info == NULL) {
+        return;
+    }
+
+    uint32_t top = 0;
+    for_each_ram_region(info, find_memory_top, &top);
+    frame_count = top >> PAGE_SHIFT;
+
+    uint32_t reserved[8 + 16][2];
+    int capacity = 8 + 16 - 1; // Keep the last slot for frame_info
+    int count = 0;
+    reserved[count][0] = (uint32_t)kernel_start;
+    reserved[count++][1] = (uint32_t)kernel_end;
+    reserved[count][0] = (uint32_t)info;
+    reserved[count++][1] = (uint32_t)info + sizeof(MultibootInfo);
+    if (info->flags & MULTIBOOT_INFO_MEM_MAP) {
+        reserved[count][0] = info->mmap_addr;
+        reserved[count++][1] = info->mmap_addr + info->mmap_length;
+    }
+    if (info->flags & MULTIBOOT_INFO_MODS) {
+        MultibootModule *modules = (MultibootModule *)info->mods_addr;
+        uint32_t merged = 0;
+        reserved[count][0] = info->mods_addr;
+        reserved[count++][1] = info->mods_addr + info->mods_count * sizeof(MultibootModule);
+        for (uint32_t i = 0; i < info->mods_count; i++) {
+            if (count < capacity) {
+                reserved[count][0] = modules[i].mod_start;
+                reserved[count++][1] = modules[i].mod_end;
+                continue;
+            }
+            // Out of slots: widen the last range to cover this module too,
+            // giving up the free memory in between rather than the module
+            if (modules[i].mod_start < reserved[count - 1][0]) {
+                reserved[count - 1][0] = modules[i].mod_start;
+            }
+            if (modules[i].mod_end > reserved[count - 1][1]) {
+                reserved[count - 1][1] = modules[i].mod_end;
+            }
+            merged++;
+        }
+        if (merged) {
+            klog("pmm: %u modules share one reserved range", merged + 1, 0);
+        }
+    }
+
+    // frame_info goes above the kernel, outside everything reserved so far
+    PlacementSearch search = { frame_count, (uint32_t)kernel_end, (const uint32_t (*)[2])reserved, count, 0 };
+    for_each_ram_region(info, find_placement, &search);
+    if (search.found == 0) {
+        frame_count = 0;
+        return;
+    }
+    frame_info = (uint8_t *)search.found;
+    memset(frame_info, 0, frame_count);
+    reserved[count][0] = search.found;
+    reserved[count++][1] = search.found + frame_count;
+
+    RegionContext regions = { reserved, count };
+    for_each_ram_region(info, add_ram_region, &regions);
+    klog("pmm: %u KB usable, %u reserved ranges", total_frames * (PAGE_SIZE / 1024), count);
+}
+
+// Globals for the kernel heap
+#define SLAB_HEADER_SIZE 32 // Objects start this far into each slab page
+
+struct SlabCache;
+
+// A slab is one page: this header, then equal-sized objects. Free
+// objects are linked through their first word.
+typedef struct Slab {
+    struct Slab *next; // Neighbours in the cache's partial list
+    struct Slab *prev;
+    struct SlabCache *cache;
+    void *free_list;
+    uint16_t in_use;
+    uint16_t capacity;
+} Slab;
+
+typedef struct SlabCache {
+    uint32_t object_size;
+    Slab *partial; // Slabs with at least one free object; full ones are not listed
+    uint32_t slab_count;
+    uint32_t in_use; // Live objects
+    uint32_t allocs;
+    uint32_t frees;
+} SlabCache;
+
+// Size classes, smallest first. Requests above the last one get whole
+// buddy blocks from alloc_pages().
+static SlabCache kmalloc_caches[] = {
+    { .object_size = 16 }, { .object_size = 32 }, { .object_size = 48 }, { .object_size = 64 },
+    { .object_size = 96 }, { .object_size = 128 }, { .object_size = 192 }, { .object_size = 256 },
+    { .object_size = 384 }, { .object_size = 512 }, { .object_size = 768 }, { .object_size = 1024 },
+};
+#define KMALLOC_CACHE_COUNT (sizeof(kmalloc_caches) / sizeof(kmalloc_caches[0]))
+
+static uint32_t large_allocs = 0;
+static uint32_t large_frees = 0;
+static uint32_t large_pages = 0; // Frames held by live large allocations
+
+// Function Prototypes for the kernel heap
+void display_heap_stats(void);
+
+static void slab_link(SlabCache *cache, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (slab->next) {
+        slab->next->prev = slab;
+    }
+    cache->partial = slab;
+}
+
+static void slab_unlink(SlabCache *cache, Slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        cache->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// Take a page for cache and thread all of its objects onto the free list
+static Slab *slab_create(SlabCache *cache) {
+    uint32_t page = alloc_page();
+    if (page == 0) {
+        return NULL;
+    }
+    frame_info[page >> PAGE_SHIFT] |= FRAME_SLAB;
+
+    Slab *slab = (Slab *)page;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->capacity = (PAGE_SIZE - SLAB_HEADER_SIZE) / cache->object_size;
+    slab->free_list = NULL;
+    // Push from the end so objects are handed out in address order
+    uint8_t *object = (uint8_t *)page + SLAB_HEADER_SIZE + (slab->capacity - 1) * cache->object_size;
+    for (uint32_t i = 0; i < slab->capacity; i++, object -= cache->object_size) {
+        *(void **)object = slab->free_list;
+        slab->free_list = object;
+    }
+    slab_link(cache, slab);
+    cache->slab_count++;
+    return slab;
+}
+
+static SlabCache *cache_for_size(size_t size) {
+    for (size_t i = 0; i < KMALLOC_CACHE_COUNT; i++) {
+        if (size <= kmalloc_caches[i].object_size) {
+            return &kmalloc_caches[i];
+        }
+    }
+    return NULL;
+}
+
+// Smallest buddy order whose block holds size bytes
+static uint32_t order_for_size(size_t size) {
+    uint32_t order = 0;
+    while (order <= MAX_ORDER && ((size_t)PAGE_SIZE << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+// Allocate size bytes; NULL when size is 0 or memory ran out. Small
+// requests come from the matching slab cache in O(1), larger ones are
+// page-aligned buddy blocks.
+static void *heap_alloc(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    SlabCache *cache = cache_for_size(size);
+    if (cache == NULL) {
+        uint32_t order = order_for_size(size);
+        uint32_t address = order <= MAX_ORDER ? alloc_pages(order) : 0;
+        if (address == 0) {
+            return NULL;
+        }
+        large_allocs++;
+        large_pages += 1u << order;
+        return (void *)address;
+    }
+
+    Slab *slab = cache->partial;
+    if (slab == NULL && (slab = slab_create(cache)) == NULL) {
+        return NULL;
+    }
+    void *object = slab->free_list;
+    slab->free_list = *(void **)object;
+    slab->in_use++;
+    if (slab->free_list == NULL) {
+        slab_unlink(cache, slab);
+    }
+    cache->in_use++;
+    cache->allocs++;
+    return object;
+}
+
+// Release a kmalloc() pointer. The frame_info entry of its page says
+// whether it is a slab object or a large block and, for the latter, its
+// order, so no per-allocation header is needed.
+static void heap_free(void *ptr) {
+    uint32_t pfn = (uint32_t)ptr >> PAGE_SHIFT;
+    if (ptr == NULL || pfn >= frame_count) {
+        return;
+    }
+
+    if (!(frame_info[pfn] & FRAME_SLAB)) {
+        if (((uint32_t)ptr & (PAGE_SIZE - 1)) || (frame_info[pfn] & FRAME_FREE)) {
+            return; // Not from kmalloc, or a double free
+        }
+        uint32_t order = frame_info[pfn] & FRAME_ORDER_MASK;
+        large_frees++;
+        large_pages -= 1u << order;
+        free_pages((uint32_t)ptr, order);
+        return;
+    }
+
+    Slab *slab = (Slab *)((uint32_t)ptr & ~(PAGE_SIZE - 1));
+    SlabCache *cache = slab->cache;
+    if (slab->free_list == NULL) {
+        slab_link(cache, slab); // Was full, has room again
+    }
+    *(void **)ptr = slab->free_list;
+    slab->free_list = ptr;
+    slab->in_use--;
+    cache->in_use--;
+    cache->frees++;
+
+    // Return empty slabs, keeping one so a kmalloc/kfree pair at the
+    // boundary does not take and release a page every time
+    if (slab->in_use == 0 && (cache->partial != slab || slab->next != NULL)) {
+        slab_unlink(cache, slab);
+        cache->slab_count--;
+        frame_info[pfn] &= ~FRAME_SLAB;
+        free_page((uint32_t)slab);
+    }
+}
+
+// The heap and the buddy allocator under it are shared by every thread,
+// so each call runs with preemption off
+void *kmalloc(size_t size) {
+    preempt_disable();
+    void *ptr = heap_alloc(size);
+    preempt_enable();
+    return ptr;
+}
+
+void kfree(void *ptr) {
+    preempt_disable();
+    heap_free(ptr);
+    preempt_enable();
+}
+
+// Usable size of a kmalloc() block
+static size_t kmalloc_size(const void *ptr) {
+    uint32_t pfn = (uint32_t)ptr >> PAGE_SHIFT;
+    if (frame_info[pfn] & FRAME_SLAB) {
+        return ((const Slab *)((uint32_t)ptr & ~(PAGE_SIZE - 1)))->cache->object_size;
+    }
+    return (size_t)PAGE_SIZE << (frame_info[pfn] & FRAME_ORDER_MASK);
+}
+
+// Resize a block, moving it only when it has no room to grow. On
+// failure NULL is returned and ptr stays valid.
+void *krealloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return kmalloc(size);
+    }
+    size_t old_size = kmalloc_size(ptr);
+    if (size <= old_size) {
+        return ptr;
+    }
+    void *copy = kmalloc(size);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, ptr, old_size);
+    kfree(ptr);
+    return copy;
+}
+
+// One row per size class: slabs, live objects, counters and the share
+// of slab memory not holding live objects
+void display_heap_stats(void) {
+    print_line("  Size  Slabs  In use   Allocs    Frees  Frag%");
+    for (size_t i = 0; i < KMALLOC_CACHE_COUNT; i++) {
+        SlabCache *cache = &kmalloc_caches[i];
+        uint32_t slab_bytes = cache->slab_count * PAGE_SIZE;
+        uint32_t live_bytes = cache->in_use * cache->object_size;
+        uint32_t fragmentation = 0;
+        if (slab_bytes) {
+            fragmentation = (uint32_t)div_u64_u32((uint64_t)(slab_bytes - live_bytes) * 100, slab_bytes, NULL);
+        }
+        kprintf("%6u%7u%8u%9u%9u%7u\n", cache->object_size, cache->slab_count, cache->in_use,
+                cache->allocs, cache->frees, fragmentation);
+    }
+
+    // Large blocks: pages held, live blocks, counters
+    kprintf(" Large%7u%8u%9u%9u\n", large_pages, large_allocs - large_frees, large_allocs, large_frees);
+}
+
+// Globals for paging
+#define PTE_PRESENT 0x001
+#define PTE_WRITABLE 0x002
+#define PTE_WRITE_THROUGH 0x008
+#define PTE_CACHE_DISABLE 0x010
+#define PDE_LARGE 0x080 // 4 MB page, needs CR4.PSE
+#define PTE_GLOBAL 0x100 // Survives CR3 reloads in the TLB, needs CR4.PGE
+#define LARGE_PAGE_SHIFT 22
+#define LARGE_PAGE_SIZE (1u << LARGE_PAGE_SHIFT)
+#define CR0_WP (1u << 16)
+#define CR0_PG (1u << 31)
+#define CR4_PSE (1u << 4)
+#define CR4_PGE (1u << 7)
+#define RAM_TOP_UNKNOWN 0x80000000u // Assumed RAM top with no memory map; PC device holes start above 2 GB
+
+static uint32_t page_directory[1024] __attribute__((aligned(PAGE_SIZE)));
+static bool paging_enabled = false;
+static uint32_t page_tables = 0; // 4 MB mappings split into page tables
+
+// Function Prototypes for paging
+void paging_init(void);
+bool map_page(uint32_t virtual_address, uint32_t physical_address, uint32_t flags);
+bool unmap_page(uint32_t virtual_address);
+
+static inline void invlpg(uint32_t address) {
+    __asm__ __volatile__("invlpg (%0)" : : "r"(address) : "memory");
+}
+
+// Page table covering address. The first call for a 4 MB page splits it
+// into 1024 small entries with the same attributes; an unmapped region
+// gets an empty table. NULL when no frame is left for the table.
+static uint32_t *page_table_for(uint32_t address) {
+    uint32_t *pde = &page_directory[address >> LARGE_PAGE_SHIFT];
+    if ((*pde & PTE_PRESENT) && !(*pde & PDE_LARGE)) {
+        return (uint32_t *)(*pde & ~(PAGE_SIZE - 1));
+    }
+
+    uint32_t table_address = alloc_page();
+    if (table_address == 0) {
+        return NULL;
+    }
+    uint32_t *table = (uint32_t *)table_address;
+    if (*pde & PTE_PRESENT) {
+        uint32_t base = *pde & ~(LARGE_PAGE_SIZE - 1);
+        uint32_t flags = *pde & (PTE_PRESENT | PTE_WRITABLE | PTE_WRITE_THROUGH | PTE_CACHE_DISABLE | PTE_GLOBAL);
+        for (uint32_t i = 0; i < 1024; i++) {
+            table[i] = (base + (i << PAGE_SHIFT)) | flags;
+        }
+    } else {
+        memset(table, 0, PAGE_SIZE);
+    }
+    *pde = table_address | PTE_PRESENT | PTE_WRITABLE;
+    invlpg(address); // Drops the old 4 MB TLB entry, global or not
+    page_tables++;
+    return table;
+}
+
+// Map one 4 KB page; false when a page table could not be allocated
+bool map_page(uint32_t virtual_address, uint32_t physical_address, uint32_t flags) {
+    uint32_t *table = page_table_for(virtual_address);
+    if (table == NULL) {
+        return false;
+    }
+    table[(virtual_address >> PAGE_SHIFT) & 1023] = (physical_address & ~(PAGE_SIZE - 1)) | flags | PTE_PRESENT;
+    invlpg(virtual_address);
+    return true;
+}
+
+// Make one 4 KB page fault on access, e.g. a stack guard; false when
+// a page table could not be allocated and the page is still mapped
+bool unmap_page(uint32_t virtual_address) {
+    if (!(page_directory[virtual_address >> LARGE_PAGE_SHIFT] & PTE_PRESENT)) {
+        return true;
+    }
+    uint32_t *table = page_table_for(virtual_address);
+    if (table == NULL) {
+        return false;
+    }
+    table[(virtual_address >> PAGE_SHIFT) & 1023] = 0;
+    invlpg(virtual_address);
+    return true;
+}
+
+// Identity-map all 4 GB with 4 MB pages, so the kernel and RAM need
+// only a handful of TLB entries, marked global where supported.
+// Everything above RAM is device memory and mapped uncached; with no
+// memory map, RAM is assumed to end at RAM_TOP_UNKNOWN. The page below
+// the boot stack is then unmapped, which costs one page table for the
+// kernel's first 4 MB. Without PSE paging stays off.
+void paging_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1u << 3))) {
+        return;
+    }
+    bool has_pge = (edx & (1u << 13)) != 0;
+
+    uint32_t ram_top = frame_count ? frame_count << PAGE_SHIFT : RAM_TOP_UNKNOWN;
+    for (uint32_t i = 0; i < 1024; i++) {
+        uint32_t base = i << LARGE_PAGE_SHIFT;
+        uint32_t flags = PTE_PRESENT | PTE_WRITABLE | PDE_LARGE;
+        if (has_pge) {
+            flags |= PTE_GLOBAL;
+        }
+        if (i > 0 && base >= ram_top) {
+            flags |= PTE_CACHE_DISABLE | PTE_WRITE_THROUGH;
+        }
+        page_directory[i] = base | flags;
+    }
+
+    // No page table to spare means no guard page, and stack_guard_page stays 0
+    uint32_t guard = ((uint32_t)stack_guard + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (unmap_page(guard)) {
+        stack_guard_page = guard;
+    }
+
+    uint32_t cr0, cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_PSE;
+    if (has_pge) {
+        cr4 |= CR4_PGE;
+    }
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4));
+    __asm__ __volatile__("mov %0, %%cr3" : : "r"(page_directory) : "memory");
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    cr0 |= CR0_PG | CR0_WP;
+    __asm__ __volatile__("mov %0, %%cr0" : : "r"(cr0) : "memory");
+
+    double_fault_tss.cr3 = (uint32_t)page_directory;
+    paging_enabled = true;
+    if (stack_guard_page) {
+        klog("paging: identity mapped with 4 MB pages, guard page at 0x%08x", stack_guard_page, 0);
+    } else {
+        klog("paging: identity mapped with 4 MB pages, no page table for a guard page", 0, 0);
+    }
+}
+
+// Globals for performance probes
+#define PERF_BUCKETS 32 // Bucket n counts samples of 2^n to 2^(n+1)-1 cycles
+
+typedef struct {
+    const char *name;
+    uint32_t count;
+    uint32_t min; // Cycles
+    uint32_t max;
+    uint32_t histogram[PERF_BUCKETS];
+} PerfProbe;
+
+static PerfProbe perf_probes[PERF_PROBE_COUNT] = {
+    [PERF_COMMAND] = { .name = "command" },
+    [PERF_INPUT] = { .name = "input" },
+    [PERF_FLUSH] = { .name = "flush" },
+    [PERF_SCROLL] = { .name = "scroll" },
+    [PERF_CLEAR] = { .name = "clear" },
+};
+
+// Function Prototypes for performance probes
+void perf_reset(void);
+void display_perf(void);
+
+// Start a measurement; 0 means "not measured" (no TSC), which
+// perf_end() ignores
+uint64_t perf_begin(void) {
+    return tsc_available ? rdtsc() : 0;
+}
+
+// Record the cycles since start: a subtraction, a bsr and four updates
+void perf_end(uint32_t probe, uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+    uint64_t elapsed = rdtsc() - start;
+    uint32_t cycles = elapsed > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)elapsed;
+    PerfProbe *p = &perf_probes[probe];
+    if (p->count == 0 || cycles < p->min) {
+        p->min = cycles;
+    }
+    if (cycles > p->max) {
+        p->max = cycles;
+    }
+    p->count++;
+    p->histogram[31 - __builtin_clz(cycles | 1)]++;
+}
+
+void perf_reset(void) {
+    for (uint32_t i = 0; i < PERF_PROBE_COUNT; i++) {
+        const char *name = perf_probes[i].name;
+        memset(&perf_probes[i], 0, sizeof(PerfProbe));
+        perf_probes[i].name = name;
+    }
+}
+
+// Upper bound of the bucket holding the given percentile, clamped to
+// the observed range
+static uint32_t perf_percentile(const PerfProbe *p, uint32_t percent) {
+    uint32_t rank = (uint32_t)div_u64_u32((uint64_t)p->count * percent + 99, 100, NULL);
+    uint32_t seen = 0;
+    for (uint32_t bucket = 0; bucket < PERF_BUCKETS; bucket++) {
+        seen += p->histogram[bucket];
+        if (seen >= rank) {
+            uint32_t upper = bucket == 31 ? 0xFFFFFFFFu : (2u << bucket) - 1;
+            if (upper > p->max) {
+                upper = p->max;
+            }
+            return upper < p->min ? p->min : upper;
+        }
+    }
+    return p->max;
+}
+
+static uint32_t cycles_to_ns(uint32_t cycles) {
+    uint64_t ns = mul_u64_u32_shr(cycles, tsc_mult, tsc_shift);
+    return ns > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)ns;
+}
+
+// One row per probe, latencies in nanoseconds
+void display_perf(void) {
+    if (!tsc_available) {
+        print_line("perf: no TSC, probes disabled");
+        return;
+    }
+    print_line("Probe       Count       Min       p50       p99       Max  (ns)");
+    for (uint32_t i = 0; i < PERF_PROBE_COUNT; i++) {
+        const PerfProbe *p = &perf_probes[i];
+        if (p->count) {
+            kprintf("%-8s%9u%10u%10u%10u%10u\n", p->name, p->count, cycles_to_ns(p->min),
+                    cycles_to_ns(perf_percentile(p, 50)), cycles_to_ns(perf_percentile(p, 99)),
+                    cycles_to_ns(p->max));
+        } else {
+            kprintf("%-8s%9u\n", p->name, p->count);
+        }
+    }
+}
+
+// Globals for the scheduler
+#define MAX_THREADS 32
+#define THREAD_NAME_LEN 16
+#define SCHED_IDLE_PRIORITY (SCHED_PRIORITIES - 1) // Shown for idle threads; spawn stays above it
+#define SCHED_DEFAULT_PRIORITY 2 // Threads started by spawn
+#define SCHED_QUANTUM_NS 10000000u // Time slice before a same-priority thread gets the CPU
+#define THREAD_STACK_ORDER 3 // 32 KB stacks, the lowest page an unmapped guard
+#define EFLAGS_IF 0x200
+
+typedef enum {
+    THREAD_UNUSED,
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_BLOCKED,
+    THREAD_DEAD, // Exited; the shell frees its stack
+} ThreadState;
+
+typedef struct Thread {
+    uint32_t id;
+    char name[THREAD_NAME_LEN];
+    volatile ThreadState state;
+    uint8_t priority;
+    volatile bool kill_pending; // Retired at its next switch instead of running on
+    uint32_t kill_deferred; // kill_defer() depth; a kill waits until it is back to 0
+    volatile bool on_cpu; // A CPU is still on its stack, even if it was just switched out
+    uint32_t cpu; // CPU whose run queue holds it, or that ran it last
+    bool script_quiet; // No echo, row advance or serial mirroring while set
+    uint32_t script_depth; // run/repeat commands currently executing
+    InterruptFrame *frame; // Saved registers while not running
+    uint32_t stack_base; // 0 for the boot stack
+    bool stack_guarded; // Lowest stack page unmapped, see thread_alloc()
+    void (*entry)(void *arg);
+    void *arg;
+    uint64_t run_ns; // CPU time, charged at each switch
+    struct Thread *next; // Run queue or wait list link
+} Thread;
+
+static Thread threads[MAX_THREADS]; // Slot 0 is the shell, on the boot stack
+static uint8_t idle0_stack[PAGE_SIZE << THREAD_STACK_ORDER] __attribute__((aligned(PAGE_SIZE))); // Needs no pmm
+static Spinlock input_lock; // Guards input_waiters against the IRQ side
+static Thread *input_waiters = NULL; // Blocked until keyboard or serial input arrives
+static Spinlock kernel_lock; // Heap and variable table, see preempt_disable()
+static Spinlock console_spinlock; // Screen, cursor, colors, scrollback and COM1, see console_lock()
+static uint32_t next_thread_id = 0;
+
+// Function Prototypes for the scheduler
+void sched_init(void);
+Thread *thread_create(const char *name, void (*entry)(void *arg), void *arg, uint8_t priority);
+void thread_exit(void) __attribute__((noreturn));
+void thread_yield(void);
+void thread_sleep(uint64_t ns);
+bool thread_kill(uint32_t id);
+void kill_defer(void);
+void kill_allow(void);
+void sched_reap(void);
+void display_threads(void);
+void smp_kick(void);
+void parallel_run(void (*job)(void *arg), void **args, uint32_t count);
+
+// Keep the scheduler off this CPU; the caller may use its Cpu until
+// preempt_unpin(). Interrupts stay on; a switch that came due meanwhile
+// happens when the count drops to zero.
+static Cpu *preempt_pin(void) {
+    uint32_t flags = irq_save(); // No migration between finding the CPU and counting
+    Cpu *cpu = this_cpu();
+    cpu->preempt_count++;
+    irq_restore(flags);
+    return cpu;
+}
+
+static void preempt_unpin(Cpu *cpu) {
+    __asm__ __volatile__("" : : : "memory");
+    if (--cpu->preempt_count == 0 && cpu->need_resched && interrupts_enabled()) {
+        thread_yield();
+    }
+}
+
+// Keep the scheduler off this CPU while the heap or the variable table
+// is half updated. The outermost call also takes kernel_lock, so these
+// sections exclude the other CPUs as well.
+void preempt_disable(void) {
+    Cpu *cpu = preempt_pin();
+    if (cpu->kernel_lock_depth++ == 0) {
+        spin_lock(&kernel_lock);
+    }
+}
+
+void preempt_enable(void) {
+    Cpu *cpu = this_cpu(); // Pinned: preemption is still off
+    if (--cpu->kernel_lock_depth == 0) {
+        spin_unlock(&kernel_lock);
+    }
+    preempt_unpin(cpu);
+}
+
+// Console state has a lock of its own, so output on one CPU and heap
+// work on another do not wait for each other. Nests on one CPU. Code
+// holding kernel_lock may take it, but not the other way round.
+void console_lock(void) {
+    Cpu *cpu = preempt_pin();
+    if (cpu->console_lock_depth++ == 0) {
+        spin_lock(&console_spinlock);
+    }
+}
+
+void console_unlock(void) {
+    Cpu *cpu = this_cpu();
+    if (--cpu->console_lock_depth == 0) {
+        spin_unlock(&console_spinlock);
+    }
+    preempt_unpin(cpu);
+}
+
+// This CPU's line buffer for formatting output without any lock held.
+// Preemption stays off, so no other thread gets the buffer, until
+// console_line_put().
+char *console_line_get(void) {
+    return preempt_pin()->console_line;
+}
+
+void console_line_put(void) {
+    preempt_unpin(this_cpu());
+}
+
+// Run queue helpers take the queue's lock themselves; interrupts are
+// off in all callers, since IRQ handlers wake threads too
+static void run_queue_push(Cpu *cpu, Thread *thread) {
+    uint8_t priority = thread->priority;
+    spin_lock(&cpu->run_queue_lock);
+    thread->next = NULL;
+    thread->cpu = cpu->index;
+    if (cpu->run_queue_tail[priority]) {
+        cpu->run_queue_tail[priority]->next = thread;
+    } else {
+        cpu->run_queue_head[priority] = thread;
+    }
+    cpu->run_queue_tail[priority] = thread;
+    cpu->run_queue_ready |= 1u << priority;
+    cpu->run_queue_count++;
+    spin_unlock(&cpu->run_queue_lock);
+}
+
+// Highest-priority ready thread of cpu, or NULL
+static Thread *run_queue_pop(Cpu *cpu) {
+    if (cpu->run_queue_ready == 0) {
+        return NULL; // Unlocked peek; a thread queued just now comes with a kick
+    }
+    spin_lock(&cpu->run_queue_lock);
+    Thread *thread = NULL;
+    if (cpu->run_queue_ready) {
+        uint8_t priority = __builtin_ctz(cpu->run_queue_ready);
+        thread = cpu->run_queue_head[priority];
+        cpu->run_queue_head[priority] = thread->next;
+        if (cpu->run_queue_head[priority] == NULL) {
+            cpu->run_queue_tail[priority] = NULL;
+            cpu->run_queue_ready &= ~(1u << priority);
+        }
+        thread->next = NULL;
+        cpu->run_queue_count--;
+    }
+    spin_unlock(&cpu->run_queue_lock);
+    return thread;
+}
+
+// Take a waiting thread from the other CPU with the most of them. The
+// counts are read unlocked; ties go to the first CPU counting round from
+// this one, so that thieves spread over their victims. A victim emptied
+// meanwhile means looking again.
+static Thread *run_queue_steal(Cpu *cpu) {
+    for (uint32_t attempt = 1; attempt < cpu_count; attempt++) {
+        Cpu *victim = NULL;
+        for (uint32_t i = 1; i < cpu_count; i++) {
+            Cpu *other = &cpus[(cpu->index + i) % cpu_count];
+            if (other->run_queue_count && (victim == NULL || other->run_queue_count > victim->run_queue_count)) {
+                victim = other;
+            }
+        }
+        if (victim == NULL) {
+            return NULL;
+        }
+        Thread *thread = run_queue_pop(victim);
+        if (thread != NULL) {
+            cpu->steals++;
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+// Whether any CPU has a thread waiting, for the idle loop
+static bool sched_work_pending(void) {
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (cpus[i].run_queue_ready) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Make a blocked thread runnable on this CPU, preempting the running
+// thread if it has a higher priority, or else kicking an idle CPU to
+// take it. Interrupts off.
+static void thread_wake(Thread *thread) {
+    Cpu *cpu = this_cpu();
+    thread->state = THREAD_READY;
+    run_queue_push(cpu, thread);
+    if (thread->priority < cpu->current->priority || cpu->current == cpu->idle) {
+        cpu->need_resched = true;
+    } else {
+        smp_kick();
+    }
+}
+
+// Next thread for cpu: its own queue first, then other CPUs' queues,
+// then its idle thread. Threads killed while waiting are retired here.
+static Thread *sched_pick(Cpu *cpu) {
+    while (1) {
+        Thread *next = run_queue_pop(cpu);
+        if (next == NULL) {
+            next = run_queue_steal(cpu);
+        }
+        if (next == NULL) {
+            return cpu->idle;
+        }
+        if (!next->kill_pending || next->kill_deferred) {
+            return next;
+        }
+        next->state = THREAD_DEAD;
+        klog("sched: killed thread %u", next->id, 0);
+    }
+}
+
+// Pick the thread to run next and return the frame isr_common resumes.
+// Entered from an interrupt, so interrupts are off.
+InterruptFrame *schedule(InterruptFrame *frame) {
+    Cpu *cpu = this_cpu();
+    Thread *previous = cpu->current;
+    previous->frame = frame;
+    if (previous->state == THREAD_RUNNING) {
+        if (previous->kill_pending && !previous->kill_deferred) {
+            previous->state = THREAD_DEAD;
+            klog("sched: killed thread %u", previous->id, 0);
+        } else if (previous == cpu->idle) {
+            previous->state = THREAD_READY;
+        } else {
+            previous->state = THREAD_READY;
+            run_queue_push(cpu, previous);
+        }
+    }
+
+    uint64_t now = ktime_ns();
+    previous->run_ns += now - cpu->switch_ns;
+    if (previous == cpu->idle) {
+        cpu->idle_ns += now - cpu->switch_ns;
+    }
+    cpu->switch_ns = now;
+
+    Thread *next = sched_pick(cpu);
+    if (next != previous) {
+        // Just switched out elsewhere: that CPU leaves its stack in a moment
+        while (next->on_cpu) {
+            __asm__ __volatile__("pause");
+        }
+        next->on_cpu = true;
+        cpu->previous = previous;
+        cpu->context_switches++;
+    }
+    next->state = THREAD_RUNNING;
+    next->cpu = cpu->index;
+    next->frame->gs = PERCPU_SELECTOR(cpu->index); // The thread may have run elsewhere
+    cpu->current = next;
+    cpu->need_resched = false;
+    cpu->slice_end = next == cpu->idle ? 0 : now + SCHED_QUANTUM_NS;
+    timer_program(cpu);
+    return next->frame;
+}
+
+// Called by isr_common once it has moved to the new thread's stack: the
+// old thread may now be resumed by another CPU, or freed if it is dead
+void switch_finish(void) {
+    Cpu *cpu = this_cpu();
+    if (cpu->previous) {
+        __asm__ __volatile__("" : : : "memory");
+        cpu->previous->on_cpu = false;
+        cpu->previous = NULL;
+    }
+}
+
+// Last step of every IRQ: switch when a handler woke a more important
+// thread or the time slice ran out. Code inside preempt_disable() gets
+// to finish first and switches itself in preempt_enable().
+InterruptFrame *sched_irq_exit(InterruptFrame *frame) {
+    Cpu *cpu = this_cpu();
+    if (cpu->need_resched && cpu->preempt_count == 0) {
+        return schedule(frame);
+    }
+    return frame;
+}
+
+// Wake the shell to bring what other threads drew or logged to the
+// screen and COM1. Interrupts off.
+static void sched_flush_wake(void) {
+    if (input_waiters && (dirty_rows || klog_next != klog_serial_next)) {
+        input_wake();
+    }
+}
+
+// The running thread's slice is over: switch if a thread of the same or
+// higher priority is waiting. Either way a new slice starts, so that a
+// switch held up by preempt_disable() gets another chance. A busy CPU
+// thus takes one timer interrupt per slice, an idle one none.
+void sched_slice_end(void) {
+    Cpu *cpu = this_cpu();
+    if (cpu->run_queue_ready & ((2u << cpu->current->priority) - 1)) {
+        cpu->need_resched = true;
+    }
+    cpu->slice_end = ktime_ns() + SCHED_QUANTUM_NS;
+    sched_flush_wake();
+}
+
+// Give up the CPU; returns when a scheduler picks this thread again
+void thread_yield(void) {
+    __asm__ __volatile__("int $0x30" : : : "memory");
+}
+
+static void thread_sleep_done(Timer *timer, InterruptFrame *frame) {
+    (void)frame;
+    thread_wake(timer->arg);
+}
+
+// Block the running thread for at least ns nanoseconds. The timer lives
+// on this stack and this CPU, which cannot take its interrupt before the
+// thread has switched out.
+void thread_sleep(uint64_t ns) {
+    Timer timer;
+    uint32_t flags = irq_save();
+    Thread *self = current_thread();
+    timer_init(&timer, thread_sleep_done, self);
+    self->state = THREAD_BLOCKED;
+    if (timer_add(&timer, ktime_ns() + ns, 0)) {
+        thread_yield();
+    } else {
+        self->state = THREAD_RUNNING; // No room for the timer; return at once
+    }
+    irq_restore(flags);
+}
+
+// Called with interrupts off once input_pending() said there is none.
+// Blocks the running thread until IRQ1 or IRQ4 delivers something and
+// returns with interrupts on; false (interrupts still off) before
+// sched_init(). Input is checked again under input_lock, since the IRQ
+// may be running on another CPU.
+bool thread_wait_input(void) {
+    Thread *self = current_thread();
+    if (self == NULL) {
+        return false;
+    }
+    spin_lock(&input_lock);
+    if (input_pending()) {
+        spin_unlock(&input_lock);
+        __asm__ __volatile__("sti");
+        return true;
+    }
+    self->state = THREAD_BLOCKED;
+    self->next = input_waiters;
+    input_waiters = self;
+    spin_unlock(&input_lock);
+    thread_yield();
+    __asm__ __volatile__("sti");
+    return true;
+}
+
+// Interrupt context: make every thread waiting for input runnable
+void input_wake(void) {
+    if (current_thread() == NULL) {
+        return;
+    }
+    spin_lock(&input_lock);
+    while (input_waiters) {
+        Thread *thread = input_waiters;
+        input_waiters = thread->next;
+        thread_wake(thread);
+    }
+    spin_unlock(&input_lock);
+}
+
+// Whether address lies in the guard page of a thread's stack
+bool thread_guard_hit(uint32_t address) {
+    for (uint32_t i = 1; i < MAX_THREADS; i++) {
+        if (threads[i].stack_guarded && threads[i].state != THREAD_UNUSED &&
+            address - threads[i].stack_base < PAGE_SIZE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether the running thread is inside a quiet script, for console_mirror()
+bool thread_quiet(void) {
+    Thread *thread = current_thread();
+    return thread != NULL && thread->script_quiet;
+}
+
+// Sleep until an interrupt, unless some CPU has a thread waiting that
+// this one could take over. Only the next timer due on this CPU, if
+// any, wakes it otherwise.
+static void idle_loop(void *arg) {
+    (void)arg;
+    while (1) {
+        __asm__ __volatile__("cli");
+        sched_flush_wake();
+        if (sched_work_pending()) {
+            __asm__ __volatile__("sti");
+            thread_yield();
+        } else {
+            __asm__ __volatile__("sti; hlt" : : : "memory");
+        }
+    }
+}
+
+// First code a new thread runs, entered through the frame thread_create()
+// built. The thread ends when its entry function returns.
+static void thread_start(void) {
+    Thread *self = current_thread();
+    self->entry(self->arg);
+    thread_exit();
+}
+
+void thread_exit(void) {
+    __asm__ __volatile__("cli");
+    current_thread()->state = THREAD_DEAD;
+    thread_yield();
+    while (1) {
+        __asm__ __volatile__("hlt"); // Never resumed
+    }
+}
+
+// Hold off kills of the running thread while its stack holds memory that
+// other threads or devices still write to. Nests; a kill that arrived
+// meanwhile ends the thread in the kill_allow() that drops the depth to
+// 0, so the caller must not hold locks there.
+void kill_defer(void) {
+    current_thread()->kill_deferred++;
+}
+
+void kill_allow(void) {
+    Thread *self = current_thread();
+    if (--self->kill_deferred == 0 && self->kill_pending) {
+        thread_exit();
+    }
+}
+
+// Claim a thread slot and a guarded stack. The thread is not runnable
+// yet. NULL when the thread table or memory is exhausted.
+static Thread *thread_alloc(const char *name, uint8_t priority) {
+    preempt_disable();
+    sched_reap();
+    Thread *thread = NULL;
+    for (uint32_t i = 1; i < MAX_THREADS; i++) {
+        if (threads[i].state == THREAD_UNUSED) {
+            thread = &threads[i];
+            break;
+        }
+    }
+    uint32_t stack = thread ? alloc_pages(THREAD_STACK_ORDER) : 0;
+    if (stack == 0) {
+        preempt_enable();
+        return NULL;
+    }
+    // Overflowing the stack faults instead of corrupting memory. CPUs
+    // that still cache the old 4 MB mapping miss the guard until their
+    // TLB drops it; the identity mapping itself never changes. Without
+    // a page table to split the mapping the thread runs unguarded.
+    bool guarded = paging_enabled && unmap_page(stack);
+
+    memset(thread, 0, sizeof(Thread));
+    thread->stack_guarded = guarded;
+    thread->id = next_thread_id++;
+    strncpy(thread->name, name, THREAD_NAME_LEN - 1);
+    thread->priority = priority < SCHED_PRIORITIES ? priority : SCHED_IDLE_PRIORITY;
+    thread->stack_base = stack;
+    thread->state = THREAD_BLOCKED; // Claimed, not runnable
+    preempt_enable();
+    return thread;
+}
+
+// Stack top of a thread_alloc() thread. 16 spare bytes keep the stack
+// aligned where the entry frame ends.
+static uint32_t thread_stack_top(const Thread *thread) {
+    return thread->stack_base + (PAGE_SIZE << THREAD_STACK_ORDER) - 16;
+}
+
+// Build the frame a thread's first switch-in "returns" through: into
+// thread_start() with interrupts on
+static void thread_prepare(Thread *thread, void (*entry)(void *arg), void *arg) {
+    InterruptFrame *frame = (InterruptFrame *)(thread_stack_top(thread) - sizeof(InterruptFrame));
+    memset(frame, 0, sizeof(InterruptFrame));
+    frame->gs = frame->fs = frame->es = frame->ds = KERNEL_DATA_SELECTOR;
+    frame->eip = (uint32_t)thread_start;
+    frame->cs = KERNEL_CODE_SELECTOR;
+    frame->eflags = EFLAGS_IF | 0x2; // Bit 1 is always set
+    thread->frame = frame;
+    thread->entry = entry;
+    thread->arg = arg;
+}
+
+// Turn the boot flow into thread 0 (the shell) and give the boot CPU its
+// idle thread. That one runs on a static stack, so there is always a
+// thread to switch to even when the page allocator has nothing to give.
+void sched_init(void) {
+    Cpu *cpu = this_cpu();
+    Thread *shell = &threads[0];
+    shell->id = next_thread_id++;
+    strncpy(shell->name, "shell", THREAD_NAME_LEN - 1);
+    shell->state = THREAD_RUNNING;
+    shell->priority = 0;
+    shell->on_cpu = true;
+    Thread *idle = &threads[1]; // No other thread exists yet
+    idle->id = next_thread_id++;
+    strncpy(idle->name, "idle0", THREAD_NAME_LEN - 1);
+    idle->priority = SCHED_IDLE_PRIORITY;
+    idle->stack_base = (uint32_t)idle0_stack;
+    cpu->idle = idle;
+    thread_prepare(cpu->idle, idle_loop, NULL);
+    cpu->idle->state = THREAD_READY;
+    cpu->current = shell;
+}
+
+// Make a prepared thread runnable, queued on this CPU for an idle CPU
+// to steal
+static void thread_enqueue(Thread *thread) {
+    uint32_t flags = irq_save();
+    thread->state = THREAD_READY;
+    run_queue_push(this_cpu(), thread);
+    irq_restore(flags);
+    smp_kick();
+    klog("sched: thread %u started, stack 0x%08x", thread->id, thread->stack_base);
+}
+
+// Start a thread on its own stack. NULL when the thread table or memory
+// is exhausted.
+Thread *thread_create(const char *name, void (*entry)(void *arg), void *arg, uint8_t priority) {
+    Thread *thread = thread_alloc(name, priority);
+    if (thread != NULL) {
+        thread_prepare(thread, entry, arg);
+        thread_enqueue(thread);
+    }
+    return thread;
+}
+
+// End another thread. One waiting for input is retired at once; one
+// asleep, when its timer wakes it; any other, at its next switch with
+// preemption enabled, so it never leaves half-updated console or heap
+// state behind. Inside kill_defer() it ends at kill_allow() instead.
+// Memory it still holds is not reclaimed. Killing the running thread
+// is thread_exit().
+bool thread_kill(uint32_t id) {
+    for (uint32_t i = 1; i < MAX_THREADS; i++) {
+        Thread *thread = &threads[i];
+        if (thread->id != id || thread->state == THREAD_UNUSED || thread->state == THREAD_DEAD) {
+            continue;
+        }
+        for (uint32_t c = 0; c < cpu_count; c++) {
+            if (thread == cpus[c].idle) {
+                return false; // The shell and the idle threads never exit
+            }
+        }
+        if (thread == current_thread()) {
+            thread_exit();
+        }
+        uint32_t flags = spin_lock_irqsave(&input_lock);
+        if (thread->state == THREAD_BLOCKED && !thread->kill_deferred) {
+            Thread **link = &input_waiters;
+            while (*link && *link != thread) {
+                link = &(*link)->next;
+            }
+            if (*link) {
+                *link = thread->next;
+                thread->state = THREAD_DEAD;
+                klog("sched: killed thread %u", id, 0);
+            } else {
+                thread->kill_pending = true; // Asleep: retired when its timer wakes it
+            }
+        } else {
+            thread->kill_pending = true;
+        }
+        spin_unlock_irqrestore(&input_lock, flags);
+        return true;
+    }
+    return false;
+}
+
+// Free the stacks of exited threads once no CPU is on them any more
+void sched_reap(void) {
+    preempt_disable();
+    for (uint32_t i = 1; i < MAX_THREADS; i++) {
+        Thread *thread = &threads[i];
+        if (thread->state != THREAD_DEAD || thread->on_cpu) {
+            continue;
+        }
+        if (thread->stack_guarded) {
+            map_page(thread->stack_base, thread->stack_base, PTE_WRITABLE);
+        }
+        free_pages(thread->stack_base, THREAD_STACK_ORDER);
+        thread->state = THREAD_UNUSED;
+    }
+    preempt_enable();
+}
+
+// One row per live thread; CPU time in milliseconds
+void display_threads(void) {
+    static const char *const state_names[] = { "unused", "ready", "running", "blocked", "dead" };
+    print_line("  ID PRI CPU STATE      CPU ms NAME");
+    for (uint32_t i = 0; i < MAX_THREADS; i++) {
+        const Thread *thread = &threads[i];
+        if (thread->state == THREAD_UNUSED) {
+            continue;
+        }
+        kprintf("%4u %3u %3u %-8s %8u %s%s\n", thread->id, thread->priority, thread->cpu,
+                state_names[thread->state],
+                (uint32_t)div_u64_u32(thread->run_ns, 1000000, NULL), thread->name,
+                thread->kill_pending ? " (killed)" : "");
+    }
+}
+
+typedef struct {
+    void (*job)(void *arg);
+    void *arg;
+    volatile uint32_t *remaining; // Jobs still running, in the caller's frame
+} ParallelJob;
+
+// Job threads start inside kill_defer(), or a kill would leave remaining
+// above zero for good
+static void parallel_job_entry(void *arg) {
+    ParallelJob *job = arg;
+    job->job(job->arg);
+    __atomic_fetch_sub(job->remaining, 1, __ATOMIC_RELEASE);
+    kill_allow();
+}
+
+// Run job(args[i]) for every i on up to count threads at the caller's
+// priority, the caller doing the first one itself, and return once all
+// are done. Idle CPUs steal the queued ones, so the jobs spread over
+// the CPUs; with one CPU they simply take turns. The jobs and usually
+// their args live in the caller's frame, so a kill of the caller waits
+// until they are all done.
+void parallel_run(void (*job)(void *arg), void **args, uint32_t count) {
+    ParallelJob jobs[MAX_CPUS];
+    volatile uint32_t remaining = 0;
+    uint8_t priority = current_thread()->priority;
+
+    if (count > MAX_CPUS) {
+        count = MAX_CPUS;
+    }
+    kill_defer();
+    for (uint32_t i = 1; i < count; i++) {
+        jobs[i].job = job;
+        jobs[i].arg = args[i];
+        jobs[i].remaining = &remaining;
+        Thread *thread = thread_alloc("job", priority);
+        if (thread == NULL) {
+            job(args[i]); // No thread left: run it here instead
+            continue;
+        }
+        __atomic_fetch_add(&remaining, 1, __ATOMIC_RELAXED);
+        thread->kill_deferred = 1; // Dropped by parallel_job_entry()
+        thread_prepare(thread, parallel_job_entry, &jobs[i]);
+        thread_enqueue(thread);
+    }
+    job(args[0]);
+    while (remaining) {
+        thread_yield();
+    }
+    kill_allow();
+}
+
+// Globals for SMP
+#define BIOS_EBDA_SEGMENT 0x40E // Real-mode segment of the extended BIOS data area
+#define BIOS_ROM_START 0xE0000
+#define BIOS_ROM_END 0x100000
+#define MADT_LOCAL_APIC 0
+#define MADT_IO_APIC 1
+#define MADT_INTERRUPT_OVERRIDE 2
+#define MADT_LAPIC_ENABLED 0x01
+#define LAPIC_ID 0x020
+#define LAPIC_TPR 0x080
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_LVT_MASKED 0x10000
+#define LAPIC_DELIVERY_NMI 0x400
+#define LAPIC_DELIVERY_EXTINT 0x700
+#define LAPIC_ICR_INIT 0x500
+#define LAPIC_ICR_STARTUP 0x600
+#define LAPIC_ICR_PENDING 0x1000
+#define LAPIC_ICR_ASSERT 0x4000
+#define LAPIC_DIVIDE_16 0x3
+#define IOAPIC_VERSION 0x01
+#define AP_TRAMPOLINE 0x8000 // Page-aligned and below 1 MB; must match kernel.asm
+#define AP_START_TIMEOUT_MS 100
+#define LAPIC_CALIBRATION_TICKS 10
+
+typedef struct {
+    char signature[8]; // "RSD PTR "
+    uint8_t checksum;
+    char oem[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __attribute__((packed)) AcpiRsdp;
+
+typedef struct {
+    char signature[4];
+    uint32_t length; // Whole table, header included
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[6];
+    char oem_table[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) AcpiHeader;
+
+// Multiple APIC Description Table; variable-length entries follow
+typedef struct {
+    AcpiHeader header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed)) AcpiMadt;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    union {
+        struct { uint8_t processor_id, apic_id; uint32_t flags; } __attribute__((packed)) lapic;
+        struct { uint8_t id, reserved; uint32_t address, gsi_base; } __attribute__((packed)) ioapic;
+        struct { uint8_t bus, irq; uint32_t gsi; uint16_t flags; } __attribute__((packed)) override;
+    };
+} __attribute__((packed)) MadtEntry;
+
+// Filled in at the end of the trampoline for each AP, see kernel.asm
+typedef struct {
+    uint32_t cr0, cr3, cr4;
+    uint32_t stack;
+    uint32_t cpu;
+} ApParams;
+
+extern uint8_t ap_trampoline[], ap_params[], ap_trampoline_end[];
+
+static volatile uint32_t *lapic = NULL; // Register base; NULL without a local APIC
+static uint8_t madt_apic_ids[MAX_CPUS]; // Usable processors, boot CPU first
+static uint32_t madt_cpus = 0;
+static uint32_t ioapic_address = 0; // 0 when the MADT lists none
+static uint8_t ioapic_id = 0;
+static uint32_t ioapic_gsi_base = 0;
+static uint32_t ioapic_pins = 0;
+static uint32_t isa_irq_gsi[16]; // Global system interrupt each ISA IRQ is wired to
+static uint32_t lapic_timer_count = 0; // Local APIC timer counts per PIT tick (tick_ns)
+
+// Function Prototypes for SMP
+void smp_init(void);
+void ap_main(uint32_t index);
+void display_cpus(void);
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static uint32_t ioapic_read(uint32_t reg) {
+    volatile uint32_t *ioapic = (volatile uint32_t *)ioapic_address;
+    ioapic[0] = reg; // IOREGSEL, then the value appears in IOWIN at +0x10
+    return ioapic[4];
+}
+
+static bool acpi_checksum_ok(const void *table, uint32_t length) {
+    const uint8_t *bytes = table;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+// The RSDP sits on a 16-byte boundary in the first KB of the EBDA or in
+// the BIOS ROM area
+static const AcpiRsdp *acpi_find_rsdp(void) {
+    // GCC takes pointers into the first page for null dereferences; hide the constant
+    uint32_t bda = BIOS_EBDA_SEGMENT;
+    __asm__("" : "+r"(bda));
+    uint32_t ebda = (uint32_t)*(volatile uint16_t *)bda << 4;
+    uint32_t ranges[2][2] = { { ebda, ebda + 1024 }, { BIOS_ROM_START, BIOS_ROM_END } };
+    for (int r = 0; r < 2; r++) {
+        for (uint32_t address = ranges[r][0]; address && address < ranges[r][1]; address += 16) {
+            const AcpiRsdp *rsdp = (const AcpiRsdp *)address;
+            if (strncmp(rsdp->signature, "RSD PTR ", 8) == 0 && acpi_checksum_ok(rsdp, sizeof(AcpiRsdp))) {
+                return rsdp;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Table with the given signature listed in the RSDT, or NULL
+static const AcpiHeader *acpi_find_table(const AcpiRsdp *rsdp, const char *signature) {
+    const AcpiHeader *rsdt = (const AcpiHeader *)rsdp->rsdt_address;
+    if (strncmp(rsdt->signature, "RSDT", 4) != 0 || !acpi_checksum_ok(rsdt, rsdt->length)) {
+        return NULL;
+    }
+    const uint32_t *entries = (const uint32_t *)(rsdt + 1);
+    uint32_t count = (rsdt->length - sizeof(AcpiHeader)) / 4;
+    for (uint32_t i = 0; i < count; i++) {
+        const AcpiHeader *table = (const AcpiHeader *)entries[i];
+        if (strncmp(table->signature, signature, 4) == 0 && acpi_checksum_ok(table, table->length)) {
+            return table;
+        }
+    }
+    return NULL;
+}
+
+// Collect the local APICs, the (first) I/O APIC and the ISA interrupt
+// overrides. The boot CPU's APIC ID is already in madt_apic_ids[0].
+static void madt_parse(const AcpiMadt *madt) {
+    const uint8_t *end = (const uint8_t *)madt + madt->header.length;
+    for (const uint8_t *p = (const uint8_t *)(madt + 1); p + 2 <= end; p += ((const MadtEntry *)p)->length) {
+        const MadtEntry *entry = (const MadtEntry *)p;
+        if (entry->length < 2) {
+            break; // Malformed; stop rather than loop forever
+        }
+        switch (entry->type) {
+            case MADT_LOCAL_APIC:
+                if ((entry->lapic.flags & MADT_LAPIC_ENABLED) && entry->lapic.apic_id != madt_apic_ids[0] &&
+                    madt_cpus < MAX_CPUS) {
+                    madt_apic_ids[madt_cpus++] = entry->lapic.apic_id;
+                }
+                break;
+            case MADT_IO_APIC:
+                if (ioapic_address == 0) {
+                    ioapic_address = entry->ioapic.address;
+                    ioapic_id = entry->ioapic.id;
+                    ioapic_gsi_base = entry->ioapic.gsi_base;
+                }
+                break;
+            case MADT_INTERRUPT_OVERRIDE:
+                if (entry->override.bus == 0 && entry->override.irq < 16) {
+                    isa_irq_gsi[entry->override.irq] = entry->override.gsi;
+                }
+                break;
+        }
+    }
+}
+
+// Software-enable this CPU's local APIC. The boot CPU keeps taking the
+// 8259's interrupts through LINT0 (virtual wire mode); the APs only get
+// their timer and IPIs.
+static void lapic_enable(bool boot_cpu) {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_LINT0, boot_cpu ? LAPIC_DELIVERY_EXTINT : LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, boot_cpu ? LAPIC_DELIVERY_NMI : LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+// Count how far the local APIC timer runs down in a few PIT ticks. Needs
+// interrupts enabled.
+static void lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    uint32_t start = timer_ticks;
+    while (timer_ticks == start) {
+        __asm__ __volatile__("hlt"); // Start on a tick edge
+    }
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    start = timer_ticks;
+    while (timer_ticks - start < LAPIC_CALIBRATION_TICKS) {
+        __asm__ __volatile__("hlt");
+    }
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    lapic_timer_count = elapsed / LAPIC_CALIBRATION_TICKS;
+}
+
+// Put this CPU's local APIC timer in one-shot mode, armed by timer_program()
+static void lapic_timer_start(void) {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    uint32_t flags = irq_save();
+    this_cpu()->timer_armed = 0;
+    timer_program(this_cpu());
+    irq_restore(flags);
+}
+
+// One-shot interrupt delta_ns from now; 0 stops the timer
+void lapic_timer_arm(uint32_t delta_ns) {
+    uint32_t count = 0;
+    if (delta_ns) {
+        count = (uint32_t)div_u64_u32((uint64_t)delta_ns * lapic_timer_count, tick_ns, NULL);
+        if (count == 0) {
+            count = 1;
+        }
+    }
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+// Send an IPI and wait until the local APIC has accepted it
+static void lapic_send_ipi(uint8_t apic_id, uint32_t command) {
+    uint32_t flags = irq_save(); // ICR high and low belong together
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ __volatile__("pause");
+    }
+    irq_restore(flags);
+}
+
+static void delay_us(uint32_t us) {
+    uint64_t deadline = ktime_ns() + (uint64_t)us * 1000;
+    while (ktime_ns() < deadline) {
+        __asm__ __volatile__("pause");
+    }
+}
+
+// INIT-SIPI-SIPI one AP into the trampoline, on the stack of the idle
+// thread it will become; true once it reports online
+static bool smp_start_cpu(uint32_t index, uint8_t apic_id) {
+    char name[THREAD_NAME_LEN];
+    ksnprintf(name, sizeof(name), "idle%u", index);
+    Thread *idle = thread_alloc(name, SCHED_IDLE_PRIORITY);
+    if (idle == NULL) {
+        return false;
+    }
+    Cpu *cpu = &cpus[index];
+    cpu->apic_id = apic_id;
+    cpu->idle = idle;
+    cpu->online = false;
+
+    ApParams *params = (ApParams *)(AP_TRAMPOLINE + (ap_params - ap_trampoline));
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(params->cr0));
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(params->cr3));
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(params->cr4));
+    params->stack = thread_stack_top(idle);
+    params->cpu = index;
+
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    delay_us(10000);
+    for (int attempt = 0; attempt < 2 && !cpu->online; attempt++) {
+        lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE >> PAGE_SHIFT));
+        uint64_t deadline = ktime_ns() + (attempt == 0 ? 200000 : AP_START_TIMEOUT_MS * 1000000ull);
+        while (!cpu->online && ktime_ns() < deadline) {
+            __asm__ __volatile__("pause");
+        }
+    }
+    // A late AP would still run on the idle stack, so it is never freed
+    return cpu->online;
+}
+
+// Find the other processors through the ACPI MADT and start them. Runs
+// on the boot CPU once the PIT ticks; without ACPI or a local APIC the
+// kernel stays on one CPU.
+void smp_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    const AcpiRsdp *rsdp = acpi_find_rsdp();
+    const AcpiMadt *madt = rsdp ? (const AcpiMadt *)acpi_find_table(rsdp, "APIC") : NULL;
+    if (!(edx & (1u << 9)) || madt == NULL) {
+        klog("smp: no local APIC or MADT, using one CPU", 0, 0);
+        return;
+    }
+
+    lapic = (volatile uint32_t *)madt->lapic_address;
+    for (uint32_t i = 0; i < 16; i++) {
+        isa_irq_gsi[i] = i;
+    }
+    madt_apic_ids[0] = lapic_read(LAPIC_ID) >> 24;
+    madt_cpus = 1;
+    madt_parse(madt);
+    if (ioapic_address) {
+        ioapic_pins = ((ioapic_read(IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+        klog("smp: I/O APIC at 0x%08x, %u pins", ioapic_address, ioapic_pins);
+    }
+
+    cpus[0].apic_id = madt_apic_ids[0];
+    cpus[0].online = true;
+    lapic_enable(true);
+    lapic_timer_calibrate();
+    timer_tickless = true;
+    lapic_timer_start();
+    if (tsc_available) {
+        pit_stop(); // The TSC keeps time, so nothing needs the tick any more
+    }
+    memcpy((void *)AP_TRAMPOLINE, ap_trampoline, ap_trampoline_end - ap_trampoline);
+
+    for (uint32_t i = 1; i < madt_cpus; i++) {
+        if (smp_start_cpu(cpu_count, madt_apic_ids[i])) {
+            cpu_count++;
+        } else {
+            klog("smp: APIC %u did not start", madt_apic_ids[i], 0);
+        }
+    }
+    klog("smp: %u of %u CPUs online", cpu_count, madt_cpus);
+}
+
+// C entry of an application processor, on its idle thread's stack
+void ap_main(uint32_t index) {
+    Cpu *cpu = &cpus[index];
+    gdt_load(index);
+    idt_load();
+    lapic_enable(false);
+    cpu->idle->state = THREAD_RUNNING;
+    cpu->idle->on_cpu = true;
+    cpu->idle->cpu = index;
+    cpu->current = cpu->idle;
+    cpu->online_ns = ktime_ns();
+    cpu->switch_ns = cpu->online_ns;
+    lapic_timer_start();
+    cpu->online = true;
+    klog("smp: CPU %u (APIC %u) online", index, cpu->apic_id);
+    idle_loop(NULL);
+}
+
+// Wake one idle CPU with an IPI to steal a newly queued thread. Idle
+// CPUs otherwise sleep until their next timer, if they have one.
+void smp_kick(void) {
+    if (cpu_count < 2) {
+        return;
+    }
+    uint32_t self = this_cpu()->index;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (i != self && cpus[i].current == cpus[i].idle) {
+            lapic_send_ipi(cpus[i].apic_id, LAPIC_ICR_ASSERT | KICK_VECTOR);
+            return;
+        }
+    }
+}
+
+// One row per CPU: timer interrupts, share of time spent idle, context
+// switches and threads stolen from other CPUs
+void display_cpus(void) {
+    uint64_t now = ktime_ns();
+    print_line("CPU APIC Timer IRQs  Idle%  Switches  Steals Running");
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        const Cpu *cpu = &cpus[i];
+        uint32_t up_ms = (uint32_t)div_u64_u32(now - cpu->online_ns, 1000000, NULL);
+        uint32_t idle_ms = (uint32_t)div_u64_u32(cpu->idle_ns, 1000000, NULL);
+        uint32_t idle = up_ms ? (uint32_t)div_u64_u32((uint64_t)idle_ms * 100, up_ms, NULL) : 0;
+        kprintf("%3u %4u %10u %5u%% %9u %7u %s\n", i, cpu->apic_id, cpu->timer_irqs, idle, cpu->context_switches,
+                cpu->steals, cpu->current ? cpu->current->name : "-");
+    }
+    kprintf("Timer: %s\n", timer_tickless ? "local APIC one-shot" : "PIT periodic");
+    if (ioapic_address) {
+        kprintf("I/O APIC %u at 0x%08X: GSI %u-%u; IRQ 0 is GSI %u, devices stay on the 8259\n", ioapic_id,
+                ioapic_address, ioapic_gsi_base, ioapic_gsi_base + ioapic_pins - 1, isa_irq_gsi[0]);
+    }
+}
+
+// Globals for PCI
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+#define PCI_MAX_DEVICES 32
+#define PCI_VENDOR_DEVICE 0x00
+#define PCI_COMMAND 0x04
+#define PCI_CLASS_REVISION 0x08
+#define PCI_HEADER_TYPE 0x0C // Byte 2 of this dword; bit 7 = multi-function
+#define PCI_BAR0 0x10
+#define PCI_INTERRUPT 0x3C // Byte 0: interrupt line the BIOS routed INTx to
+#define PCI_COMMAND_IO 0x1
+#define PCI_COMMAND_MEMORY 0x2
+#define PCI_COMMAND_MASTER 0x4
+#define PCI_BAR_IO 0x1
+#define PCI_NO_IRQ 0xFF
+
+typedef struct {
+    uint8_t bus;
+    uint8_t device;
+    uint8_t function;
+    uint8_t irq; // 8259 line, PCI_NO_IRQ if none
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint32_t bar[6];
+} PciDevice;
+
+static PciDevice pci_devices[PCI_MAX_DEVICES];
+static uint32_t pci_device_count = 0;
+static Spinlock pci_lock; // CONFIG_ADDRESS and CONFIG_DATA belong together
+
+static const char *const pci_class_names[] = {
+    "Unclassified", "Storage", "Network", "Display", "Multimedia", "Memory", "Bridge",
+    "Communication", "System", "Input", "Docking station", "Processor", "Serial bus",
+};
+
+// Function Prototypes for PCI
+void pci_init(void);
+uint32_t pci_config_read(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset);
+void pci_config_write(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint32_t value);
+PciDevice *pci_find(uint16_t vendor_id, uint16_t device_id);
+void pci_enable(const PciDevice *dev);
+void display_pci(void);
+
+// Configuration mechanism #1: select a dword through CONFIG_ADDRESS,
+// then move it through CONFIG_DATA
+uint32_t pci_config_read(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
+    uint32_t address = 0x80000000u | (uint32_t)bus << 16 | (uint32_t)device << 11 |
+                       (uint32_t)function << 8 | (offset & 0xFC);
+    uint32_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, address);
+    uint32_t value = inl(PCI_CONFIG_DATA);
+    spin_unlock_irqrestore(&pci_lock, flags);
+    return value;
+}
+
+void pci_config_write(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint32_t value) {
+    uint32_t address = 0x80000000u | (uint32_t)bus << 16 | (uint32_t)device << 11 |
+                       (uint32_t)function << 8 | (offset & 0xFC);
+    uint32_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, address);
+    outl(PCI_CONFIG_DATA, value);
+    spin_unlock_irqrestore(&pci_lock, flags);
+}
+
+static void pci_add(uint8_t bus, uint8_t device, uint8_t function, uint32_t id) {
+    if (pci_device_count == PCI_MAX_DEVICES) {
+        klog("pci: table full, %02x:%02x ignored", bus, device);
+        return;
+    }
+    PciDevice *dev = &pci_devices[pci_device_count++];
+    uint32_t class_revision = pci_config_read(bus, device, function, PCI_CLASS_REVISION);
+    uint8_t line = pci_config_read(bus, device, function, PCI_INTERRUPT) & 0xFF;
+    dev->bus = bus;
+    dev->device = device;
+    dev->function = function;
+    dev->vendor_id = id & 0xFFFF;
+    dev->device_id = id >> 16;
+    dev->class_code = class_revision >> 24;
+    dev->subclass = (class_revision >> 16) & 0xFF;
+    dev->prog_if = (class_revision >> 8) & 0xFF;
+    dev->irq = line < 16 ? line : PCI_NO_IRQ;
+    for (uint8_t i = 0; i < 6; i++) {
+        dev->bar[i] = pci_config_read(bus, device, function, PCI_BAR0 + i * 4);
+    }
+}
+
+// Probe every bus, slot and function; absent ones read as vendor 0xFFFF
+void pci_init(void) {
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint8_t device = 0; device < 32; device++) {
+            uint32_t id = pci_config_read(bus, device, 0, PCI_VENDOR_DEVICE);
+            if ((id & 0xFFFF) == 0xFFFF) {
+                continue;
+            }
+            pci_add(bus, device, 0, id);
+            if (!(pci_config_read(bus, device, 0, PCI_HEADER_TYPE) & 0x800000)) {
+                continue;
+            }
+            for (uint8_t function = 1; function < 8; function++) {
+                id = pci_config_read(bus, device, function, PCI_VENDOR_DEVICE);
+                if ((id & 0xFFFF) != 0xFFFF) {
+                    pci_add(bus, device, function, id);
+                }
+            }
+        }
+    }
+    klog("pci: %u functions found", pci_device_count, 0);
+}
+
+PciDevice *pci_find(uint16_t vendor_id, uint16_t device_id) {
+    for (uint32_t i = 0; i < pci_device_count; i++) {
+        if (pci_devices[i].vendor_id == vendor_id && pci_devices[i].device_id == device_id) {
+            return &pci_devices[i];
+        }
+    }
+    return NULL;
+}
+
+// Turn on I/O and memory decoding and let the device master the bus (DMA)
+void pci_enable(const PciDevice *dev) {
+    uint32_t command = pci_config_read(dev->bus, dev->device, dev->function, PCI_COMMAND);
+    command |= PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER;
+    pci_config_write(dev->bus, dev->device, dev->function, PCI_COMMAND, command & 0xFFFF);
+}
+
+void display_pci(void) {
+    print_line("Slot    Vendor:Device Class     Type             IRQ");
+    for (uint32_t i = 0; i < pci_device_count; i++) {
+        const PciDevice *dev = &pci_devices[i];
+        const char *name = dev->class_code < sizeof(pci_class_names) / sizeof(pci_class_names[0])
+                               ? pci_class_names[dev->class_code] : "Other";
+        char irq[4] = "-";
+        if (dev->irq != PCI_NO_IRQ) {
+            utoa(dev->irq, irq, 10);
+        }
+        kprintf("%02x:%02x.%u %04x:%04x     %02x.%02x.%02x  %-16s %s\n", dev->bus, dev->device, dev->function,
+                dev->vendor_id, dev->device_id, dev->class_code, dev->subclass, dev->prog_if, name, irq);
+    }
+}
+
+// Globals for virtio-blk
+#define VIRTIO_VENDOR_ID 0x1AF4
+#define VIRTIO_BLK_DEVICE_ID 0x1001 // Transitional device, legacy interface in BAR0
+#define VIRTIO_PCI_HOST_FEATURES 0x00
+#define VIRTIO_PCI_GUEST_FEATURES 0x04
+#define VIRTIO_PCI_QUEUE_PFN 0x08
+#define VIRTIO_PCI_QUEUE_SIZE 0x0C
+#define VIRTIO_PCI_QUEUE_SELECT 0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY 0x10
+#define VIRTIO_PCI_STATUS 0x12
+#define VIRTIO_PCI_ISR 0x13 // Reading acknowledges the interrupt
+#define VIRTIO_PCI_CONFIG 0x14 // Device config; MSI-X stays off, so it starts here
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED 0x80
+#define VIRTIO_ISR_QUEUE 0x01
+#define VIRTIO_BLK_F_SEG_MAX (1u << 2)
+#define VIRTIO_BLK_F_RO (1u << 5)
+#define VIRTIO_BLK_CONFIG_CAPACITY 0x00
+#define VIRTIO_BLK_CONFIG_SEG_MAX 0x0C
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_S_OK 0
+#define VIRTQ_DESC_F_NEXT 0x1
+#define VIRTQ_DESC_F_WRITE 0x2 // Device writes this buffer
+#define VIRTQ_USED_F_NO_NOTIFY 0x1
+#define VIRTQ_ALIGN PAGE_SIZE // Legacy layout: the used ring starts on a page
+#define VIRTQ_MAX_SIZE 1024
+#define BLOCK_MAX_FRAMES 32 // Page frames per request, 128 KB
+#define SECTOR_SIZE 512
+#define SECTORS_PER_PAGE (PAGE_SIZE / SECTOR_SIZE)
+
+typedef struct {
+    uint64_t address; // Physical
+    uint32_t length;
+    uint16_t flags;
+    uint16_t next;
+} VirtqDesc;
+
+typedef struct {
+    uint16_t flags;
+    volatile uint16_t index;
+    uint16_t ring[];
+} VirtqAvail;
+
+typedef struct {
+    uint32_t id; // Head descriptor of the finished chain
+    uint32_t length;
+} VirtqUsedElem;
+
+typedef struct {
+    volatile uint16_t flags;
+    volatile uint16_t index;
+    VirtqUsedElem ring[];
+} VirtqUsed;
+
+typedef enum {
+    BLOCK_PENDING,
+    BLOCK_OK,
+    BLOCK_ERROR,
+} BlockStatus;
+
+// One disk transfer, straight between the device and the caller's page
+// frames. The request must stay put until block_wait() returns.
+typedef struct BlockRequest {
+    uint64_t sector;
+    uint32_t frames[BLOCK_MAX_FRAMES]; // Page-aligned physical addresses
+    uint32_t frame_count; // Transfers frame_count * SECTORS_PER_PAGE sectors
+    bool write;
+    volatile BlockStatus status;
+    Thread *waiter; // Blocked in block_wait()
+} BlockRequest;
+
+// Header and status byte of the request whose chain starts at the same
+// descriptor index
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+    volatile uint8_t status;
+    BlockRequest *request;
+} VirtioBlkSlot;
+
+typedef struct {
+    uint16_t io_base;
+    uint8_t irq;
+    bool read_only;
+    uint16_t queue_size;
+    uint32_t ring_order; // alloc_pages() order of the ring memory
+    VirtqDesc *desc;
+    VirtqAvail *avail;
+    VirtqUsed *used;
+    VirtioBlkSlot *slots;
+    uint16_t free_head; // Free descriptors, linked through next
+    uint16_t free_count;
+    uint16_t last_used; // Used ring entries consumed so far
+    uint64_t capacity; // Sectors
+    uint32_t seg_max; // Data descriptors per request
+    uint32_t in_flight;
+    uint32_t max_in_flight; // Highest in_flight seen
+    uint32_t completed;
+    Thread *ring_waiters; // Blocked in block_submit() until descriptors are freed
+    Spinlock lock; // Rings, free list, slots and ring_waiters; IRQ side too
+} VirtioBlk;
+
+static VirtioBlk virtio_blk;
+static bool virtio_blk_present = false;
+
+// Function Prototypes for virtio-blk
+void virtio_blk_init(void);
+void virtio_blk_irq(InterruptFrame *frame);
+bool block_submit(BlockRequest *request);
+bool block_wait(BlockRequest *request);
+bool block_transfer(BlockRequest *request);
+
+// Bytes of a legacy split virtqueue with size entries
+static uint32_t virtq_bytes(uint32_t size) {
+    uint32_t driver_area = sizeof(VirtqDesc) * size + sizeof(uint16_t) * (3 + size);
+    uint32_t device_area = sizeof(uint16_t) * 3 + sizeof(VirtqUsedElem) * size;
+    return ((driver_area + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1)) + device_area;
+}
+
+// Find the device, negotiate features and hand it queue 0
+void virtio_blk_init(void) {
+    PciDevice *dev = pci_find(VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID);
+    if (dev == NULL) {
+        return;
+    }
+    if (!(dev->bar[0] & PCI_BAR_IO) || dev->irq == PCI_NO_IRQ) {
+        klog("virtio-blk: no I/O BAR or IRQ at %02x:%02x", dev->bus, dev->device);
+        return;
+    }
+    VirtioBlk *blk = &virtio_blk;
+    uint16_t io = dev->bar[0] & ~3u;
+    blk->io_base = io;
+    blk->irq = dev->irq;
+    pci_enable(dev);
+
+    outb(io + VIRTIO_PCI_STATUS, 0); // Reset
+    outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    uint32_t features = inl(io + VIRTIO_PCI_HOST_FEATURES) & (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO);
+    outl(io + VIRTIO_PCI_GUEST_FEATURES, features);
+    blk->read_only = (features & VIRTIO_BLK_F_RO) != 0;
+    blk->capacity = inl(io + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY) |
+                    (uint64_t)inl(io + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32;
+    blk->seg_max = BLOCK_MAX_FRAMES;
+    if (features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t seg_max = inl(io + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CONFIG_SEG_MAX);
+        if (seg_max > 0 && seg_max < blk->seg_max) {
+            blk->seg_max = seg_max;
+        }
+    }
+
+    // Legacy devices fix the queue size; the ring must be exactly that big
+    outw(io + VIRTIO_PCI_QUEUE_SELECT, 0);
+    blk->queue_size = inw(io + VIRTIO_PCI_QUEUE_SIZE);
+    if (blk->queue_size == 0 || blk->queue_size > VIRTQ_MAX_SIZE) {
+        klog("virtio-blk: unusable queue size %u", blk->queue_size, 0);
+        outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return;
+    }
+    uint32_t bytes = virtq_bytes(blk->queue_size);
+    blk->ring_order = 0;
+    while (((uint32_t)PAGE_SIZE << blk->ring_order) < bytes) {
+        blk->ring_order++;
+    }
+    uint32_t ring = alloc_pages(blk->ring_order);
+    blk->slots = kmalloc(sizeof(VirtioBlkSlot) * blk->queue_size);
+    if (ring == 0 || blk->slots == NULL) {
+        klog("virtio-blk: out of memory for a %u-entry queue", blk->queue_size, 0);
+        if (ring != 0) {
+            free_pages(ring, blk->ring_order);
+        }
+        kfree(blk->slots);
+        blk->slots = NULL;
+        outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return;
+    }
+    memset((void *)ring, 0, PAGE_SIZE << blk->ring_order);
+    blk->desc = (VirtqDesc *)ring;
+    blk->avail = (VirtqAvail *)(ring + sizeof(VirtqDesc) * blk->queue_size);
+    blk->used = (VirtqUsed *)(ring + bytes - (sizeof(uint16_t) * 3 + sizeof(VirtqUsedElem) * blk->queue_size));
+    for (uint16_t i = 0; i < blk->queue_size; i++) {
+        blk->desc[i].next = i + 1;
+    }
+    blk->free_head = 0;
+    blk->free_count = blk->queue_size;
+    outl(io + VIRTIO_PCI_QUEUE_PFN, ring >> PAGE_SHIFT);
+
+    irq_install_handler(blk->irq, virtio_blk_irq);
+    outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    virtio_blk_present = true;
+    klog("virtio-blk: %u MB, queue of %u", (uint32_t)(blk->capacity >> 11), blk->queue_size);
+}
+
+static uint16_t virtq_take(VirtioBlk *blk) {
+    uint16_t index = blk->free_head;
+    blk->free_head = blk->desc[index].next;
+    blk->free_count--;
+    return index;
+}
+
+// Queue a request and notify the device. Adjacent frames share a
+// descriptor. Waits while the ring is full, then returns without waiting
+// for the transfer. False, with the request marked failed, only when it
+// is malformed or there is no disk.
+bool block_submit(BlockRequest *request) {
+    VirtioBlk *blk = &virtio_blk;
+    uint32_t segments = 0;
+    for (uint32_t i = 0; i < request->frame_count; i++) {
+        if (i == 0 || request->frames[i] != request->frames[i - 1] + PAGE_SIZE) {
+            segments++;
+        }
+    }
+    uint64_t sectors = (uint64_t)request->frame_count * SECTORS_PER_PAGE;
+    request->waiter = NULL;
+    request->status = BLOCK_ERROR;
+    if (!virtio_blk_present || request->frame_count == 0 || request->frame_count > BLOCK_MAX_FRAMES ||
+        segments > blk->seg_max || segments + 2 > blk->queue_size || request->sector + sectors > blk->capacity ||
+        (request->write && blk->read_only)) {
+        return false;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&blk->lock);
+    while (blk->free_count < segments + 2) {
+        Thread *self = current_thread();
+        if (self != NULL) {
+            self->state = THREAD_BLOCKED;
+            self->next = blk->ring_waiters;
+            blk->ring_waiters = self;
+            spin_unlock(&blk->lock);
+            thread_yield();
+        } else {
+            spin_unlock(&blk->lock);
+            __asm__ __volatile__("sti; hlt; cli"); // Before sched_init(): the IRQ frees descriptors
+        }
+        spin_lock(&blk->lock);
+    }
+    request->status = BLOCK_PENDING;
+    uint16_t head = virtq_take(blk);
+    VirtioBlkSlot *slot = &blk->slots[head];
+    slot->type = request->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    slot->reserved = 0;
+    slot->sector = request->sector;
+    slot->status = 0xFF;
+    slot->request = request;
+    blk->desc[head].address = (uint32_t)slot;
+    blk->desc[head].length = offsetof(VirtioBlkSlot, status); // type, reserved, sector
+    blk->desc[head].flags = VIRTQ_DESC_F_NEXT;
+
+    uint16_t last = head;
+    uint16_t data_flags = VIRTQ_DESC_F_NEXT | (request->write ? 0 : VIRTQ_DESC_F_WRITE);
+    for (uint32_t i = 0; i < request->frame_count; i++) {
+        if (i > 0 && request->frames[i] == request->frames[i - 1] + PAGE_SIZE) {
+            blk->desc[last].length += PAGE_SIZE;
+            continue;
+        }
+        uint16_t index = virtq_take(blk);
+        blk->desc[last].next = index;
+        blk->desc[index].address = request->frames[i];
+        blk->desc[index].length = PAGE_SIZE;
+        blk->desc[index].flags = data_flags;
+        last = index;
+    }
+    uint16_t status = virtq_take(blk);
+    blk->desc[last].next = status;
+    blk->desc[status].address = (uint32_t)&slot->status;
+    blk->desc[status].length = 1;
+    blk->desc[status].flags = VIRTQ_DESC_F_WRITE;
+
+    uint16_t avail = blk->avail->index;
+    blk->avail->ring[avail % blk->queue_size] = head;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // Chain and ring entry before the index
+    blk->avail->index = avail + 1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // Index before reading the device's flags
+    if (++blk->in_flight > blk->max_in_flight) {
+        blk->max_in_flight = blk->in_flight;
+    }
+    if (!(blk->used->flags & VIRTQ_USED_F_NO_NOTIFY)) {
+        outw(blk->io_base + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+    }
+    spin_unlock_irqrestore(&blk->lock, flags);
+    return true;
+}
+
+// Block until the device is done with request; true if it succeeded
+bool block_wait(BlockRequest *request) {
+    uint32_t flags = spin_lock_irqsave(&virtio_blk.lock);
+    Thread *self = current_thread();
+    if (request->status == BLOCK_PENDING && self != NULL) {
+        self->state = THREAD_BLOCKED;
+        request->waiter = self;
+        spin_unlock(&virtio_blk.lock);
+        thread_yield();
+    } else {
+        spin_unlock(&virtio_blk.lock);
+    }
+    irq_restore(flags);
+    while (request->status == BLOCK_PENDING) {
+        __asm__ __volatile__("hlt"); // Before sched_init(): the IRQ still completes it
+    }
+    return request->status == BLOCK_OK;
+}
+
+// Submit and wait. A kill waits until the device is done with request,
+// which usually lives in the caller's frame.
+bool block_transfer(BlockRequest *request) {
+    kill_defer();
+    bool ok = block_submit(request) && block_wait(request);
+    kill_allow();
+    return ok;
+}
+
+// Completion: hand back every chain the device has put on the used ring
+// and wake the threads waiting for them
+void virtio_blk_irq(InterruptFrame *frame) {
+    (void)frame;
+    VirtioBlk *blk = &virtio_blk;
+    if (!(inb(blk->io_base + VIRTIO_PCI_ISR) & VIRTIO_ISR_QUEUE)) {
+        return; // Another device on a shared line, or a config change
+    }
+    spin_lock(&blk->lock);
+    while (blk->last_used != blk->used->index) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST); // Entry after the index that published it
+        uint16_t head = blk->used->ring[blk->last_used % blk->queue_size].id;
+        VirtioBlkSlot *slot = &blk->slots[head];
+        BlockRequest *request = slot->request;
+        request->status = slot->status == VIRTIO_BLK_S_OK ? BLOCK_OK : BLOCK_ERROR;
+        if (request->waiter) {
+            thread_wake(request->waiter);
+        }
+
+        uint16_t index = head;
+        while (1) {
+            uint16_t next = blk->desc[index].next;
+            bool more = blk->desc[index].flags & VIRTQ_DESC_F_NEXT;
+            blk->desc[index].next = blk->free_head;
+            blk->free_head = index;
+            blk->free_count++;
+            if (!more) {
+                break;
+            }
+            index = next;
+        }
+        blk->last_used++;
+        blk->in_flight--;
+        blk->completed++;
+    }
+    // Every submitter retries; those that still do not fit wait again
+    while (blk->ring_waiters) {
+        Thread *thread = blk->ring_waiters;
+        blk->ring_waiters = thread->next;
+        thread_wake(thread);
+    }
+    spin_unlock(&blk->lock);
+}
+
+// Globals for Tic-Tac-Toe
+char board[3][3];
+char current_player;
+
+// Function Prototypes for Tic-Tac-Toe
+void start_tictactoe(void);
+void display_board(void);
+void make_move(int row, int col);
+int check_winner(void);
+void reset_board(void);
+
+// Start the Tic-Tac-Toe game
+void start_tictactoe(void) {
+    reset_board();
+    current_player = 'X';
+    kprintf("Tic-Tac-Toe started! Use row and col (e.g., 1 1).\n");
+    display_board();
+}
+
+// Display the Tic-Tac-Toe board, leaving a blank row before the input
+void display_board(void) {
+    for (int i = 0; i < 3; i++) {
+        kprintf(" %c | %c | %c\n", board[i][0], board[i][1], board[i][2]);
+        if (i < 2) {
+            kprintf("---|---|---\n");
+        }
+    }
+    kprintf("\n");
+}
+
+
+// Make a move in the game
+void make_move(int row, int col) {
+    if (row < 1 || row > 3 || col < 1 || col > 3) {
+        display_text("Invalid position! Use row and col (1-3).", get_cursor_row(), 0);
+        return;
+    }
+
+    row--; col--; // Convert to zero-based index
+    if (board[row][col] != ' ') {
+        display_text("Position already taken!", get_cursor_row(), 0);
+        return;
+    }
+
+    board[row][col] = current_player;
+
+    if (check_winner()) {
+        display_board();
+        kprintf("Player %c wins!", current_player);
+        reset_board();
+        return;
+    }
+
+    // Check for a draw
+    int draw = 1;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            if (board[i][j] == ' ') {
+                draw = 0;
+                break;
+            }
+        }
+        if (!draw) break;
+    }
+
+    if (draw) {
+        display_board();
+        display_text("It's a draw!", get_cursor_row(), 0);
+        reset_board();
+        return;
+    }
+
+    // Switch players
+    current_player = (current_player == 'X') ? 'O' : 'X';
+    display_board();
+}
+
+// Check if there's a winner
+int check_winner(void) {
+    // Check rows, columns, and diagonals
+    for (int i = 0; i < 3; i++) {
+        if (board[i][0] == current_player && board[i][1] == current_player && board[i][2] == current_player) return 1;
+        if (board[0][i] == current_player && board[1][i] == current_player && board[2][i] == current_player) return 1;
+    }
+    if (board[0][0] == current_player && board[1][1] == current_player && board[2][2] == current_player) return 1;
+    if (board[0][2] == current_player && board[1][1] == current_player && board[2][0] == current_player) return 1;
+
+    return 0;
+}
+
+// Reset the Tic-Tac-Toe board
+void reset_board(void) {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            board[i][j] = ' ';
+        }
+    }
+}
+// FNV-1a over the first length bytes of name
+static uint32_t hash_name(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Allocate size bytes (4-byte aligned) from an arena, starting a new
+// heap chunk when the current one is full; NULL when out of memory
+void *arena_alloc(Arena *arena, size_t size) {
+    size_t start = (arena->used + 3) & ~(size_t)3;
+    if (arena->base == NULL || start + size > arena->size) {
+        size_t chunk_size = ARENA_CHUNK_SIZE;
+        if (size + sizeof(uint8_t *) > chunk_size) {
+            chunk_size = size + sizeof(uint8_t *);
+        }
+        uint8_t *chunk = kmalloc(chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        *(uint8_t **)chunk = arena->base;
+        arena->base = chunk;
+        arena->size = chunk_size;
+        start = sizeof(uint8_t *);
+    }
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+// Free every chunk; all pointers handed out by the arena become invalid
+void arena_reset(Arena *arena) {
+    while (arena->base) {
+        uint8_t *previous = *(uint8_t **)arena->base;
+        kfree(arena->base);
+        arena->base = previous;
+    }
+    arena->size = 0;
+    arena->used = 0;
+}
+
+static bool is_name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// Slot holding name, or the empty slot where it would be inserted;
+// NULL before the first variable creates the table
+static Variable *variable_slot(const char *name, size_t length, uint32_t hash) {
+    if (variables == NULL) {
+        return NULL;
+    }
+    uint32_t slot = hash & (var_table_size - 1);
+    while (variables[slot].name) {
+        if (variables[slot].hash == hash &&
+            strncmp(variables[slot].name, name, length) == 0 && variables[slot].name[length] == '\0') {
+            break;
+        }
+        slot = (slot + 1) & (var_table_size - 1);
+    }
+    return &variables[slot];
+}
+
+// Double the table (or create it) and reinsert every entry
+static bool variables_grow(void) {
+    uint32_t new_size = var_table_size ? var_table_size * 2 : VAR_TABLE_MIN;
+    Variable *table = kmalloc(new_size * sizeof(Variable));
+    if (table == NULL) {
+        return false;
+    }
+    memset(table, 0, new_size * sizeof(Variable));
+    for (uint32_t i = 0; i < var_table_size; i++) {
+        if (!variables[i].name) {
+            continue;
+        }
+        uint32_t slot = variables[i].hash & (new_size - 1);
+        while (table[slot].name) {
+            slot = (slot + 1) & (new_size - 1);
+        }
+        table[slot] = variables[i];
+    }
+    kfree(variables);
+    variables = table;
+    var_table_size = new_size;
+    return true;
+}
+
+// Create name or update its value in place. Values that outgrow their
+// storage move to a new arena block. The table doubles at 3/4 load to
+// keep probes short. Returns false when out of memory.
+bool set_variable(const char *name, const char *value) {
+    size_t name_length = strlen(name);
+    size_t value_length = strlen(value);
+    uint32_t hash = hash_name(name, name_length);
+    Variable *var = variable_slot(name, name_length, hash);
+
+    if (var && var->name && value_length < var->value_capacity) {
+        memcpy(var->value, value, value_length + 1);
+        return true;
+    }
+    if (var == NULL || (!var->name && (var_count + 1) * 4 > var_table_size * 3)) {
+        if (!variables_grow()) {
+            return false;
+        }
+        var = variable_slot(name, name_length, hash);
+    }
+
+    // Round up so small edits to a value can stay in place
+    uint32_t capacity = (value_length + 16) & ~15u;
+    char *value_copy = arena_alloc(&var_arena, capacity);
+    if (value_copy == NULL) {
+        return false;
+    }
+    if (!var->name) {
+        char *name_copy = arena_alloc(&var_arena, name_length + 1);
+        if (name_copy == NULL) {
+            return false;
+        }
+        memcpy(name_copy, name, name_length + 1);
+        var->name = name_copy;
+        var->hash = hash;
+        var_count++;
+    }
+    memcpy(value_copy, value, value_length + 1);
+    var->value = value_copy;
+    var->value_capacity = capacity;
+    return true;
+}
+
+// Remove name, shifting later entries of its probe run back so lookups
+// never need tombstones
+bool delete_variable(const char *name) {
+    size_t length = strlen(name);
+    Variable *var = variable_slot(name, length, hash_name(name, length));
+    if (var == NULL || !var->name) {
+        return false;
+    }
+
+    uint32_t hole = var - variables;
+    uint32_t slot = hole;
+    while (1) {
+        slot = (slot + 1) & (var_table_size - 1);
+        if (!variables[slot].name) {
+            break;
+        }
+        // Move the entry back if its home slot is not between hole and slot
+        uint32_t home = variables[slot].hash & (var_table_size - 1);
+        if (((slot - home) & (var_table_size - 1)) >= ((slot - hole) & (var_table_size - 1))) {
+            variables[hole] = variables[slot];
+            hole = slot;
+        }
+    }
+    variables[hole].name = NULL;
+    var_count--;
+
+    // Nothing references the arena any more, so give its chunks back
+    if (var_count == 0) {
+        arena_reset(&var_arena);
+    }
+    return true;
+}
+
+// Function to create a variable
+void create_variable(const char *name, const char *value) {
+    for (const char *p = name; *p; p++) {
+        if (!is_name_char(*p)) {
+            display_text("Invalid variable name!", get_cursor_row(), 0);
+            return;
+        }
+    }
+    preempt_disable(); // The table may be rehashed
+    bool existed = get_variable_value(name) != NULL;
+    bool stored = set_variable(name, value);
+    preempt_enable();
+    if (stored) {
+        display_text(existed ? "Variable updated!" : "Variable created!", get_cursor_row(), 0);
+    } else {
+        display_text("Out of memory!", get_cursor_row(), 0);
+    }
+}
+
+// Function to get a variable's value
+char *get_variable_value(const char *name) {
+    size_t length = strlen(name);
+    Variable *var = variable_slot(name, length, hash_name(name, length));
+    return var && var->name ? var->value : NULL; // NULL: variable not found
+}
+
+// Copy input to output replacing $name with the variable's value.
+// Undefined names expand to nothing; "$$" gives a literal '$'. Like
+// snprintf, returns the full expanded length even when output (size
+// bytes, may be 0) is too small.
+size_t expand_variables(const char *input, char *output, size_t size) {
+    size_t out = 0;
+    while (*input) {
+        const char *text = input;
+        size_t text_length = 1;
+        if (input[0] == '$' && input[1] == '$') {
+            input += 2;
+        } else if (input[0] == '$' && is_name_char(input[1])) {
+            size_t length = 0;
+            input++;
+            while (is_name_char(input[length])) {
+                length++;
+            }
+            Variable *var = variable_slot(input, length, hash_name(input, length));
+            text = var && var->name ? var->value : "";
+            text_length = strlen(text);
+            input += length;
+        } else {
+            input++;
+        }
+        for (size_t i = 0; i < text_length; i++, out++) {
+            if (out + 1 < size) {
+                output[out] = text[i];
+            }
+        }
+    }
+    if (size) {
+        output[out < size ? out : size - 1] = '\0';
+    }
+    return out;
+}
+
+// Function to display all variables
+void display_variables(void) {
+    preempt_disable();
+    for (size_t i = 0; i < var_table_size; i++) {
+        if (!variables[i].name) {
+            continue;
+        }
+        kprintf("%s: %s\n", variables[i].name, variables[i].value); // Cut at one screen row
+    }
+    preempt_enable();
+}
+
+// Function to fill the screen area with a specified character and color
+void fill_area(char fill_char, uint8_t fg_color, uint8_t bg_color, uint16_t start_row, uint16_t start_col, uint16_t height, uint16_t width) {
+    uint16_t cell = fill_char | ((fg_color | (bg_color << 4)) << 8);
+    for (uint16_t row = 0; row < height; row++) {
+        screen_fill((start_row + row) * SCREEN_WIDTH + start_col, cell, width);
+    }
+    console_lock();
+    cursor_pos = (start_row + height) * SCREEN_WIDTH; // Move cursor below filled area
+    update_cursor(cursor_pos);
+    console_unlock();
+}
+// Function to print text in a specified color
+void print_color_text(const char *text, const char *color_name) {
+    int color_code = color_code_from_name(color_name);
+    if (color_code == -1) {
+        display_text("Invalid color name!", get_cursor_row() + 1, 0);
+        return;
+    }
+    console_lock();
+    uint16_t offset = cursor_pos; // Use current cursor position
+    while (*text && offset < SCREEN_CELLS) {
+        *shadow_cell(offset++) = *text | ((color_code | (bg_color << 4)) << 8);
+        text++;
+    }
+    mark_dirty(cursor_pos, offset - cursor_pos);
+    cursor_pos = offset; // Update cursor position
+    update_cursor(cursor_pos);
+    console_unlock();
+}
+
+// Function to set the splash screen color
+void set_color_splash(const char *color_name) {
+    int color_code = color_code_from_name(color_name);
+    if (color_code == -1) {
+        display_text("Invalid color name!", get_cursor_row(), 0);
+        return;
+    }
+    text_color1 = color_code;
+    display_text("Splash text color updated!", get_cursor_row(), 0);
+}
+// Pause Execution
+void pause_com(void) {
+    display_text("Press any key to continue...", get_cursor_row(), 0);
+    screen_flush();
+    uint8_t scancode;
+    do {
+        while (!keyboard_read_scancode(&scancode)) {
+            wait_for_interrupt(); // Wait for key press
+        }
+    } while (scancode & 0x80); // Skip key releases
+}
+void reboot_system(void) {
+    display_text("Rebooting system...", get_cursor_row(), 0);
+    screen_flush();
+    __asm__ __volatile__("cli");
+    // Pulse the CPU reset line through the keyboard controller
+    while (inb(KEYBOARD_STATUS_PORT) & 0x02);
+    outb(KEYBOARD_STATUS_PORT, 0xFE);
+    // Fall back to a triple fault with an empty IDT
+    DescriptorPointer null_idt = { 0, 0 };
+    __asm__ __volatile__("lidt %0; int $0x03" : : "m"(null_idt));
+}
+
+// Shutdown Command
+void shutdown_system(void) {
+    display_text("System shutting down...", get_cursor_row(), 0);
+    screen_flush();
+    // Issue halt instruction
+    __asm__ __volatile__("cli; hlt");
+}
+void get_cpu_info(void) {
+    char cpu_vendor[13];
+    uint32_t max_leaf;
+    // The vendor string comes back in EBX, EDX, ECX order
+    cpuid(0, &max_leaf, (uint32_t *)&cpu_vendor[0], (uint32_t *)&cpu_vendor[8], (uint32_t *)&cpu_vendor[4]);
+    cpu_vendor[12] = '\0';
+
+    kprintf("CPU Vendor: %s\nmemcpy: %s", cpu_vendor, memcpy_variant);
+}
+void get_memory_info(void) {
+    if (frame_count == 0) {
+        display_text("Memory Size: unknown (no multiboot memory map)", get_cursor_row(), 0);
+        return;
+    }
+
+    kprintf("Memory Size: %u KB\nFree: %u KB\n", total_frames * (PAGE_SIZE / 1024),
+            free_frames * (PAGE_SIZE / 1024));
+    if (paging_enabled) {
+        kprintf("Paging: 4 MB pages, split: %u", page_tables);
+    } else {
+        kprintf("Paging: off");
+    }
+}
+void get_uptime(void) {
+    uint32_t milliseconds;
+    uint32_t seconds = (uint32_t)div_u64_u32(ktime_ns(), NS_PER_SEC, &milliseconds);
+    milliseconds /= 1000000;
+
+    kprintf("Uptime: %u.%03u seconds", seconds, milliseconds);
+}
+void get_disk_info(void) {
+    if (!virtio_blk_present) {
+        kprintf("Disk Drives: 0 (no virtio-blk device)");
+        return;
+    }
+    const VirtioBlk *blk = &virtio_blk;
+    kprintf("Disk: virtio-blk, %u MB (%llu sectors)%s\nQueue: %u descriptors, IRQ %u, %u in flight (most %u), %u done",
+            (uint32_t)(blk->capacity >> 11), blk->capacity, blk->read_only ? ", read-only" : "", blk->queue_size,
+            blk->irq, blk->in_flight, blk->max_in_flight, blk->completed);
+}
+void get_system_time(void) {
+    // Boot-time RTC reading advanced by the monotonic clock, no CMOS access
+    uint32_t elapsed = (uint32_t)div_u64_u32(ktime_ns() - rtc_boot_ns, NS_PER_SEC, NULL);
+    uint32_t now = (rtc_boot_seconds + elapsed) % 86400;
+    kprintf("Time: %02u:%02u:%02u", now / 3600, (now / 60) % 60, now % 60);
+}
+
+// Globals for the RAM filesystem
+#define RAMFS_SUFFIX ".tar" // Multiboot modules with this name are mounted
+#define TAR_BLOCK 512
+#define RAMFS_INDEX_MIN 16 // Smallest path index, must be a power of two
+#define RAMFS_MAX_MODULES 16 // Modules looked at for archives
+
+// ustar header, one 512-byte block before each member's data
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12]; // Octal
+    char mtime[12];
+    char checksum[8];
+    char type; // '0' or '\0' file, '5' directory
+    char linkname[100];
+    char magic[6]; // "ustar"
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155]; // Leading path components of long names
+    char pad[12];
+} __attribute__((packed)) TarHeader;
+
+// A file or directory in a mounted archive. Paths have no leading "/"
+// or "./" and no trailing "/"; data points into the module itself.
+typedef struct {
+    char *path;
+    uint32_t hash;
+    const uint8_t *data;
+    uint32_t size;
+    bool directory;
+} RamfsFile;
+
+static RamfsFile *ramfs_files = NULL;
+static uint32_t ramfs_count = 0;
+static uint32_t *ramfs_index = NULL; // Open addressing on path hash: file number + 1, 0 = empty
+static uint32_t ramfs_index_size = 0; // Slots in ramfs_index, a power of two
+
+// Function Prototypes for the RAM filesystem
+void ramfs_init(void);
+const RamfsFile *ramfs_lookup(const char *path, size_t length);
+const uint8_t *ramfs_read(const char *path, uint32_t *size);
+void ramfs_list(const char *directory);
+void ramfs_cat(const char *path);
+
+// Parse an octal tar field; stops at the first non-digit
+static uint32_t tar_octal(const char *field, size_t length) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < length && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (uint32_t)(field[i] - '0');
+    }
+    return value;
+}
+
+// Length of a NUL-padded header field that may fill its whole size
+static size_t tar_field_length(const char *field, size_t size) {
+    size_t length = 0;
+    while (length < size && field[length]) {
+        length++;
+    }
+    return length;
+}
+
+// The checksum field counts as eight spaces in its own sum
+static bool tar_checksum_ok(const TarHeader *header) {
+    const uint8_t *bytes = (const uint8_t *)header;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; i++) {
+        bool in_field = i >= offsetof(TarHeader, checksum) && i < offsetof(TarHeader, type);
+        sum += in_field ? ' ' : bytes[i];
+    }
+    return sum == tar_octal(header->checksum, sizeof(header->checksum));
+}
+
+// Walk one archive; store is NULL while counting, else it has room for
+// capacity members. Returns the number of members (stored or counted);
+// stops at the end blocks, a bad header or a member cut off by the end.
+static uint32_t tar_scan(const uint8_t *archive, uint32_t length, RamfsFile *store, uint32_t capacity) {
+    uint32_t count = 0;
+    for (uint32_t offset = 0; offset <= length && length - offset >= TAR_BLOCK;) {
+        const TarHeader *header = (const TarHeader *)(archive + offset);
+        if (header->name[0] == '\0' || strncmp(header->magic, "ustar", 5) != 0 || !tar_checksum_ok(header)) {
+            break;
+        }
+        uint32_t size = tar_octal(header->size, sizeof(header->size));
+        uint32_t data = offset + TAR_BLOCK;
+        if (size > length - data) {
+            break; // Checked before adding, so a huge size cannot wrap offset
+        }
+        offset = data + ((size + TAR_BLOCK - 1) & ~(uint32_t)(TAR_BLOCK - 1));
+        if (header->type != '0' && header->type != '\0' && header->type != '5') {
+            continue; // Links and devices are not served
+        }
+
+        // prefix + "/" + name, without "./" or "/" in front or "/" behind
+        char path[sizeof(header->prefix) + 1 + sizeof(header->name) + 1];
+        size_t prefix_length = tar_field_length(header->prefix, sizeof(header->prefix));
+        size_t name_length = tar_field_length(header->name, sizeof(header->name));
+        size_t path_length = prefix_length;
+        memcpy(path, header->prefix, prefix_length);
+        if (prefix_length) {
+            path[path_length++] = '/';
+        }
+        memcpy(path + path_length, header->name, name_length);
+        path_length += name_length;
+        size_t start = 0;
+        while (start < path_length && (path[start] == '/' || (path[start] == '.' && path[start + 1] == '/'))) {
+            start += path[start] == '/' ? 1 : 2;
+        }
+        while (path_length > start && path[path_length - 1] == '/') {
+            path_length--;
+        }
+        if (path_length == start) {
+            continue; // The archive root itself
+        }
+
+        if (store) {
+            if (count == capacity) {
+                break;
+            }
+            RamfsFile *file = &store[count];
+            file->path = kmalloc(path_length - start + 1);
+            if (file->path == NULL) {
+                break;
+            }
+            memcpy(file->path, path + start, path_length - start);
+            file->path[path_length - start] = '\0';
+            file->hash = hash_name(file->path, path_length - start);
+            file->data = archive + data;
+            file->size = header->type == '5' ? 0 : size;
+            file->directory = header->type == '5';
+        }
+        count++;
+    }
+    return count;
+}
+
+// Mount every multiboot module named *.tar. All archives share one
+// namespace; a later archive's file hides an earlier one with the same path.
+void ramfs_init(void) {
+    if (boot_info == NULL || !(boot_info->flags & MULTIBOOT_INFO_MODS)) {
+        return;
+    }
+    MultibootModule *modules = (MultibootModule *)boot_info->mods_addr;
+    size_t suffix_length = strlen(RAMFS_SUFFIX);
+    bool is_archive[RAMFS_MAX_MODULES];
+    uint32_t module_count = boot_info->mods_count;
+    if (module_count > RAMFS_MAX_MODULES) {
+        klog("ramfs: %u modules, only the first %u are mounted", module_count, RAMFS_MAX_MODULES);
+        module_count = RAMFS_MAX_MODULES;
+    }
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < module_count; i++) {
+        const char *name = modules[i].string ? (const char *)modules[i].string : "";
+        size_t name_length = 0;
+        while (name[name_length] && name[name_length] != ' ') {
+            name_length++;
+        }
+        is_archive[i] = name_length >= suffix_length &&
+                        strncmp(name + name_length - suffix_length, RAMFS_SUFFIX, suffix_length) == 0;
+        if (is_archive[i]) {
+            total += tar_scan((const uint8_t *)modules[i].mod_start, modules[i].mod_end - modules[i].mod_start, NULL, 0);
+        }
+    }
+    if (total == 0) {
+        return;
+    }
+
+    ramfs_index_size = RAMFS_INDEX_MIN;
+    while (ramfs_index_size < total * 2) {
+        ramfs_index_size *= 2;
+    }
+    ramfs_files = kmalloc(total * sizeof(RamfsFile));
+    ramfs_index = kmalloc(ramfs_index_size * sizeof(uint32_t));
+    if (ramfs_files == NULL || ramfs_index == NULL) {
+        kfree(ramfs_files);
+        kfree(ramfs_index);
+        ramfs_files = NULL;
+        ramfs_index = NULL;
+        ramfs_index_size = 0;
+        klog("ramfs: out of memory indexing %u files", total, 0);
+        return;
+    }
+    memset(ramfs_index, 0, ramfs_index_size * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < module_count; i++) {
+        if (is_archive[i]) {
+            const uint8_t *archive = (const uint8_t *)modules[i].mod_start;
+            ramfs_count += tar_scan(archive, modules[i].mod_end - modules[i].mod_start, ramfs_files + ramfs_count,
+                                    total - ramfs_count);
+        }
+    }
+    for (uint32_t n = 0; n < ramfs_count; n++) {
+        uint32_t slot = ramfs_files[n].hash & (ramfs_index_size - 1);
+        while (ramfs_index[slot] && strcmp(ramfs_files[ramfs_index[slot] - 1].path, ramfs_files[n].path) != 0) {
+            slot = (slot + 1) & (ramfs_index_size - 1);
+        }
+        ramfs_index[slot] = n + 1; // New slot, or replaces the earlier file
+    }
+    klog("ramfs: %u files indexed in %u slots", ramfs_count, ramfs_index_size);
+}
+
+// Find a (not necessarily terminated) path; leading and trailing '/'
+// are ignored. NULL if there is no such file or directory.
+const RamfsFile *ramfs_lookup(const char *path, size_t length) {
+    while (length && *path == '/') {
+        path++;
+        length--;
+    }
+    while (length && path[length - 1] == '/') {
+        length--;
+    }
+    if (ramfs_index_size == 0 || length == 0) {
+        return NULL;
+    }
+    uint32_t slot = hash_name(path, length) & (ramfs_index_size - 1);
+    while (ramfs_index[slot]) {
+        const RamfsFile *file = &ramfs_files[ramfs_index[slot] - 1];
+        if (strncmp(file->path, path, length) == 0 && file->path[length] == '\0') {
+            return file;
+        }
+        slot = (slot + 1) & (ramfs_index_size - 1);
+    }
+    return NULL;
+}
+
+// Zero-copy read: the file's bytes inside the module, or NULL for a
+// missing file or a directory. The data is not terminated.
+const uint8_t *ramfs_read(const char *path, uint32_t *size) {
+    const RamfsFile *file = ramfs_lookup(path, strlen(path));
+    if (file == NULL || file->directory) {
+        return NULL;
+    }
+    *size = file->size;
+    return file->data;
+}
+
+// List the entries directly inside directory ("" or "/" for the root)
+void ramfs_list(const char *directory) {
+    while (*directory == '/') {
+        directory++;
+    }
+    size_t length = strlen(directory);
+    while (length && directory[length - 1] == '/') {
+        length--;
+    }
+
+    // Children are found by path prefix, since archives do not always
+    // carry entries for their directories
+    uint32_t shown = 0;
+    for (uint32_t n = 0; n < ramfs_count; n++) {
+        const RamfsFile *file = &ramfs_files[n];
+        const char *name = file->path;
+        if (length) {
+            if (strncmp(name, directory, length) != 0 || name[length] != '/') {
+                continue;
+            }
+            name += length + 1;
+        }
+        if (strchr(name, '/') || ramfs_lookup(file->path, strlen(file->path)) != file) {
+            continue; // Deeper down, or hidden by a later archive
+        }
+        if (file->directory) {
+            kprintf("%10s  %s/\n", "<dir>", name);
+        } else {
+            kprintf("%10u  %s\n", file->size, name);
+        }
+        shown++;
+    }
+    if (shown == 0) {
+        kprintf(ramfs_count ? "No such directory\n" : "No RAM filesystem mounted\n");
+    }
+}
+
+// Print a file, one screen row per line; long lines wrap
+void ramfs_cat(const char *path) {
+    uint32_t size;
+    const char *text = (const char *)ramfs_read(path, &size);
+    if (text == NULL) {
+        display_text("No such file!", get_cursor_row(), 0);
+        return;
+    }
+    for (uint32_t line = 0; line < size;) {
+        uint32_t end = line;
+        while (end < size && text[end] != '\n' && end - line < SCREEN_WIDTH) {
+            end++;
+        }
+        uint32_t next = end < size && text[end] == '\n' ? end + 1 : end;
+        if (end > line && text[end - 1] == '\r') {
+            end--;
+        }
+        kprintf("%.*s\n", (int)(end - line), text + line);
+        line = next;
+    }
+}
+
+// Globals for the command shell
+#define MAX_ARGS 16
+#define MAX_COMMANDS 64
+#define COMMAND_HASH_SIZE 128 // Open-addressed name index, power of two, > 2 * MAX_COMMANDS
+#define QEMU_EXIT_PORT 0xF4 // QEMU isa-debug-exit device, if present
+#define MAX_SCRIPT_DEPTH 8 // Nested run/repeat commands
+#define SCRIPT_SUFFIX ".dsh" // Multiboot modules with this name run at boot
+#define ADLER_BASE 65521
+#define ADLER_NMAX 5552 // Most bytes before the Adler-32 sums could overflow 32 bits
+#define CHECKSUM_BLOCK_ORDER 8 // checksum -m sums buddy blocks of 2^8 pages (1 MB)
+#define DISK_BENCH_ORDER 4 // 64 KB buffer per disk bench request
+#define DISK_BENCH_MAX_DEPTH 16
+#define DISK_DUMP_BYTES 128
+
+// argv[0] is the command name; args is the raw text after it, for
+// commands that take free text with spaces in it
+typedef void (*command_handler_t)(int argc, char **argv, const char *args);
+
+typedef struct {
+    const char *name;
+    command_handler_t handler;
+    const char *usage; // Line shown by help
+} Command;
+
+static Command command_table[MAX_COMMANDS];
+static size_t command_count = 0;
+static uint8_t command_index[COMMAND_HASH_SIZE]; // Table position + 1, 0 = empty slot
+static bool bench_ack = false; // Report every command's latency on COM1, see tools/bench.py
+
+// Function Prototypes for the command shell
+bool register_command(const char *name, command_handler_t handler, const char *usage);
+const Command *find_command(const char *name, size_t length);
+int tokenize(char *line, char **argv, int max_args);
+const char *skip_args(const char *args, int count);
+void commands_init(void);
+uint32_t run_script(const char *text, size_t length, bool quiet);
+void run_boot_scripts(void);
+
+
+// Add a command to the table; false if the name is taken or the table is full
+bool register_command(const char *name, command_handler_t handler, const char *usage) {
+    size_t length = strlen(name);
+    if (command_count >= MAX_COMMANDS || find_command(name, length)) {
+        return false;
+    }
+
+    command_table[command_count].name = name;
+    command_table[command_count].handler = handler;
+    command_table[command_count].usage = usage;
+    command_count++;
+
+    uint32_t slot = hash_name(name, length) & (COMMAND_HASH_SIZE - 1);
+    while (command_index[slot]) {
+        slot = (slot + 1) & (COMMAND_HASH_SIZE - 1);
+    }
+    command_index[slot] = command_count;
+    return true;
+}
+
+// Hash lookup of a (not necessarily terminated) command name. The index
+// is at most half full, so a miss costs one hash and a short probe no
+// matter how many commands are registered.
+const Command *find_command(const char *name, size_t length) {
+    uint32_t slot = hash_name(name, length) & (COMMAND_HASH_SIZE - 1);
+    while (command_index[slot]) {
+        const Command *command = &command_table[command_index[slot] - 1];
+        if (strncmp(command->name, name, length) == 0 && command->name[length] == '\0') {
+            return command;
+        }
+        slot = (slot + 1) & (COMMAND_HASH_SIZE - 1);
+    }
+    return NULL;
+}
+
+// Split line in place on spaces; returns the number of arguments stored
+int tokenize(char *line, char **argv, int max_args) {
+    int argc = 0;
+    while (*line && argc < max_args) {
+        while (*line == ' ') {
+            *line++ = '\0';
+        }
+        if (*line == '\0') {
+            break;
+        }
+        argv[argc++] = line;
+        while (*line && *line != ' ') {
+            line++;
+        }
+    }
+    return argc;
+}
+
+// Skip count space-separated words of args, returning the rest of the text
+const char *skip_args(const char *args, int count) {
+    while (*args == ' ') {
+        args++;
+    }
+    for (int i = 0; i < count && *args; i++) {
+        while (*args && *args != ' ') {
+            args++;
+        }
+        while (*args == ' ') {
+            args++;
+        }
+    }
+    return args;
+}
+
+// Substitute $name in a command line and dispatch it, timed as PERF_COMMAND
+static bool run_command(const char *line) {
+    preempt_disable(); // Both passes must see the same variables
+    size_t length = expand_variables(line, NULL, 0);
+    char *command = kmalloc(length + 1);
+    if (command == NULL) {
+        preempt_enable();
+        display_text("Out of memory!", get_cursor_row(), 0);
+        return false;
+    }
+    expand_variables(line, command, length + 1);
+    preempt_enable();
+    uint64_t start = perf_begin();
+    bool ok = execute_command(command);
+    perf_end(PERF_COMMAND, start);
+    kfree(command);
+    return ok;
+}
+
+// Run one scripted command, echoed like typed input when asked to. Output
+// starts on a fresh row, except in quiet mode where every command reuses
+// the cursor row so a long script does not scroll the screen.
+static bool script_step(const char *line, bool echo) {
+    if (echo && !current_thread()->script_quiet) {
+        kprintf("> %s\n", line);
+    }
+    bool ok = run_command(line);
+    if (!current_thread()->script_quiet) {
+        console_newline();
+    }
+    return ok;
+}
+
+// Run a list of commands separated by newlines or ';', straight into
+// execute_command() with no keystroke echo. Blank statements and lines
+// starting with '#' are skipped. Returns the number of failed commands.
+uint32_t run_script(const char *text, size_t length, bool quiet) {
+    Thread *self = current_thread(); // Script state is per thread
+    if (self->script_depth >= MAX_SCRIPT_DEPTH) {
+        display_text("Scripts nested too deeply!", get_cursor_row(), 0);
+        return 1;
+    }
+    bool outer_quiet = self->script_quiet;
+    self->script_quiet = outer_quiet || quiet;
+    self->script_depth++;
+
+    uint32_t commands = 0, failed = 0;
+    char *statement = NULL;
+    size_t capacity = 0;
+    for (size_t pos = 0; pos < length;) {
+        size_t end = pos;
+        while (end < length && text[end] != '\n' && text[end] != ';' && text[end] != '\0') {
+            end++;
+        }
+        size_t start = pos;
+        pos = end + 1;
+        while (start < end && (text[start] == ' ' || text[start] == '\t')) {
+            start++;
+        }
+        while (end > start && (text[end - 1] == ' ' || text[end - 1] == '\t' || text[end - 1] == '\r')) {
+            end--;
+        }
+        if (start == end || text[start] == '#') {
+            continue;
+        }
+
+        // Module text is not terminated, so each statement gets a copy
+        if (end - start + 1 > capacity) {
+            char *grown = krealloc(statement, end - start + 1);
+            if (grown == NULL) {
+                display_text("Out of memory!", get_cursor_row(), 0);
+                failed++;
+                break;
+            }
+            statement = grown;
+            capacity = end - start + 1;
+        }
+        memcpy(statement, text + start, end - start);
+        statement[end - start] = '\0';
+        commands++;
+        if (!script_step(statement, true)) {
+            failed++;
+        }
+    }
+    kfree(statement);
+
+    self->script_depth--;
+    self->script_quiet = outer_quiet;
+    if (self->script_depth == 0) {
+        kprintf("Script: %u commands, %u failed", commands, failed);
+    }
+    return failed;
+}
+
+// Run every multiboot module named *.dsh, in load order. A "-q" after
+// the module path (e.g. "module /setup.dsh -q") runs it quietly.
+void run_boot_scripts(void) {
+    if (boot_info == NULL || !(boot_info->flags & MULTIBOOT_INFO_MODS)) {
+        return;
+    }
+    MultibootModule *modules = (MultibootModule *)boot_info->mods_addr;
+    for (uint32_t i = 0; i < boot_info->mods_count; i++) {
+        const char *name = modules[i].string ? (const char *)modules[i].string : "";
+        size_t name_length = 0;
+        while (name[name_length] && name[name_length] != ' ') {
+            name_length++;
+        }
+        size_t suffix_length = strlen(SCRIPT_SUFFIX);
+        if (name_length < suffix_length ||
+            strncmp(name + name_length - suffix_length, SCRIPT_SUFFIX, suffix_length) != 0) {
+            continue;
+        }
+        bool quiet = strcmp(skip_args(name + name_length, 0), "-q") == 0;
+        klog("script: running module %u (%u bytes)", i, modules[i].mod_end - modules[i].mod_start);
+        run_script((const char *)modules[i].mod_start, modules[i].mod_end - modules[i].mod_start, quiet);
+        console_newline();
+    }
+}
+
+// Print one line of output at the cursor row and move to the next row,
+// scrolling when the bottom of the screen is reached
+void print_line(const char *text) {
+    console_lock();
+    while (cursor_pos >= SCREEN_CELLS) {
+        scroll_screen();
+    }
+    display_text(text, get_cursor_row(), 0);
+    cursor_pos = (get_cursor_row() + 1) * SCREEN_WIDTH;
+    update_cursor(cursor_pos);
+    console_unlock();
+}
+
+// Serial-only "<tag> <microseconds>.<fraction>" line for tools/bench.py
+static void bench_report(const char *tag, uint64_t ns) {
+    char line[48];
+    uint32_t fraction;
+    uint32_t micros = (uint32_t)div_u64_u32(ns, 1000, &fraction);
+    console_serial_line(line, ksnprintf(line, sizeof(line), "%s %u.%03u", tag, micros, fraction));
+}
+
+// Print that many full-width lines, flushing each one to VGA memory like
+// interactive output, and report the time taken. Serial mirroring is
+// paused so the UART does not set the pace.
+static void bench_scroll(int lines) {
+    char line[SCREEN_WIDTH + 1];
+    for (int i = 0; i < SCREEN_WIDTH; i++) {
+        line[i] = 'A' + i % 26;
+    }
+    line[SCREEN_WIDTH] = '\0';
+
+    console_mute(true);
+    uint64_t start = ktime_ns();
+    for (int i = 0; i < lines; i++) {
+        line[0] = '0' + i % 10;
+        print_line(line);
+        screen_flush();
+    }
+    uint64_t elapsed = ktime_ns() - start;
+    console_mute(false);
+    bench_report("BENCH scroll", elapsed);
+}
+
+// Adler-32 as in zlib. Partial sums of adjacent pieces combine into the
+// sum of the whole, so parallel jobs give the same result as one pass.
+static uint32_t adler32(uint32_t adler, const uint8_t *data, size_t length) {
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (length > 0) {
+        size_t n = length < ADLER_NMAX ? length : ADLER_NMAX;
+        length -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+    return a | (b << 16);
+}
+
+static uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, uint32_t length2) {
+    uint32_t rem = length2 % ADLER_BASE;
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = rem * sum1 % ADLER_BASE;
+    sum1 += (adler2 & 0xFFFF) + ADLER_BASE - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+    if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if (sum2 >= 2 * ADLER_BASE) sum2 -= 2 * ADLER_BASE;
+    if (sum2 >= ADLER_BASE) sum2 -= ADLER_BASE;
+    return sum1 | (sum2 << 16);
+}
+
+// A piece of a file, or for checksum -m a run of 1 MB blocks summed as
+// if they were one piece
+typedef struct {
+    const uint8_t *data;
+    const uint32_t *blocks; // NULL for a file
+    uint32_t length;
+    uint32_t adler;
+} ChecksumJob;
+
+static void checksum_job(void *arg) {
+    ChecksumJob *job = arg;
+    if (job->blocks == NULL) {
+        job->adler = adler32(1, job->data, job->length);
+        return;
+    }
+    uint32_t adler = 1;
+    for (uint32_t i = 0; i < job->length >> 20; i++) {
+        adler = adler32(adler, (const uint8_t *)job->blocks[i], 1u << 20);
+    }
+    job->adler = adler;
+}
+
+static void cmd_cls(int argc, char **argv, const char *args) {
+    clear_screen();
+}
+
+static void cmd_help(int argc, char **argv, const char *args) {
+    print_line("Available commands:");
+    for (size_t i = 0; i < command_count; i++) {
+        print_line(command_table[i].usage);
+    }
+}
+
+static void cmd_setcolor(int argc, char **argv, const char *args) {
+    if (argc < 3) {
+        display_text("Usage: setcolor <fg> <bg>", get_cursor_row(), 0);
+        return;
+    }
+    int fg = color_code_from_name(argv[1]);
+    int bg = color_code_from_name(argv[2]);
+
+    if (fg != -1 && bg != -1) {
+        console_lock();
+        text_color = fg;
+        bg_color = bg;
+        clear_screen();
+        console_unlock();
+        display_text("Colors updated successfully!", get_cursor_row(), 0);
+    } else {
+        display_text("Invalid color names!", get_cursor_row(), 0);
+    }
+}
+
+static void cmd_cpuinfo(int argc, char **argv, const char *args) {
+    get_cpu_info();
+}
+
+static void cmd_meminfo(int argc, char **argv, const char *args) {
+    get_memory_info();
+}
+
+static void cmd_uptime(int argc, char **argv, const char *args) {
+    get_uptime();
+}
+
+static void cmd_diskinfo(int argc, char **argv, const char *args) {
+    get_disk_info();
+}
+
+static void cmd_lspci(int argc, char **argv, const char *args) {
+    display_pci();
+}
+
+// Hex dump of the start of a sector, read into a page of our own
+static void disk_dump(uint32_t sector) {
+    BlockRequest request = { .sector = sector, .frame_count = 1 };
+    request.frames[0] = alloc_page();
+    if (request.frames[0] == 0) {
+        display_text("Out of memory!", get_cursor_row(), 0);
+        return;
+    }
+    if (!block_transfer(&request)) {
+        display_text("Read failed.", get_cursor_row(), 0);
+        free_pages(request.frames[0], 0);
+        return;
+    }
+    const uint8_t *data = (const uint8_t *)request.frames[0];
+    for (uint32_t offset = 0; offset < DISK_DUMP_BYTES; offset += 16) {
+        char line[SCREEN_WIDTH];
+        size_t length = ksnprintf(line, sizeof(line), "%04x:", offset);
+        for (uint32_t i = 0; i < 16; i++) {
+            length += ksnprintf(line + length, sizeof(line) - length, " %02x", data[offset + i]);
+        }
+        line[length++] = ' ';
+        line[length++] = ' ';
+        for (uint32_t i = 0; i < 16; i++) {
+            uint8_t c = data[offset + i];
+            line[length++] = c >= 0x20 && c < 0x7F ? c : '.';
+        }
+        line[length] = '\0';
+        print_line(line);
+    }
+    free_pages(request.frames[0], 0);
+}
+
+// Read megabytes from sector 0 with depth requests in flight, each one
+// straight into its own buffer, and report the throughput. The requests
+// live in this frame, so a kill waits until they are all drained.
+static void disk_bench(uint32_t megabytes, uint32_t depth) {
+    uint32_t chunk_shift = 3 + DISK_BENCH_ORDER; // Sectors per request, log2
+    uint64_t sectors = (uint64_t)megabytes << 11;
+    if (sectors > virtio_blk.capacity) {
+        sectors = virtio_blk.capacity;
+    }
+    uint32_t chunks = (uint32_t)(sectors >> chunk_shift);
+    uint32_t ring_limit = virtio_blk.queue_size / 3; // Header, buffer and status descriptors each
+    if (depth > ring_limit) {
+        depth = ring_limit;
+    }
+    if (chunks == 0 || depth < 1 || depth > DISK_BENCH_MAX_DEPTH) {
+        display_text("Usage: disk bench <MB> [depth 1-16]", get_cursor_row(), 0);
+        return;
+    }
+
+    BlockRequest requests[DISK_BENCH_MAX_DEPTH];
+    for (uint32_t i = 0; i < depth; i++) {
+        uint32_t buffer = alloc_pages(DISK_BENCH_ORDER);
+        if (buffer == 0) {
+            depth = i;
+            break;
+        }
+        requests[i].frame_count = 1u << DISK_BENCH_ORDER;
+        requests[i].write = false;
+        for (uint32_t f = 0; f < requests[i].frame_count; f++) {
+            requests[i].frames[f] = buffer + f * PAGE_SIZE;
+        }
+    }
+    if (depth == 0) {
+        display_text("Out of memory!", get_cursor_row(), 0);
+        return;
+    }
+
+    kill_defer();
+    uint64_t start = ktime_ns();
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < depth && next < chunks; i++, next++) {
+        requests[i].sector = (uint64_t)next << chunk_shift;
+        block_submit(&requests[i]);
+    }
+    // Chunk n uses request n % depth, so they finish in the order waited on
+    bool failed = false;
+    for (uint32_t done = 0; done < chunks; done++) {
+        BlockRequest *request = &requests[done % depth];
+        if (!block_wait(request)) {
+            failed = true; // Stop issuing, but let what is in flight finish
+        }
+        if (!failed && next < chunks) {
+            request->sector = (uint64_t)next++ << chunk_shift;
+            block_submit(request);
+        }
+    }
+    uint32_t micros = (uint32_t)div_u64_u32(ktime_ns() - start, 1000, NULL);
+    for (uint32_t i = 0; i < depth; i++) {
+        free_pages(requests[i].frames[0], DISK_BENCH_ORDER);
+    }
+    kill_allow();
+
+    if (failed) {
+        display_text("Read failed.", get_cursor_row(), 0);
+        return;
+    }
+    uint64_t bytes = (uint64_t)chunks << (chunk_shift + 9);
+    uint32_t rate = micros ? (uint32_t)div_u64_u32(bytes, micros, NULL) : 0;
+    kprintf("%u KB in %u us: %u MB/s, %u requests of %u KB in flight\n", (uint32_t)(bytes >> 10), micros, rate,
+            depth, PAGE_SIZE << DISK_BENCH_ORDER >> 10);
+}
+
+static void cmd_disk(int argc, char **argv, const char *args) {
+    if (!virtio_blk_present) {
+        display_text("No virtio-blk disk.", get_cursor_row(), 0);
+    } else if (argc >= 3 && strcmp(argv[1], "read") == 0) {
+        disk_dump(atoi(argv[2]));
+    } else if (argc >= 3 && strcmp(argv[1], "bench") == 0) {
+        disk_bench(atoi(argv[2]), argc >= 4 ? atoi(argv[3]) : 8);
+    } else {
+        display_text("Usage: disk read <sector> | disk bench <MB> [depth]", get_cursor_row(), 0);
+    }
+}
+
+static void cmd_heapstat(int argc, char **argv, const char *args) {
+    display_heap_stats();
+}
+
+static void cmd_dmesg(int argc, char **argv, const char *args) {
+    display_klog(argc > 1 ? atoi(argv[1]) : 0);
+}
+
+static Timer prof_timer;
+
+static void prof_tick(Timer *timer, InterruptFrame *frame) {
+    (void)timer;
+    if (prof_running) {
+        prof_sample(frame->eip);
+    }
+}
+
+static void cmd_prof(int argc, char **argv, const char *args) {
+    if (argc < 2) {
+        display_text("Usage: prof start|stop|dump|reset", get_cursor_row(), 0);
+    } else if (strcmp(argv[1], "start") == 0) {
+        if (!prof_running) {
+            // Samples whichever CPU runs this command, every PIT tick's worth of time
+            timer_init(&prof_timer, prof_tick, NULL);
+            prof_running = timer_add(&prof_timer, ktime_ns() + tick_ns, tick_ns);
+        }
+        print_line(prof_running ? "Profiling started." : "No timer free.");
+    } else if (strcmp(argv[1], "stop") == 0) {
+        if (prof_running) {
+            prof_running = false;
+            timer_cancel(&prof_timer);
+        }
+        print_line("Profiling stopped.");
+    } else if (strcmp(argv[1], "dump") == 0) {
+        prof_dump();
+    } else if (strcmp(argv[1], "reset") == 0) {
+        prof_reset();
+        print_line("Profile cleared.");
+    } else {
+        display_text("Usage: prof start|stop|dump|reset", get_cursor_row(), 0);
+    }
+}
+
+static void cmd_bench(int argc, char **argv, const char *args) {
+    if (argc >= 3 && strcmp(argv[1], "scroll") == 0) {
+        bench_scroll(atoi(argv[2]));
+    } else if (argc >= 3 && strcmp(argv[1], "ack") == 0) {
+        bench_ack = strcmp(argv[2], "on") == 0;
+    } else {
+        display_text("Usage: bench scroll <lines> | bench ack on|off", get_cursor_row(), 0);
+    }
+}
+
+// Leave QEMU with status (code << 1) | 1; no effect on real hardware
+static void cmd_exit(int argc, char **argv, const char *args) {
+    klog_drain_serial();
+    uint32_t flags = irq_save();
+    serial_drain();
+    outb(QEMU_EXIT_PORT, argc > 1 ? atoi(argv[1]) : 0);
+    irq_restore(flags);
+    display_text("exit: no isa-debug-exit device", get_cursor_row(), 0);
+}
+
+static void cmd_perf(int argc, char **argv, const char *args) {
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        perf_reset();
+        print_line("Probes reset.");
+        return;
+    }
+    display_perf();
+}
+
+static void cmd_sysclock(int argc, char **argv, const char *args) {
+    get_system_time();
+}
+
+static void cmd_shutdown(int argc, char **argv, const char *args) {
+    shutdown_system();
+}
+
+static void cmd_reboot(int argc, char **argv, const char *args) {
+    reboot_system();
+}
+
+static void cmd_pause(int argc, char **argv, const char *args) {
+    pause_com();
+}
+
+static void cmd_showvars(int argc, char **argv, const char *args) {
+    display_variables(); // Show all variables
+}
+
+static void cmd_fill(int argc, char **argv, const char *args) {
+    clear_screen();
+    if (argc < 6) {
+        display_text("Usage: fill <char> <fg_color> <bg_color> <height> <width>", get_cursor_row(), 0);
+        return;
+    }
+    char fill_char = argv[1][0]; // Take the first character as the fill character
+    int fg_color = color_code_from_name(argv[2]);
+    int bg_color = color_code_from_name(argv[3]);
+    int height = atoi(argv[4]);
+    int width = atoi(argv[5]);
+
+    if (fg_color != -1 && bg_color != -1) {
+        fill_area(fill_char, fg_color, bg_color, 1, 1, height, width);
+    } else {
+        display_text("Invalid color names!", get_cursor_row(), 0);
+    }
+}
+
+static void cmd_calc(int argc, char **argv, const char *args) {
+    if (argc < 4) {
+        display_text("Invalid calculator syntax!", get_cursor_row(), 0);
+        return;
+    }
+    int op1 = atoi(argv[1]);
+    int op2 = atoi(argv[3]);
+    const char *op_str = argv[2];
+    int result = 0;
+
+    if (strcmp(op_str, "+") == 0) {
+        result = op1 + op2;
+    } else if (strcmp(op_str, "-") == 0) {
+        result = op1 - op2;
+    } else if (strcmp(op_str, "*") == 0) {
+        result = op1 * op2;
+    } else if (strcmp(op_str, "/") == 0 && op2 != 0) {
+        result = op1 / op2;
+    } else {
+        display_text("Invalid operator or division by zero!", get_cursor_row(), 0);
+        return;
+    }
+
+    kprintf("Result: %d", result);
+}
+
+static void cmd_setsplash(int argc, char **argv, const char *args) {
+    set_splash(args); // The whole remaining line is the new splash text
+    clear_screen();
+}
+
+static void cmd_tictactoe(int argc, char **argv, const char *args) {
+    start_tictactoe();
+}
+
+static void cmd_move(int argc, char **argv, const char *args) {
+    if (argc < 3) {
+        display_text("Invalid move syntax! Use move row col.", get_cursor_row(), 0);
+        return;
+    }
+    make_move(atoi(argv[1]), atoi(argv[2]));
+}
+
+static void cmd_printcolortext(int argc, char **argv, const char *args) {
+    const char *text = skip_args(args, 1); // Everything after the color name
+    if (argc < 3) {
+        display_text("Usage: printcolortext <color> <text>", get_cursor_row(), 0);
+        return;
+    }
+    print_color_text(text, argv[1]);
+}
+
+static void cmd_setcolorsplash(int argc, char **argv, const char *args) {
+    if (argc < 2) {
+        display_text("Usage: setcolorsplash <color>", get_cursor_row(), 0);
+        return;
+    }
+    set_color_splash(argv[1]);
+}
+
+static void cmd_createvar(int argc, char **argv, const char *args) {
+    const char *value = skip_args(args, 1); // Everything after the name
+    if (argc < 3) {
+        display_text("Usage: createvar <name> <value>", get_cursor_row(), 0);
+        return;
+    }
+    create_variable(argv[1], value);
+}
+
+static void cmd_unset(int argc, char **argv, const char *args) {
+    if (argc < 2) {
+        display_text("Usage: unset <name>", get_cursor_row(), 0);
+        return;
+    }
+    preempt_disable();
+    bool deleted = delete_variable(argv[1]);
+    preempt_enable();
+    display_text(deleted ? "Variable deleted!" : "No such variable!", get_cursor_row(), 0);
+}
+
+static void cmd_run(int argc, char **argv, const char *args) {
+    bool quiet = argc > 1 && strcmp(argv[1], "-q") == 0;
+    const char *script = skip_args(args, quiet ? 1 : 0);
+    if (*script == '\0') {
+        display_text("Usage: run [-q] <command>; <command>; ...", get_cursor_row(), 0);
+        return;
+    }
+    console_newline(); // Keep the typed line
+    run_script(script, strlen(script), quiet);
+}
+
+// Run a command count times with no echo, e.g. to load-test it
+static void cmd_repeat(int argc, char **argv, const char *args) {
+    const char *command = skip_args(args, 1);
+    int count = argc > 1 ? atoi(argv[1]) : 0;
+    if (argc < 3 || count <= 0) {
+        display_text("Usage: repeat <count> <command>", get_cursor_row(), 0);
+        return;
+    }
+    if (current_thread()->script_depth >= MAX_SCRIPT_DEPTH) {
+        display_text("Scripts nested too deeply!", get_cursor_row(), 0);
+        return;
+    }
+    current_thread()->script_depth++;
+    uint32_t failed = 0;
+    for (int i = 0; i < count; i++) {
+        if (!script_step(command, false)) {
+            failed++;
+        }
+    }
+    current_thread()->script_depth--;
+    if (failed) {
+        kprintf("repeat: %u of %d runs failed", failed, count);
+    }
+}
+
+static void cmd_ls(int argc, char **argv, const char *args) {
+    ramfs_list(argc > 1 ? argv[1] : "");
+}
+
+static void cmd_cat(int argc, char **argv, const char *args) {
+    if (argc < 2) {
+        display_text("Usage: cat <file>", get_cursor_row(), 0);
+        return;
+    }
+    ramfs_cat(argv[1]);
+}
+
+// Run a script file from the RAM filesystem
+static void cmd_source(int argc, char **argv, const char *args) {
+    bool quiet = argc > 2 && strcmp(argv[1], "-q") == 0;
+    if (argc < 2 || (argc == 2 && strcmp(argv[1], "-q") == 0)) {
+        display_text("Usage: source [-q] <file>", get_cursor_row(), 0);
+        return;
+    }
+    uint32_t size;
+    const char *script = (const char *)ramfs_read(argv[quiet ? 2 : 1], &size);
+    if (script == NULL) {
+        display_text("No such file!", get_cursor_row(), 0);
+        return;
+    }
+    console_newline(); // Keep the typed line
+    run_script(script, size, quiet);
+}
+
+// Thread body for spawn: one command line, then a fresh row like a
+// script step
+static void spawn_entry(void *arg) {
+    char *line = arg;
+    script_step(line, false);
+    kfree(line);
+}
+
+// Run a command line in a background thread, e.g. "spawn repeat 1000 calc 2 * 3"
+static void cmd_spawn(int argc, char **argv, const char *args) {
+    int options = 0, priority = SCHED_DEFAULT_PRIORITY;
+    bool quiet = false;
+    while (options + 1 < argc) {
+        if (strcmp(argv[options + 1], "-q") == 0) {
+            quiet = true;
+            options++;
+        } else if (strcmp(argv[options + 1], "-p") == 0 && options + 2 < argc) {
+            priority = atoi(argv[options + 2]);
+            options += 2;
+        } else {
+            break;
+        }
+    }
+    const char *command = skip_args(args, options);
+    if (*command == '\0' || priority < 0 || priority >= SCHED_IDLE_PRIORITY) {
+        display_text("Usage: spawn [-q] [-p 0-2] <command>", get_cursor_row(), 0);
+        return;
+    }
+
+    size_t length = strlen(command);
+    char *line = kmalloc(length + 1);
+    if (line == NULL) {
+        display_text("Out of memory!", get_cursor_row(), 0);
+        return;
+    }
+    memcpy(line, command, length + 1);
+    char name[THREAD_NAME_LEN];
+    size_t name_length = 0;
+    while (name_length < THREAD_NAME_LEN - 1 && command[name_length] && command[name_length] != ' ') {
+        name[name_length] = command[name_length];
+        name_length++;
+    }
+    name[name_length] = '\0';
+
+    Thread *thread = thread_alloc(name, (uint8_t)priority);
+    if (thread == NULL) {
+        kfree(line);
+        display_text("Cannot start a thread!", get_cursor_row(), 0);
+        return;
+    }
+    thread_prepare(thread, spawn_entry, line);
+    thread->script_quiet = quiet; // Before another CPU can pick it up
+    thread_enqueue(thread);
+    kprintf("Started thread %u", thread->id);
+}
+
+static void cmd_cpus(int argc, char **argv, const char *args) {
+    display_cpus();
+}
+
+// Split length bytes over the jobs and print their combined Adler-32
+static void checksum_run(ChecksumJob *work, uint32_t jobs, uint32_t length) {
+    void *job_args[MAX_CPUS];
+    for (uint32_t i = 0; i < jobs; i++) {
+        job_args[i] = &work[i];
+    }
+    uint64_t start = ktime_ns();
+    parallel_run(checksum_job, job_args, jobs);
+    uint32_t micros = (uint32_t)div_u64_u32(ktime_ns() - start, 1000, NULL);
+    uint32_t adler = work[0].adler;
+    for (uint32_t i = 1; i < jobs; i++) {
+        adler = adler32_combine(adler, work[i].adler, work[i].length);
+    }
+    uint32_t rate = micros ? (uint32_t)div_u64_u32((uint64_t)length, micros, NULL) : 0; // Bytes per us is MB/s
+    kprintf("adler32 %08x: %u bytes, %u jobs, %u us, %u MB/s\n", adler, length, jobs, micros, rate);
+}
+
+// checksum -m: sum freshly allocated 1 MB blocks, each filled with its
+// number, handing every job a run of whole blocks. Memory in use is
+// never read, since the kernel image and stack guard pages live there.
+static void checksum_memory(uint32_t jobs, uint32_t megabytes) {
+    if (megabytes > free_frames >> CHECKSUM_BLOCK_ORDER) {
+        megabytes = free_frames >> CHECKSUM_BLOCK_ORDER;
+    }
+    uint32_t *blocks = megabytes ? kmalloc(megabytes * sizeof(uint32_t)) : NULL; // None free: no pmm
+    if (blocks == NULL) {
+        display_text("Out of memory!", get_cursor_row(), 0);
+        return;
+    }
+    kill_defer(); // The blocks are freed before a kill ends the thread
+    uint32_t count = 0;
+    while (count < megabytes && (blocks[count] = alloc_pages(CHECKSUM_BLOCK_ORDER)) != 0) {
+        memset((void *)blocks[count], (int)count, 1u << 20);
+        count++;
+    }
+
+    ChecksumJob work[MAX_CPUS];
+    uint32_t first = 0;
+    for (uint32_t i = 0; i < jobs; i++) {
+        uint32_t share = count / jobs + (i < count % jobs);
+        work[i].data = NULL;
+        work[i].blocks = blocks + first;
+        work[i].length = share << 20;
+        first += share;
+    }
+    if (count > 0) {
+        checksum_run(work, jobs, count << 20);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        free_pages(blocks[i], CHECKSUM_BLOCK_ORDER);
+    }
+    kfree(blocks);
+    kill_allow();
+}
+
+// Adler-32 of a file, or of a given amount of memory, split over parallel jobs
+static void cmd_checksum(int argc, char **argv, const char *args) {
+    int arg = 1;
+    uint32_t jobs = cpu_count;
+    if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+        jobs = atoi(argv[2]);
+        arg = 3;
+    }
+    bool memory = arg + 1 < argc && strcmp(argv[arg], "-m") == 0;
+    const uint8_t *data = NULL;
+    uint32_t length = 0;
+    if (!memory && arg < argc) {
+        data = ramfs_read(argv[arg], &length);
+        if (data == NULL) {
+            display_text("No such file!", get_cursor_row(), 0);
+            return;
+        }
+    }
+    int megabytes = memory ? atoi(argv[arg + 1]) : 0;
+    if ((memory ? megabytes < 1 : data == NULL) || jobs < 1 || jobs > MAX_CPUS) {
+        display_text("Usage: checksum [-j 1-8] <file> | -m <megabytes>", get_cursor_row(), 0);
+        return;
+    }
+    if (memory) {
+        checksum_memory(jobs, (uint32_t)megabytes);
+        return;
+    }
+
+    ChecksumJob work[MAX_CPUS];
+    uint32_t piece = length / jobs;
+    for (uint32_t i = 0; i < jobs; i++) {
+        work[i].data = data + i * piece;
+        work[i].blocks = NULL;
+        work[i].length = i + 1 < jobs ? piece : length - i * piece;
+    }
+    checksum_run(work, jobs, length);
+}
+
+static void cmd_sleep(int argc, char **argv, const char *args) {
+    int ms = argc < 2 ? -1 : atoi(argv[1]);
+    if (ms < 0) {
+        display_text("Usage: sleep <milliseconds>", get_cursor_row(), 0);
+        return;
+    }
+    thread_sleep((uint64_t)ms * 1000000);
+}
+
+static void cmd_ps(int argc, char **argv, const char *args) {
+    display_threads();
+}
+
+static void cmd_kill(int argc, char **argv, const char *args) {
+    if (argc < 2) {
+        display_text("Usage: kill <id>", get_cursor_row(), 0);
+        return;
+    }
+    display_text(thread_kill(atoi(argv[1])) ? "Thread killed!" : "No such thread!", get_cursor_row(), 0);
+}
+
+static void cmd_var(int argc, char **argv, const char *args) {
+    const char *value = skip_args(args, 1);
+    if (argc < 3) {
+        display_text("Usage: var <name> <value>", get_cursor_row(), 0);
+        return;
+    }
+    create_variable(argv[1], value);
+}
+
+// Built-in commands, in the order help lists them
+static const Command builtin_commands[] = {
+    { "cls", cmd_cls, "cls - clear screen" },
+    { "help", cmd_help, "help - list available commands" },
+    { "shutdown", cmd_shutdown, "shutdown - shut down the system" },
+    { "tictactoe", cmd_tictactoe, "tictactoe - play Tic-Tac-Toe" },
+    { "move", cmd_move, "move <row> <col> - make a move in Tic-Tac-Toe" },
+    { "calc", cmd_calc, "calc 1 + 1 - calculator" },
+    { "setcolor", cmd_setcolor, "setcolor <fg> <bg> - set text and bg color" },
+    { "pause", cmd_pause, "pause - pause" },
+    { "setsplash", cmd_setsplash, "setsplash <text> - set splash screen" },
+    { "printcolortext", cmd_printcolortext, "printcolortext <color> <text> - print text in color" },
+    { "setcolorsplash", cmd_setcolorsplash, "setcolorsplash <color> - set splash text color" },
+    { "createvar", cmd_createvar, "createvar <name> <value> - create a variable" },
+    { "var", cmd_var, "var <name> <value> - assign a value to a variable" },
+    { "unset", cmd_unset, "unset <name> - delete a variable" },
+    { "showvars", cmd_showvars, "showvars - Displays all defined variables and their values" },
+    { "fill", cmd_fill, "fill <char> <fg> <bg> <height> <width> - fill an area with a character" },
+    { "reboot", cmd_reboot, "reboot - reboot" },
+    { "cpuinfo", cmd_cpuinfo, "cpuinfo - cpu info" },
+    { "meminfo", cmd_meminfo, "meminfo - memory info" },
+    { "uptime", cmd_uptime, "uptime - uptime" },
+    { "sysclock", cmd_sysclock, "sysclock - clock" },
+    { "diskinfo", cmd_diskinfo, "diskinfo - disk info" },
+    { "disk", cmd_disk, "disk read <sector> | bench <MB> [depth] - virtio-blk" },
+    { "lspci", cmd_lspci, "lspci - list PCI devices" },
+    { "heapstat", cmd_heapstat, "heapstat - kernel heap statistics" },
+    { "dmesg", cmd_dmesg, "dmesg [count] - show the kernel log" },
+    { "perf", cmd_perf, "perf [reset] - command, input and screen latencies" },
+    { "prof", cmd_prof, "prof start|stop|dump|reset - sampling profiler" },
+    { "bench", cmd_bench, "bench scroll <lines> | bench ack on|off - benchmarks" },
+    { "exit", cmd_exit, "exit [code] - quit QEMU (isa-debug-exit)" },
+    { "run", cmd_run, "run [-q] <cmd>; <cmd>... - run commands as a script, -q quietly" },
+    { "repeat", cmd_repeat, "repeat <count> <command> - run a command count times" },
+    { "ls", cmd_ls, "ls [dir] - list files in the RAM filesystem" },
+    { "cat", cmd_cat, "cat <file> - print a file" },
+    { "source", cmd_source, "source [-q] <file> - run a script file" },
+    { "spawn", cmd_spawn, "spawn [-q] [-p 0-2] <command> - run a command in a new thread" },
+    { "ps", cmd_ps, "ps - list threads" },
+    { "kill", cmd_kill, "kill <id> - end a thread" },
+    { "sleep", cmd_sleep, "sleep <ms> - pause this thread" },
+    { "cpus", cmd_cpus, "cpus - per-CPU scheduler statistics" },
+    { "checksum", cmd_checksum, "checksum [-j jobs] <file> | -m <MB> - parallel Adler-32" },
+};
+
+void commands_init(void) {
+    for (size_t i = 0; i < sizeof(builtin_commands) / sizeof(builtin_commands[0]); i++) {
+        register_command(builtin_commands[i].name, builtin_commands[i].handler, builtin_commands[i].usage);
+    }
+}
+
+// Look the first word up in the command table and run its handler;
+// false for an unknown command or when out of memory
+bool execute_command(const char *command) {
+    while (*command == ' ') {
+        command++;
+    }
+    size_t name_length = 0;
+    while (command[name_length] && command[name_length] != ' ') {
+        name_length++;
+    }
+    if (name_length == 0) {
+        return true;
+    }
+
+    const Command *entry = find_command(command, name_length);
+    if (entry == NULL) {
+        display_text("Unknown command! Enter help!", get_cursor_row(), 0);
+        return false;
+    }
+
+    // Tokenize a private copy, leaving command intact for the raw argument
+    // string. The copy is freed on return, so handlers must not keep argv.
+    size_t length = strlen(command);
+    char *line = kmalloc(length + 1);
+    if (line == NULL) {
+        display_text("Out of memory!", get_cursor_row(), 0);
+        return false;
+    }
+    char *argv[MAX_ARGS];
+    memcpy(line, command, length + 1);
+    int argc = tokenize(line, argv, MAX_ARGS);
+    entry->handler(argc, argv, skip_args(command + name_length, 0));
+    kfree(line);
+    return true;
+}
+
+int color_code_from_name(const char *name) {
+    if (strcmp(name, "black") == 0) return 0;
+    if (strcmp(name, "blue") == 0) return 1;
+    if (strcmp(name, "green") == 0) return 2;
+    if (strcmp(name, "cyan") == 0) return 3;
+    if (strcmp(name, "red") == 0) return 4;
+    if (strcmp(name, "magenta") == 0) return 5;
+    if (strcmp(name, "brown") == 0) return 6;
+    if (strcmp(name, "light_gray") == 0) return 7;
+    if (strcmp(name, "dark_gray") == 0) return 8;
+    if (strcmp(name, "light_blue") == 0) return 9;
+    if (strcmp(name, "light_green") == 0) return 10;
+    if (strcmp(name, "light_cyan") == 0) return 11;
+    if (strcmp(name, "light_red") == 0) return 12;
+    if (strcmp(name, "light_magenta") == 0) return 13;
+    if (strcmp(name, "yellow") == 0) return 14;
+    if (strcmp(name, "white") == 0) return 15;
+    return -1;
+}
+
+
+// Process input when the Enter key is pressed
+void process_input(void) {
+    uint64_t started = ktime_ns();
+    if (input_index > 0) {
+        input_buffer[input_index] = '\0'; // Null-terminate the string
+        run_command(input_buffer);
+    }
+    console_newline();
+    if (bench_ack) {
+        bench_report("ACK", ktime_ns() - started);
+    }
+}
+
+// Initialize the system
+void init_system(void) {
+    gdt_init(); // First: per-CPU data is reached through GS
+    mem_init();
+    pmm_init(boot_info);
+    paging_init();
+    sched_init();
+    ramfs_init();
+    commands_init();
+    pic_remap();
+    idt_init();
+    irq_install_handler(1, keyboard_irq);
+    serial_init();
+    pit_init(TIMER_HZ);
+    __asm__ __volatile__("sti");
+    tsc_calibrate();
+    rtc_init();
+    smp_init();
+    pci_init();
+    virtio_blk_init();
+    clear_screen();
+    cursor_pos = 3 * SCREEN_WIDTH; // Start at line 3
+    update_cursor(cursor_pos);
+}
+
+// Main kernel entry point; kernel.asm passes the multiboot magic and info pointer
+void kmain(uint32_t magic, MultibootInfo *info) {
+    if (magic == MULTIBOOT_BOOTLOADER_MAGIC) {
+        boot_info = info;
+    }
+    init_system();
+    display_text(splash_screen, 0, (SCREEN_WIDTH - strlen(splash_screen)) / 2);
+    run_boot_scripts();
+    klog("boot: ready after %u us", (uint32_t)div_u64_u32(ktime_ns(), 1000, NULL), 0);
+    while (1) {
+        handle_keyboard(); // Process scancodes queued by IRQ1
+        handle_serial_input(); // And characters received on COM1
+        klog_drain_serial(); // Copy new kernel log entries to COM1
+        sched_reap(); // Free the stacks of threads that exited
+        screen_flush(); // Push everything drawn for this batch to VGA memory
+        wait_for_interrupt(); // Sleep until input, other threads run meanwhile
+    }
+}
@@ -0,0 +1,517 @@
+// klib.c - string, conversion, formatting and memory routines shared by
+// the kernel and the host test build (see klib.h and tests/)
+#include "klib.h"
+
+// Loops that look like memcpy/memset must not be turned back into calls
+// to memcpy/memset, which would recurse into themselves
+#define NO_LIBCALLS __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+int atoi(const char *str) {
+    uint32_t result = 0;
+    bool negative = false;
+
+    // Handle the sign
+    if (*str == '-' || *str == '+') {
+        negative = *str == '-';
+        str++;
+    }
+
+    // Convert characters to integers. The magnitude is accumulated unsigned
+    // so that "-2147483648" does not overflow on the way.
+    while (*str >= '0' && *str <= '9') {
+        result = result * 10 + (uint32_t)(*str - '0');
+        str++;
+    }
+
+    return (int)(negative ? 0u - result : result);
+}
+
+// Unsigned conversion in any base from 2 to 16
+void utoa(uint32_t value, char *str, int base) {
+    const char *digits = "0123456789ABCDEF";
+    char buffer[32];
+    int i = 0;
+
+    do {
+        buffer[i++] = digits[value % (uint32_t)base];
+        value /= (uint32_t)base;
+    } while (value > 0);
+
+    // Reverse the string into the output buffer
+    int j = 0;
+    while (i > 0) {
+        str[j++] = buffer[--i];
+    }
+    str[j] = '\0';
+}
+
+// Signed in base 10; other bases print the two's complement bit pattern,
+// so itoa(-1, s, 16) gives "FFFFFFFF"
+void itoa(int value, char *str, int base) {
+    if (value < 0 && base == 10) {
+        *str++ = '-';
+        // Negate as unsigned: -INT_MIN does not fit in an int
+        utoa(0u - (uint32_t)value, str, 10);
+        return;
+    }
+    utoa((uint32_t)value, str, base);
+}
+
+// 64-by-32 division without libgcc: two divl steps, the first remainder
+// seeding the high half of the second
+uint64_t div_u64_u32(uint64_t dividend, uint32_t divisor, uint32_t *remainder) {
+    uint32_t high = (uint32_t)(dividend >> 32);
+    uint32_t low = (uint32_t)dividend;
+    uint32_t quotient_high = high / divisor;
+    uint32_t rem = high % divisor;
+    uint32_t quotient_low;
+
+    __asm__("divl %4" : "=a"(quotient_low), "=d"(rem) : "a"(low), "d"(rem), "rm"(divisor));
+    if (remainder) {
+        *remainder = rem;
+    }
+    return ((uint64_t)quotient_high << 32) | quotient_low;
+}
+
+// Output cursor for kvsnprintf: characters past the end are counted, not stored
+typedef struct {
+    char *out;
+    size_t size;
+    size_t length;
+} FormatBuffer;
+
+static void format_put(FormatBuffer *buffer, char c) {
+    if (buffer->length + 1 < buffer->size) {
+        buffer->out[buffer->length] = c;
+    }
+    buffer->length++;
+}
+
+// Emit text padded to width: spaces on the left (or right with '-'), or
+// zeros after any sign when zero_pad is set
+static void format_field(FormatBuffer *buffer, const char *text, size_t length, const char *sign,
+                         size_t width, bool left, bool zero_pad) {
+    size_t sign_length = strlen(sign);
+    size_t pad = width > length + sign_length ? width - length - sign_length : 0;
+    if (!left && !zero_pad) {
+        for (; pad > 0; pad--) {
+            format_put(buffer, ' ');
+        }
+    }
+    while (*sign) {
+        format_put(buffer, *sign++);
+    }
+    if (zero_pad && !left) {
+        for (; pad > 0; pad--) {
+            format_put(buffer, '0');
+        }
+    }
+    for (size_t i = 0; i < length; i++) {
+        format_put(buffer, text[i]);
+    }
+    for (; pad > 0; pad--) {
+        format_put(buffer, ' ');
+    }
+}
+
+// printf-style formatting into out, storing at most size - 1 characters
+// plus the terminator. Returns the length the whole output needed, so a
+// return value >= size means it was cut short.
+// Conversions: %s %c %d %i %u %x %X %p %%, the flags '-' and '0', a
+// field width (digits or '*'), a precision for %s, and the length
+// modifiers l, ll (64-bit) and z.
+size_t kvsnprintf(char *out, size_t size, const char *fmt, va_list args) {
+    FormatBuffer buffer = { out, size, 0 };
+
+    for (const char *p = fmt; *p; p++) {
+        if (*p != '%') {
+            format_put(&buffer, *p);
+            continue;
+        }
+        p++;
+
+        bool left = false, zero_pad = false;
+        for (;; p++) {
+            if (*p == '-') {
+                left = true;
+            } else if (*p == '0') {
+                zero_pad = true;
+            } else {
+                break;
+            }
+        }
+        size_t width = 0;
+        if (*p == '*') {
+            int value = va_arg(args, int);
+            if (value < 0) {
+                left = true;
+                value = -value;
+            }
+            width = (size_t)value;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') {
+            width = width * 10 + (size_t)(*p++ - '0');
+        }
+        size_t precision = (size_t)-1;
+        if (*p == '.') {
+            p++;
+            precision = 0;
+            if (*p == '*') {
+                int value = va_arg(args, int);
+                precision = value < 0 ? (size_t)-1 : (size_t)value;
+                p++;
+            }
+            while (*p >= '0' && *p <= '9') {
+                precision = precision * 10 + (size_t)(*p++ - '0');
+            }
+        }
+        int longs = 0;
+        for (; *p == 'l' || *p == 'z'; p++) {
+            longs += *p == 'l' ? 1 : (sizeof(size_t) > sizeof(uint32_t) ? 2 : 0);
+        }
+
+        char digits[24]; // 2^64 in decimal, or a pointer in hex
+        const char *sign = "";
+        uint64_t value;
+        uint32_t base = 10;
+        const char *digit_chars = "0123456789abcdef";
+        switch (*p) {
+            case 's': {
+                const char *text = va_arg(args, const char *);
+                if (text == NULL) {
+                    text = "(null)";
+                }
+                size_t length = 0;
+                while (length < precision && text[length]) {
+                    length++;
+                }
+                format_field(&buffer, text, length, "", width, left, false);
+                continue;
+            }
+            case 'c':
+                digits[0] = (char)va_arg(args, int);
+                format_field(&buffer, digits, 1, "", width, left, false);
+                continue;
+            case 'd':
+            case 'i': {
+                int64_t signed_value;
+                if (longs >= 2) {
+                    signed_value = va_arg(args, long long);
+                } else if (longs == 1) {
+                    signed_value = va_arg(args, long);
+                } else {
+                    signed_value = va_arg(args, int);
+                }
+                if (signed_value < 0) {
+                    sign = "-";
+                    value = 0 - (uint64_t)signed_value; // Also right for the minimum
+                } else {
+                    value = (uint64_t)signed_value;
+                }
+                break;
+            }
+            case 'p':
+                value = (uintptr_t)va_arg(args, void *);
+                base = 16;
+                sign = "0x";
+                zero_pad = !left;
+                if (width < 2 + 2 * sizeof(void *)) {
+                    width = 2 + 2 * sizeof(void *);
+                }
+                break;
+            case 'X':
+                digit_chars = "0123456789ABCDEF";
+                // Fall through
+            case 'x':
+                base = 16;
+                // Fall through
+            case 'u':
+                if (longs >= 2) {
+                    value = va_arg(args, unsigned long long);
+                } else if (longs == 1) {
+                    value = va_arg(args, unsigned long);
+                } else {
+                    value = va_arg(args, unsigned int);
+                }
+                break;
+            case '\0':
+                p--; // A lone '%' at the end: stop at the terminator
+                continue;
+            default: // %% and unknown conversions print the character
+                format_put(&buffer, *p);
+                continue;
+        }
+
+        // Digits from the least significant end of the scratch buffer
+        size_t start = sizeof(digits);
+        do {
+            uint32_t digit;
+            value = div_u64_u32(value, base, &digit);
+            digits[--start] = digit_chars[digit];
+        } while (value);
+        format_field(&buffer, digits + start, sizeof(digits) - start, sign, width, left, zero_pad);
+    }
+
+    if (size > 0) {
+        out[buffer.length < size ? buffer.length : size - 1] = '\0';
+    }
+    return buffer.length;
+}
+
+size_t ksnprintf(char *out, size_t size, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    size_t length = kvsnprintf(out, size, fmt, args);
+    va_end(args);
+    return length;
+}
+
+// Word-at-a-time strlen: aligned dword reads never cross a page boundary
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+size_t strlen(const char *str) {
+    const char *p = str;
+    while ((uintptr_t)p & 3) {
+        if (*p == '\0') {
+            return p - str;
+        }
+        p++;
+    }
+    const word_t *word = (const word_t *)p;
+    // Non-zero when any byte of the word is zero
+    while (!((*word - 0x01010101u) & ~*word & 0x80808080u)) {
+        word++;
+    }
+    p = (const char *)word;
+    while (*p) {
+        p++;
+    }
+    return p - str;
+}
+
+int strcmp(const char *str1, const char *str2) {
+    while (*str1 && (*str1 == *str2)) {
+        str1++;
+        str2++;
+    }
+    return *(const unsigned char *)str1 - *(const unsigned char *)str2;
+}
+
+// Compare at most n characters; a string ending inside the first n
+// characters compares like strcmp
+int strncmp(const char *str1, const char *str2, size_t n) {
+    for (; n > 0; n--, str1++, str2++) {
+        if (*str1 != *str2 || *str1 == '\0') {
+            return *(const unsigned char *)str1 - *(const unsigned char *)str2;
+        }
+    }
+    return 0;
+}
+
+char *strncpy(char *dest, const char *src, size_t n) {
+    size_t i;
+    for (i = 0; i < n && src[i] != '\0'; i++) {
+        dest[i] = src[i];
+    }
+    for (; i < n; i++) {
+        dest[i] = '\0';
+    }
+    return dest;
+}
+
+// Like the C library, searching for '\0' finds the terminator
+char *strchr(const char *str, int c) {
+    while (*str != (char)c) {
+        if (*str == '\0') {
+            return NULL;
+        }
+        str++;
+    }
+    return (char *)str;
+}
+
+// Memory primitives. memcpy/memset go through function pointers that
+// mem_init() points at the best variant for this CPU; until then the
+// plain byte loops are used.
+typedef void *(*memcpy_fn)(void *dest, const void *src, size_t n);
+typedef void *(*memset_fn)(void *dest, int value, size_t n);
+
+static void *memcpy_bytes(void *dest, const void *src, size_t n);
+static void *memset_bytes(void *dest, int value, size_t n);
+
+static memcpy_fn memcpy_impl = memcpy_bytes;
+static memset_fn memset_impl = memset_bytes;
+const char *memcpy_variant = "bytes";
+
+NO_LIBCALLS
+static void *memcpy_bytes(void *dest, const void *src, size_t n) {
+    char *d = (char *)dest;
+    const char *s = (const char *)src;
+    for (size_t i = 0; i < n; i++) {
+        d[i] = s[i];
+    }
+    return dest;
+}
+
+NO_LIBCALLS
+static void *memset_bytes(void *dest, int value, size_t n) {
+    uint8_t *d = (uint8_t *)dest;
+    for (size_t i = 0; i < n; i++) {
+        d[i] = (uint8_t)value;
+    }
+    return dest;
+}
+
+// Dword string moves plus a byte tail; good on every CPU with a TSC
+static void *memcpy_movsd(void *dest, const void *src, size_t n) {
+    void *d = dest;
+    size_t dwords = n >> 2;
+    __asm__ __volatile__(
+        "rep movsl\n"
+        "mov %k3, %%ecx\n"
+        "rep movsb"
+        : "+D"(d), "+S"(src), "+c"(dwords) : "r"(n & 3) : "memory"
+    );
+    return dest;
+}
+
+static void *memset_stosd(void *dest, int value, size_t n) {
+    void *d = dest;
+    uint32_t pattern = (uint8_t)value * 0x01010101u;
+    size_t dwords = n >> 2;
+    __asm__ __volatile__(
+        "rep stosl\n"
+        "mov %k3, %%ecx\n"
+        "rep stosb"
+        : "+D"(d), "+c"(dwords) : "a"(pattern), "r"(n & 3) : "memory"
+    );
+    return dest;
+}
+
+// Enhanced REP MOVSB/STOSB: microcode picks the widest moves itself
+static void *memcpy_erms(void *dest, const void *src, size_t n) {
+    void *d = dest;
+    __asm__ __volatile__("rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
+    return dest;
+}
+
+static void *memset_erms(void *dest, int value, size_t n) {
+    void *d = dest;
+    __asm__ __volatile__("rep stosb" : "+D"(d), "+c"(n) : "a"(value) : "memory");
+    return dest;
+}
+
+#ifdef KERNEL_SSE2
+// 64 bytes per iteration through xmm0-3. Only built with -DKERNEL_SSE2,
+// since nothing else in the kernel saves SSE state: not interrupts and
+// not context switches, so two threads copying at once corrupt each other.
+__attribute__((target("sse2")))
+static void *memcpy_sse2(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+    for (; n >= 64; n -= 64, d += 64, s += 64) {
+        __asm__ __volatile__(
+            "movdqu 0(%1), %%xmm0\n"
+            "movdqu 16(%1), %%xmm1\n"
+            "movdqu 32(%1), %%xmm2\n"
+            "movdqu 48(%1), %%xmm3\n"
+            "movdqu %%xmm0, 0(%0)\n"
+            "movdqu %%xmm1, 16(%0)\n"
+            "movdqu %%xmm2, 32(%0)\n"
+            "movdqu %%xmm3, 48(%0)\n"
+            : : "r"(d), "r"(s) : "memory", "xmm0", "xmm1", "xmm2", "xmm3"
+        );
+    }
+    memcpy_movsd(d, s, n);
+    return dest;
+}
+
+static void sse_enable(void) {
+#ifndef KLIB_HOSTED // A hosted OS has already turned SSE on
+    uint32_t cr0, cr4;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~(1u << 2)) | (1u << 1); // Clear EM, set MP
+    __asm__ __volatile__("mov %0, %%cr0" : : "r"(cr0));
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= (1u << 9) | (1u << 10); // OSFXSR, OSXMMEXCPT
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4));
+#endif
+}
+#endif
+
+// Pick memcpy/memset variants from the CPUID feature bits
+void mem_init(void) {
+    uint32_t max_leaf, eax, ebx, ecx, edx;
+    cpuid(0, &max_leaf, &ebx, &ecx, &edx);
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    bool has_sse2 = (edx & (1u << 26)) != 0;
+    bool has_erms = false;
+    if (max_leaf >= 7) {
+        cpuid(7, &eax, &ebx, &ecx, &edx);
+        has_erms = (ebx & (1u << 9)) != 0;
+    }
+
+    memcpy_impl = memcpy_movsd;
+    memset_impl = memset_stosd;
+    memcpy_variant = "rep movsd";
+    if (has_erms) {
+        memcpy_impl = memcpy_erms;
+        memset_impl = memset_erms;
+        memcpy_variant = "rep movsb (ERMS)";
+    }
+#ifdef KERNEL_SSE2
+    if (has_sse2 && !has_erms) {
+        sse_enable();
+        memcpy_impl = memcpy_sse2;
+        memcpy_variant = "SSE2";
+    }
+#else
+    (void)has_sse2;
+#endif
+}
+
+void *memcpy(void *dest, const void *src, size_t n) {
+    return memcpy_impl(dest, src, n);
+}
+
+void *memset(void *dest, int value, size_t n) {
+    return memset_impl(dest, value, n);
+}
+
+// Overlap-safe copy: forwards through memcpy unless dest lies inside src
+void *memmove(void *dest, const void *src, size_t n) {
+    if ((uintptr_t)dest - (uintptr_t)src >= n) {
+        return memcpy_impl(dest, src, n);
+    }
+    // Copy backwards from the last byte, dwords first then the head bytes
+    void *d = (uint8_t *)dest + n - 1;
+    const void *s = (const uint8_t *)src + n - 1;
+    size_t head = n & 3;
+    __asm__ __volatile__(
+        "std\n"
+        "rep movsb\n"
+        "sub $3, %0\n"
+        "sub $3, %1\n"
+        "mov %k3, %%ecx\n"
+        "rep movsl\n"
+        "cld"
+        : "+D"(d), "+S"(s), "+c"(head) : "r"(n >> 2) : "memory"
+    );
+    return dest;
+}
+
+// Fill count 16-bit cells, e.g. blank screen rows; two cells per store
+void memset16(uint16_t *dest, uint16_t value, size_t count) {
+    if (count && ((uintptr_t)dest & 2)) {
+        *dest++ = value;
+        count--;
+    }
+    uint32_t pattern = value | ((uint32_t)value << 16);
+    void *d = dest;
+    size_t dwords = count >> 1;
+    __asm__ __volatile__("rep stosl" : "+D"(d), "+c"(dwords) : "a"(pattern) : "memory");
+    if (count & 1) {
+        dest[count - 1] = value;
+    }
+}
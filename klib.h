@@ -0,0 +1,60 @@
+// klib.h - the kernel's small C library: string, conversion, formatting
+// and memory routines. klib.c builds freestanding for the kernel and, with
+// -DKLIB_HOSTED, as an ordinary Linux object for the tests in tests/
+#ifndef KLIB_H
+#define KLIB_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef KLIB_HOSTED
+// Hosted builds link against the C library too, so klib's symbols get
+// their own names there. Code including this header is unaffected.
+#define atoi klib_atoi
+#define itoa klib_itoa
+#define utoa klib_utoa
+#define strlen klib_strlen
+#define strcmp klib_strcmp
+#define strncmp klib_strncmp
+#define strncpy klib_strncpy
+#define strchr klib_strchr
+#define memcpy klib_memcpy
+#define memset klib_memset
+#define memmove klib_memmove
+#define memset16 klib_memset16
+#define mem_init klib_mem_init
+#define memcpy_variant klib_memcpy_variant
+#endif
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    __asm__ __volatile__("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+// Conversions
+int atoi(const char *str);
+void itoa(int value, char *str, int base);
+void utoa(uint32_t value, char *str, int base);
+uint64_t div_u64_u32(uint64_t dividend, uint32_t divisor, uint32_t *remainder);
+
+// Formatting
+size_t kvsnprintf(char *out, size_t size, const char *fmt, va_list args);
+size_t ksnprintf(char *out, size_t size, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+// Strings
+size_t strlen(const char *str);
+int strcmp(const char *str1, const char *str2);
+int strncmp(const char *str1, const char *str2, size_t n);
+char *strncpy(char *dest, const char *src, size_t n);
+char *strchr(const char *str, int c);
+
+// Memory
+void *memcpy(void *dest, const void *src, size_t n);
+void *memset(void *dest, int value, size_t n);
+void *memmove(void *dest, const void *src, size_t n);
+void memset16(uint16_t *dest, uint16_t value, size_t count);
+void mem_init(void);
+extern const char *memcpy_variant; // Variant mem_init() picked, shown by cpuinfo
+
+#endif
@@ -0,0 +1,140 @@
+// Host microbenchmarks for klib.c: ns per call across input sizes, with
+// the C library alongside for reference. Build and run with
+// `make -C tests bench`; pass a minimum run time in ms to change 200.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The C library's versions, taken before klib.h renames the symbols
+static void *(*libc_memcpy)(void *, const void *, size_t) = memcpy;
+static void *(*libc_memset)(void *, int, size_t) = memset;
+static void *(*libc_memmove)(void *, const void *, size_t) = memmove;
+static size_t (*libc_strlen)(const char *) = strlen;
+static int (*libc_strcmp)(const char *, const char *) = strcmp;
+
+#include "klib.h"
+
+#define MAX_SIZE 65536
+
+static unsigned char src[MAX_SIZE + 64];
+static unsigned char dest[MAX_SIZE + 64];
+static char text[MAX_SIZE + 64];
+static char text2[MAX_SIZE + 64];
+static volatile size_t sink; // Keeps results alive
+static double min_seconds = 0.2;
+
+typedef void (*bench_fn)(size_t size);
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Double the iteration count until a run takes min_seconds, then report it
+static double ns_per_op(bench_fn fn, size_t size) {
+    for (size_t iterations = 16;; iterations *= 2) {
+        double start = now();
+        for (size_t i = 0; i < iterations; i++) {
+            fn(size);
+        }
+        double elapsed = now() - start;
+        if (elapsed >= min_seconds) {
+            return elapsed * 1e9 / iterations;
+        }
+    }
+}
+
+static void klib_memcpy_op(size_t size) { memcpy(dest, src, size); }
+static void libc_memcpy_op(size_t size) { libc_memcpy(dest, src, size); }
+static void klib_memcpy_unaligned_op(size_t size) { memcpy(dest + 1, src + 3, size); }
+static void libc_memcpy_unaligned_op(size_t size) { libc_memcpy(dest + 1, src + 3, size); }
+static void klib_memset_op(size_t size) { memset(dest, 0x20, size); }
+static void libc_memset_op(size_t size) { libc_memset(dest, 0x20, size); }
+static void klib_memmove_op(size_t size) { memmove(dest + 8, dest, size); }
+static void libc_memmove_op(size_t size) { libc_memmove(dest + 8, dest, size); }
+static void klib_memset16_op(size_t size) { memset16((uint16_t *)dest, 0x1F20, size / 2); }
+static void klib_strlen_op(size_t size) { sink = strlen(text + MAX_SIZE - size); }
+static void libc_strlen_op(size_t size) { sink = libc_strlen(text + MAX_SIZE - size); }
+static void klib_strcmp_op(size_t size) { sink = strcmp(text + MAX_SIZE - size, text2 + MAX_SIZE - size); }
+static void libc_strcmp_op(size_t size) { sink = libc_strcmp(text + MAX_SIZE - size, text2 + MAX_SIZE - size); }
+
+typedef struct {
+    const char *name;
+    bench_fn klib;
+    bench_fn libc; // NULL when the C library has no equivalent
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    { "memcpy", klib_memcpy_op, libc_memcpy_op },
+    { "memcpy unaligned", klib_memcpy_unaligned_op, libc_memcpy_unaligned_op },
+    { "memset", klib_memset_op, libc_memset_op },
+    { "memmove backward", klib_memmove_op, libc_memmove_op },
+    { "memset16", klib_memset16_op, NULL },
+    { "strlen", klib_strlen_op, libc_strlen_op },
+    { "strcmp equal", klib_strcmp_op, libc_strcmp_op },
+};
+
+static const size_t sizes[] = { 8, 64, 512, 4096, 65536 };
+
+// Conversions have no size parameter; one row each
+static void bench_conversions(void) {
+    char buffer[32];
+    static const char *const numbers[] = { "7", "-2147483648", "123456" };
+    size_t iterations = 1u << 22;
+
+    double start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        sink = (size_t)atoi(numbers[i % 3]);
+    }
+    printf("%-20s %10s %10.2f\n", "atoi", "-", (now() - start) * 1e9 / iterations);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        itoa((int)(i * 2654435761u), buffer, 10);
+        sink = (size_t)buffer[0];
+    }
+    printf("%-20s %10s %10.2f\n", "itoa", "-", (now() - start) * 1e9 / iterations);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        sink = ksnprintf(buffer, sizeof(buffer), "Result: %d", (int)i);
+    }
+    printf("%-20s %10s %10.2f\n", "ksnprintf %d", "-", (now() - start) * 1e9 / iterations);
+
+    start = now();
+    for (size_t i = 0; i < iterations; i++) {
+        sink = ksnprintf(buffer, sizeof(buffer), "%6u%7u%9llu", (unsigned)i, 42u, (unsigned long long)i << 20);
+    }
+    printf("%-20s %10s %10.2f\n", "ksnprintf columns", "-", (now() - start) * 1e9 / iterations);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        min_seconds = atof(argv[1]) / 1000.0;
+    }
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = (unsigned char)i;
+    }
+    libc_memset(text, 'a', MAX_SIZE);
+    libc_memset(text2, 'a', MAX_SIZE);
+    text[MAX_SIZE] = text2[MAX_SIZE] = '\0';
+
+    mem_init();
+    printf("klib memcpy variant: %s\n", memcpy_variant);
+    printf("%-20s %10s %10s %10s\n", "benchmark", "bytes", "klib ns", "libc ns");
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            const Benchmark *bench = &benchmarks[b];
+            printf("%-20s %10zu %10.2f", bench->name, sizes[s], ns_per_op(bench->klib, sizes[s]));
+            if (bench->libc) {
+                printf(" %10.2f\n", ns_per_op(bench->libc, sizes[s]));
+            } else {
+                printf(" %10s\n", "-");
+            }
+        }
+    }
+    bench_conversions();
+    return 0;
+}
@@ -0,0 +1,318 @@
+// Host unit tests for klib.c, checked against the C library where the
+// behaviour should match. Build and run with `make -C tests test`.
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+// The C library's versions, taken before klib.h renames the symbols
+static size_t (*libc_strlen)(const char *) = strlen;
+static int (*libc_strcmp)(const char *, const char *) = strcmp;
+static int (*libc_strncmp)(const char *, const char *, size_t) = strncmp;
+
+#include "klib.h"
+
+static int failures = 0;
+static int checks = 0;
+
+#define CHECK(cond) do { \
+    checks++; \
+    if (!(cond)) { \
+        failures++; \
+        printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+#define CHECK_STR(actual, expected) do { \
+    checks++; \
+    if (libc_strcmp((actual), (expected)) != 0) { \
+        failures++; \
+        printf("%s:%d: got \"%s\", expected \"%s\"\n", __FILE__, __LINE__, (actual), (expected)); \
+    } \
+} while (0)
+
+static int sign(int value) {
+    return (value > 0) - (value < 0);
+}
+
+static void test_atoi(void) {
+    CHECK(atoi("0") == 0);
+    CHECK(atoi("42") == 42);
+    CHECK(atoi("-42") == -42);
+    CHECK(atoi("+7") == 7);
+    CHECK(atoi("12abc") == 12);
+    CHECK(atoi("") == 0);
+    CHECK(atoi("-") == 0);
+    CHECK(atoi("2147483647") == INT_MAX);
+    CHECK(atoi("-2147483648") == INT_MIN);
+}
+
+static void test_itoa(void) {
+    char buffer[40];
+    itoa(0, buffer, 10);
+    CHECK_STR(buffer, "0");
+    itoa(12345, buffer, 10);
+    CHECK_STR(buffer, "12345");
+    itoa(-12345, buffer, 10);
+    CHECK_STR(buffer, "-12345");
+    itoa(INT_MAX, buffer, 10);
+    CHECK_STR(buffer, "2147483647");
+    itoa(INT_MIN, buffer, 10);
+    CHECK_STR(buffer, "-2147483648");
+    itoa(255, buffer, 16);
+    CHECK_STR(buffer, "FF");
+    itoa(-1, buffer, 16);
+    CHECK_STR(buffer, "FFFFFFFF");
+    itoa(5, buffer, 2);
+    CHECK_STR(buffer, "101");
+
+    utoa(0, buffer, 10);
+    CHECK_STR(buffer, "0");
+    utoa(UINT_MAX, buffer, 10);
+    CHECK_STR(buffer, "4294967295");
+    utoa(0xC0DE0000u, buffer, 16);
+    CHECK_STR(buffer, "C0DE0000");
+}
+
+// Each case is formatted by ksnprintf and by the C library's snprintf
+#define CHECK_FORMAT(...) do { \
+    char actual[128], expected[128]; \
+    size_t actual_length = ksnprintf(actual, sizeof(actual), __VA_ARGS__); \
+    int expected_length = snprintf(expected, sizeof(expected), __VA_ARGS__); \
+    CHECK_STR(actual, expected); \
+    CHECK(actual_length == (size_t)expected_length); \
+} while (0)
+
+static void test_ksnprintf(void) {
+    CHECK_FORMAT("plain text");
+    CHECK_FORMAT("Player %c wins!", 'X');
+    CHECK_FORMAT("Result: %d", -7);
+    CHECK_FORMAT("%d %d %d", 0, INT_MAX, INT_MIN);
+    CHECK_FORMAT("%i", -42);
+    CHECK_FORMAT("%u %u", 0u, UINT_MAX);
+    CHECK_FORMAT("%x %X %x", 0xDEADBEEFu, 0xDEADBEEFu, 0u);
+    CHECK_FORMAT("%lld %lld", LLONG_MAX, LLONG_MIN);
+    CHECK_FORMAT("%llu %llx", ULLONG_MAX, 0x123456789ABCDEFull);
+    CHECK_FORMAT("%ld %lu", -5L, 5UL);
+    CHECK_FORMAT("%zu", (size_t)123456);
+    CHECK_FORMAT("%s and %s", "this", "that");
+    CHECK_FORMAT("100%%");
+    CHECK_FORMAT("[%5u.%06u]", 12u, 345u);
+    CHECK_FORMAT("[%-6s|%6s]", "ab", "cd");
+    CHECK_FORMAT("[%08X] [%-8x] [%8d] [%08d]", 0xBEEFu, 0xBEEFu, -123, -123);
+    CHECK_FORMAT("[%*d] [%-*d]", 6, 42, 6, 42);
+    CHECK_FORMAT("[%3s]", "longer than width");
+    CHECK_FORMAT("[%.3s] [%.*s] [%8.2s]", "abcdef", 2, "xyz", "abc");
+    CHECK_FORMAT("%6u%7u%8u%9u%9u%7u", 16u, 2u, 300u, 1000u, 700u, 12u);
+
+    // %p: "0x" and every digit of a pointer
+    char buffer[64];
+    ksnprintf(buffer, sizeof(buffer), "%p", (void *)0x1234);
+    CHECK_STR(buffer, sizeof(void *) == 8 ? "0x0000000000001234" : "0x00001234");
+
+    // Truncation keeps size - 1 characters, always terminates and still
+    // returns the full length
+    memset(buffer, '#', sizeof(buffer));
+    CHECK(ksnprintf(buffer, 6, "Result: %d", 1234) == 12);
+    CHECK_STR(buffer, "Resul");
+    CHECK(buffer[6] == '#');
+    CHECK(ksnprintf(buffer, 10, "ab%scd", "0123456789") == 14);
+    CHECK_STR(buffer, "ab0123456");
+    CHECK(ksnprintf(buffer, 1, "anything") == 8);
+    CHECK_STR(buffer, "");
+
+    // size 0 only measures
+    memset(buffer, '#', sizeof(buffer));
+    CHECK(ksnprintf(NULL, 0, "%d", 12345) == 5);
+    CHECK(ksnprintf(buffer, 0, "anything") == 8);
+    CHECK(buffer[0] == '#');
+}
+
+static void test_div_u64_u32(void) {
+    uint32_t remainder;
+    CHECK(div_u64_u32(1000000007ull * 3 + 2, 3, &remainder) == 1000000007ull && remainder == 2);
+    CHECK(div_u64_u32(0xFFFFFFFFFFFFFFFFull, 10, &remainder) == 1844674407370955161ull && remainder == 5);
+    CHECK(div_u64_u32(5, 7, NULL) == 0);
+}
+
+static void test_strlen(void) {
+    // Every start alignment and length around the word size, with junk
+    // after the terminator so reading past it would be noticed
+    char buffer[96];
+    for (size_t start = 0; start < 8; start++) {
+        for (size_t length = 0; length < 64; length++) {
+            memset(buffer, 'x', sizeof(buffer));
+            buffer[start + length] = '\0';
+            CHECK(strlen(buffer + start) == length);
+        }
+    }
+    CHECK(strlen("\x80\xff") == 2);
+}
+
+static void test_strcmp(void) {
+    CHECK(strcmp("", "") == 0);
+    CHECK(strcmp("abc", "abc") == 0);
+    CHECK(strcmp("abc", "abd") < 0);
+    CHECK(strcmp("abd", "abc") > 0);
+    CHECK(strcmp("ab", "abc") < 0);
+    CHECK(strcmp("abc", "ab") > 0);
+    // Bytes compare as unsigned char
+    CHECK(strcmp("\x80", "a") > 0);
+
+    const char *words[] = { "", "a", "ab", "abc", "abd", "b", "\xff", "help", "helpme" };
+    size_t count = sizeof(words) / sizeof(words[0]);
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < count; j++) {
+            CHECK(sign(strcmp(words[i], words[j])) == sign(libc_strcmp(words[i], words[j])));
+            for (size_t n = 0; n < 8; n++) {
+                CHECK(sign(strncmp(words[i], words[j], n)) == sign(libc_strncmp(words[i], words[j], n)));
+            }
+        }
+    }
+}
+
+static void test_strncmp(void) {
+    CHECK(strncmp("abc", "abd", 0) == 0);
+    CHECK(strncmp("abc", "abd", 2) == 0);
+    CHECK(strncmp("abc", "abd", 3) < 0);
+    // The shorter string ends inside the first n characters
+    CHECK(strncmp("ab", "abc", 5) < 0);
+    CHECK(strncmp("abc", "ab", 5) > 0);
+    CHECK(strncmp("ab", "ab", 5) == 0);
+    // Differences after both strings end are never looked at
+    CHECK(strncmp("ab\0x", "ab\0y", 4) == 0);
+    // The command lookup prefix compare
+    CHECK(strncmp("help", "helpme", 4) == 0);
+}
+
+static void test_strncpy(void) {
+    char buffer[8];
+    memset(buffer, '#', sizeof(buffer));
+    strncpy(buffer, "ab", 6);
+    CHECK(libc_strcmp(buffer, "ab") == 0);
+    CHECK(buffer[5] == '\0' && buffer[6] == '#');
+    memset(buffer, '#', sizeof(buffer));
+    strncpy(buffer, "abcdef", 3);
+    CHECK(buffer[0] == 'a' && buffer[2] == 'c' && buffer[3] == '#');
+}
+
+static void test_strchr(void) {
+    const char *text = "set x=1";
+    CHECK(strchr(text, '=') == text + 5);
+    CHECK(strchr(text, 's') == text);
+    CHECK(strchr(text, '?') == NULL);
+    CHECK(strchr(text, '\0') == text + libc_strlen(text));
+    CHECK(strchr("", 'a') == NULL);
+}
+
+// Copy every size and alignment pair and compare with a byte-by-byte model
+static void test_memcpy(void) {
+    static unsigned char src[600], dest[600], expected[600];
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = (unsigned char)(i * 7 + 3);
+    }
+    size_t sizes[] = { 0, 1, 2, 3, 4, 5, 7, 8, 15, 16, 31, 63, 64, 65, 127, 128, 255, 512 };
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        for (size_t src_off = 0; src_off < 4; src_off++) {
+            for (size_t dest_off = 0; dest_off < 4; dest_off++) {
+                size_t n = sizes[k];
+                for (size_t i = 0; i < sizeof(dest); i++) {
+                    dest[i] = expected[i] = 0xEE;
+                }
+                for (size_t i = 0; i < n; i++) {
+                    expected[dest_off + i] = src[src_off + i];
+                }
+                CHECK(memcpy(dest + dest_off, src + src_off, n) == dest + dest_off);
+                CHECK(memcmp(dest, expected, sizeof(dest)) == 0);
+            }
+        }
+    }
+}
+
+static void test_memset(void) {
+    static unsigned char buffer[600];
+    size_t sizes[] = { 0, 1, 3, 4, 5, 8, 31, 64, 65, 511 };
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        for (size_t off = 0; off < 4; off++) {
+            size_t n = sizes[k];
+            for (size_t i = 0; i < sizeof(buffer); i++) {
+                buffer[i] = 0xEE;
+            }
+            CHECK(memset(buffer + off, 0x1A5, n) == buffer + off); // Only the low byte counts
+            bool ok = true;
+            for (size_t i = 0; i < sizeof(buffer); i++) {
+                unsigned char want = (i >= off && i < off + n) ? 0xA5 : 0xEE;
+                ok = ok && buffer[i] == want;
+            }
+            CHECK(ok);
+        }
+    }
+}
+
+// Both overlap directions, including the backwards std/rep path
+static void test_memmove(void) {
+    static unsigned char buffer[300], expected[300];
+    for (size_t n = 0; n < 70; n++) {
+        for (int shift = -9; shift <= 9; shift++) {
+            for (size_t i = 0; i < sizeof(buffer); i++) {
+                buffer[i] = expected[i] = (unsigned char)i;
+            }
+            size_t src = 100, dest = (size_t)(100 + shift);
+            for (size_t i = 0; i < n; i++) {
+                expected[dest + i] = (unsigned char)(src + i);
+            }
+            CHECK(memmove(buffer + dest, buffer + src, n) == buffer + dest);
+            CHECK(memcmp(buffer, expected, sizeof(buffer)) == 0);
+        }
+    }
+    // The direction flag must be clear again afterwards
+    unsigned long flags;
+    memmove(buffer + 10, buffer, 64);
+    __asm__ __volatile__("pushf; pop %0" : "=r"(flags));
+    CHECK((flags & 0x400) == 0);
+}
+
+static void test_memset16(void) {
+    static uint16_t cells[200];
+    for (size_t start = 0; start < 4; start++) {
+        for (size_t count = 0; count < 90; count++) {
+            for (size_t i = 0; i < 200; i++) {
+                cells[i] = 0xEEEE;
+            }
+            memset16(cells + start, 0x1F20, count);
+            bool ok = true;
+            for (size_t i = 0; i < 200; i++) {
+                uint16_t want = (i >= start && i < start + count) ? 0x1F20 : 0xEEEE;
+                ok = ok && cells[i] == want;
+            }
+            CHECK(ok);
+        }
+    }
+}
+
+int main(void) {
+    test_atoi();
+    test_itoa();
+    test_ksnprintf();
+    test_div_u64_u32();
+    test_strlen();
+    test_strcmp();
+    test_strncmp();
+    test_strncpy();
+    test_strchr();
+
+    // The memory tests run once on the byte loops, once on the CPU's variant
+    const char *variants[2];
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            mem_init();
+        }
+        variants[pass] = memcpy_variant;
+        test_memcpy();
+        test_memset();
+        test_memmove();
+        test_memset16();
+    }
+
+    printf("klib: %d checks, %d failures (memcpy: %s, %s)\n", checks, failures, variants[0], variants[1]);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,245 @@
+#!/usr/bin/env python3
+"""Build DubrDOS, boot it headless in QEMU and benchmark it.
+
+The kernel is driven entirely over the serial console:
+
+  * boot-to-prompt time: host wall clock until the "boot: ready" kernel
+    log line, plus the kernel's own figure from that line
+  * per-command latency: after `bench ack on` the kernel reports every
+    command's execution time as an "ACK <us>" line
+  * scroll throughput: `bench scroll N` reports "BENCH scroll <us>"
+
+Finally `exit` leaves QEMU through the isa-debug-exit device.
+
+Results are written as JSON. With --baseline, any metric more than
+--threshold slower than the baseline fails the run with exit status 1.
+Harness problems (build failure, timeout, wrong exit code) give 2.
+
+Examples:
+    tools/bench.py --output results.json
+    tools/bench.py --baseline results.json --threshold 0.10
+    CC=i686-elf-gcc LD=i686-elf-ld tools/bench.py --repeat 20
+"""
+
+import argparse
+import json
+import os
+import queue
+import re
+import shlex
+import statistics
+import subprocess
+import sys
+import threading
+import time
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+DEFAULT_COMMANDS = ["help", "meminfo", "cpuinfo", "uptime", "calc 6 * 7", "createvar bench 1", "showvars"]
+QEMU_EXIT_SUCCESS = (0 << 1) | 1  # isa-debug-exit status for `exit 0`
+
+READY = re.compile(r"boot: ready after (\d+) us")
+ACK = re.compile(r"^ACK (\d+\.\d+)$")
+SCROLL = re.compile(r"^BENCH scroll (\d+\.\d+)$")
+
+
+class HarnessError(Exception):
+    pass
+
+
+def tool(name, default):
+    return shlex.split(os.environ.get(name, default))
+
+
+def build(out_dir):
+    """The README recipe, with the tools overridable through the environment."""
+    os.makedirs(out_dir, exist_ok=True)
+    obj = lambda name: os.path.join(out_dir, name)
+    cflags = shlex.split(os.environ.get("CFLAGS", "-m32 -O2 -ffreestanding -fno-pic -fno-stack-protector -nostdlib"))
+    steps = [
+        tool("AS", "nasm") + ["-f", "elf32", "kernel.asm", "-o", obj("kasm.o")],
+        tool("CC", "gcc") + cflags + ["-c", "kernel.c", "-o", obj("kc.o")],
+        tool("CC", "gcc") + cflags + ["-c", "klib.c", "-o", obj("klib.o")],
+        tool("LD", "ld") + ["-T", "link.ld", "-o", obj("k"), obj("kasm.o"), obj("kc.o"), obj("klib.o"),
+                            "-build-id=none", "-Map", obj("kernel.map")],
+        tool("OBJCOPY", "objcopy") + ["-O", "elf32-i386", obj("k"), obj("kernel-5")],
+    ]
+    for step in steps:
+        print("+ " + " ".join(shlex.quote(arg) for arg in step), file=sys.stderr)
+        if subprocess.run(step, cwd=REPO).returncode != 0:
+            raise HarnessError("build step failed: " + step[0])
+    return obj("kernel-5")
+
+
+class Guest:
+    """A QEMU process whose serial port is our stdin/stdout pipe."""
+
+    def __init__(self, command, verbose):
+        self.verbose = verbose
+        self.lines = queue.Queue()
+        self.process = subprocess.Popen(command, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                        stderr=subprocess.DEVNULL)
+        threading.Thread(target=self._read, daemon=True).start()
+
+    def _read(self):
+        for raw in self.process.stdout:
+            line = raw.decode("latin-1").strip("\r\n")
+            if self.verbose:
+                print("serial: " + line, file=sys.stderr)
+            self.lines.put(line)
+        self.lines.put(None)
+
+    def expect(self, pattern, timeout):
+        deadline = time.monotonic() + timeout
+        while True:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                raise HarnessError("timed out waiting for /%s/" % pattern.pattern)
+            try:
+                line = self.lines.get(timeout=remaining)
+            except queue.Empty:
+                continue
+            if line is None:
+                raise HarnessError("QEMU exited while waiting for /%s/" % pattern.pattern)
+            match = pattern.search(line)
+            if match:
+                return match
+
+    def send(self, command):
+        self.process.stdin.write(command.encode("ascii") + b"\r")
+        self.process.stdin.flush()
+
+    def run(self, command, timeout):
+        """Type a command and return (kernel us, host ms) once it is acknowledged."""
+        start = time.monotonic()
+        self.send(command)
+        kernel_us = float(self.expect(ACK, timeout).group(1))
+        return kernel_us, (time.monotonic() - start) * 1000.0
+
+    def close(self, timeout):
+        try:
+            return self.process.wait(timeout=timeout)
+        except subprocess.TimeoutExpired:
+            self.process.kill()
+            raise HarnessError("QEMU did not exit")
+
+
+def summarize(values):
+    return {
+        "samples": len(values),
+        "median": statistics.median(values),
+        "min": min(values),
+        "max": max(values),
+    }
+
+
+def benchmark(args, kernel):
+    qemu = tool("QEMU", args.qemu) + [
+        "-kernel", kernel, "-m", str(args.memory), "-display", "none", "-monitor", "none",
+        "-serial", "stdio", "-no-reboot", "-device", "isa-debug-exit,iobase=0xf4,iosize=0x01",
+    ]
+    start = time.monotonic()
+    guest = Guest(qemu, args.verbose)
+    try:
+        ready = guest.expect(READY, args.timeout)
+        results = {
+            "boot": {"host_ms": (time.monotonic() - start) * 1000.0, "kernel_us": int(ready.group(1))},
+            "commands": {},
+        }
+
+        guest.send("bench ack on")
+        guest.expect(ACK, args.timeout)
+        for command in args.command or DEFAULT_COMMANDS:
+            kernel_us, host_ms = [], []
+            for _ in range(args.repeat):
+                k, h = guest.run(command, args.timeout)
+                kernel_us.append(k)
+                host_ms.append(h)
+            results["commands"][command] = {"kernel_us": summarize(kernel_us), "host_ms": summarize(host_ms)}
+
+        guest.send("bench scroll %d" % args.scroll_lines)
+        scroll_us = float(guest.expect(SCROLL, args.timeout).group(1))
+        guest.expect(ACK, args.timeout)
+        results["scroll"] = {
+            "lines": args.scroll_lines,
+            "us": scroll_us,
+            "lines_per_sec": args.scroll_lines / (scroll_us / 1e6) if scroll_us else None,
+        }
+
+        guest.send("exit 0")
+        status = guest.close(args.timeout)
+    except BaseException:
+        if guest.process.poll() is None:
+            guest.process.kill()
+        raise
+    if status != QEMU_EXIT_SUCCESS:
+        raise HarnessError("QEMU exit status %d, expected %d" % (status, QEMU_EXIT_SUCCESS))
+    return results
+
+
+def metrics(results):
+    """Lower-is-better numbers compared against a baseline."""
+    found = {"boot.kernel_us": results["boot"]["kernel_us"], "scroll.us": results["scroll"]["us"]}
+    for command, data in results["commands"].items():
+        found["command[%s].median_us" % command] = data["kernel_us"]["median"]
+    return found
+
+
+def compare(baseline, results, threshold):
+    old, new = metrics(baseline), metrics(results)
+    regressions = []
+    for name in sorted(new):
+        if name not in old or not old[name]:
+            continue
+        change = new[name] / old[name] - 1.0
+        flag = "REGRESSION" if change > threshold else ""
+        print("%-40s %12.3f -> %12.3f  %+7.1f%%  %s" % (name, old[name], new[name], change * 100, flag))
+        if flag:
+            regressions.append(name)
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--build-dir", default=os.path.join(REPO, "build"))
+    parser.add_argument("--no-build", action="store_true", help="use the kernel already in --build-dir")
+    parser.add_argument("--qemu", default="qemu-system-i386")
+    parser.add_argument("--memory", type=int, default=128, help="guest RAM in MB")
+    parser.add_argument("--command", action="append", help="command to time (repeatable)")
+    parser.add_argument("--repeat", type=int, default=10, help="runs per command")
+    parser.add_argument("--scroll-lines", type=int, default=1000)
+    parser.add_argument("--timeout", type=float, default=30.0, help="seconds to wait for each step")
+    parser.add_argument("--output", help="write results JSON here (default: stdout)")
+    parser.add_argument("--baseline", help="results JSON to compare against")
+    parser.add_argument("--threshold", type=float, default=0.10, help="allowed slowdown, 0.10 = 10%%")
+    parser.add_argument("--verbose", action="store_true", help="echo the serial console")
+    args = parser.parse_args()
+
+    try:
+        if args.no_build:
+            kernel = os.path.join(args.build_dir, "kernel-5")
+        else:
+            kernel = build(args.build_dir)
+        results = benchmark(args, kernel)
+    except HarnessError as error:
+        print("bench: " + str(error), file=sys.stderr)
+        return 2
+
+    text = json.dumps(results, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(json.load(f), results, args.threshold)
+        if regressions:
+            print("bench: %d metric(s) regressed by more than %.0f%%" % (len(regressions), args.threshold * 100),
+                  file=sys.stderr)
+            return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
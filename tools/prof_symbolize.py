@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""Resolve DubrDOS profiler samples to kernel functions.
+
+Run `prof start`, the workload, `prof stop` and `prof dump` in the
+kernel with the serial port captured (e.g. qemu -serial file:serial.log),
+then:
+
+    tools/prof_symbolize.py kernel.map serial.log
+
+The symbol file is either the linker map (ld -Map kernel.map) or
+`nm -n k` output. Only nm lists static functions, so use it when the
+map attributes samples to the wrong neighbour.
+"""
+
+import argparse
+import bisect
+import re
+import sys
+from collections import Counter
+
+MAP_SYMBOL = re.compile(r"^\s+0x([0-9a-fA-F]+)\s+([A-Za-z_.$][\w.$@]*)\s*$")
+NM_SYMBOL = re.compile(r"^([0-9a-fA-F]+)\s+[tTwW]\s+(\S+)\s*$")
+SAMPLE = re.compile(r"PROF\s+0x([0-9a-fA-F]+)\s+(\d+)")
+
+
+def load_symbols(path):
+    symbols = {}
+    with open(path, errors="replace") as f:
+        for line in f:
+            match = MAP_SYMBOL.match(line) or NM_SYMBOL.match(line)
+            if match:
+                address = int(match.group(1), 16)
+                name = match.group(2)
+                # pei-i386 prefixes C symbols with an underscore
+                symbols.setdefault(address, name[1:] if name.startswith("_") else name)
+    addresses = sorted(symbols)
+    return addresses, [symbols[a] for a in addresses]
+
+
+def load_samples(stream):
+    samples = Counter()
+    for line in stream:
+        match = SAMPLE.search(line)
+        if match:
+            samples[int(match.group(1), 16)] += int(match.group(2))
+    return samples
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("symbols", help="linker map or nm -n output")
+    parser.add_argument("capture", nargs="?", help="serial log (default: stdin)")
+    parser.add_argument("-n", "--top", type=int, default=20, help="functions to show")
+    args = parser.parse_args()
+
+    addresses, names = load_symbols(args.symbols)
+    if args.capture:
+        with open(args.capture, errors="replace") as f:
+            samples = load_samples(f)
+    else:
+        samples = load_samples(sys.stdin)
+    total = sum(samples.values())
+    if not total:
+        sys.exit("no PROF lines found")
+
+    functions = Counter()
+    for eip, count in samples.items():
+        index = bisect.bisect_right(addresses, eip) - 1
+        functions[names[index] if index >= 0 else "0x%08x" % eip] += count
+
+    print("%8s %6s  %s" % ("samples", "%", "function"))
+    for name, count in functions.most_common(args.top):
+        print("%8d %5.1f%%  %s" % (count, 100.0 * count / total, name))
+
+
+if __name__ == "__main__":
+    main()